@@ -5,9 +5,12 @@
 ; PURPOSE:
 ;   Defines a structure which controls tomography reconstruction parameters for tomo_recon.
 ;   This structure is passed directly to the C++ code in the shareable library.
+;   The fields up to sinogramInput must be in the same order and have the same types as tomoParams_t in tomoRecon.h.
+;   The fields after sinogramInput are only used by IDL.
 ;
 ; MODIFICATION HISTORY:
 ;   Written by:     Mark Rivers, August 1, 2012
+;   Reordered to match tomoParams_t and added the fields from ringMethod to sinogramInput for R2-0.
 ;-
 
 pro tomo_params__define 
@@ -17,23 +20,19 @@ pro tomo_params__define
     numPixels: 0L,           $ ; Number of pixels in sinogram row before padding
     numProjections: 0L,      $ ; Number of angles
     numSlices: 0L,           $ ; Number of slices
+    inputDataType: 0L,       $ ; 0=Float32, 1=UInt16, 2=UInt8, 3=UInt12Packed
+    outputDataType: 0L,      $ ; 0=Float32, 1=UInt16, 2=Int16
     sinoScale: 1/10000.,     $ ; Scale factor to multiply sinogram when airPixels=0
     reconScale: 1.e6,        $ ; Scale factor to multiple reconstruction
+    reconOffset: 0.,         $ ; Offset to add to reconstruction
     paddedSinogramWidth: 0L, $ ; Number of pixels in sinogram after padding
     paddingAverage: 0L,      $ ; Number of pixels to average on each side of sinogram to compute padding. 0 pixels pads with 0.0 
     airPixels: 0L,           $ ; Number of pixels of air to average at each end of sinogram row
     ringWidth: 0L,           $ ; Number of pixels to smooth by when removing ring artifacts
     fluorescence: 0L,        $ ; 0=absorption data, 1=fluorescence
     
-    ; Reconstruction method
-    reconMethod: 0L,         $ ; 0=tomoRecon, 1=Gridrec, 2=Backproject
-    reconMethodTomoRecon:   0L, $
-    reconMethodGridrec:     1L, $
-    reconMethodBackproject: 2L, $
-    
     ; tomoRecon parameters
     numThreads: 0L, $
-    slicesPerChunk: 0L, $
     debug: 0L, $
     debugFile: bytarr(256), $
     
@@ -48,6 +47,26 @@ pro tomo_params__define
     Y0: 0.,             $ ; in units of center-to-edge distance.
     ltbl: 0L,           $ ; No. elements in convolvent lookup tables
     GR_filterName: bytarr(16),  $ ; Name of filter function
+
+    ; tomoRecon parameters added in R2-0.  0 selects the previous behaviour for each of them.
+    ringMethod: 0L,     $ ; 0=smooth the average row, 1=median filter the column-sorted sinogram
+    tiltAngle: 0.,      $ ; Tilt of the rotation axis in the detector plane in degrees
+    offsetAxis: 0L,     $ ; 1 for 360 degree offset-axis data; the output is [2*numPixels, 2*numPixels, numSlices]
+    maxChunks: 0L,      $ ; Maximum number of chunks in flight; 0 selects 2
+    gridCacheSize: 0L,  $ ; Number of geometries whose grid objects are kept; 0 selects 4
+    pinThreads: 0L,     $ ; 1 to pin the pool threads to CPUs spread over the NUMA nodes
+    memoryBudget: 0.,   $ ; Memory in MB that the reconstruction may use; 0 for no limit
+    hugePages: 0L,      $ ; 0=normal pages, 1=transparent huge pages, 2=explicit huge pages
+    priorityClass: 0L,  $ ; 0=batch, 1=interactive
+    fftwRigor: 0L,      $ ; 0=machine profile or measure, 1=estimate, 2=measure, 3=patient
+    sinogramInput: 0L,  $ ; 1 if the input is [numPixels, numProjections, numSlices]
+    
+    ; Reconstruction method
+    reconMethod: 0L,         $ ; 0=tomoRecon, 1=Gridrec, 2=Backproject
+    reconMethodTomoRecon:   0L, $
+    reconMethodGridrec:     1L, $
+    reconMethodBackproject: 2L, $
+    slicesPerChunk: 0L, $
     
     ; Backproject parameters
     BP_Method: 0L,         $ ; 0=Riemann, 1=Radon
@@ -59,8 +78,8 @@ pro tomo_params__define
     RiemannInterpolationNone:     0L, $
     RiemannInterpolationBilinear: 1L, $
     RiemannInterpolationCubic:    2L, $
-    RadonInterpolation: 0L,  $ ; 0=none, 1=linear
-    RadonInterpolationNone:     0L, $
-    RadonInterpolationLinear:   1L  $
+    RadonInterpolation: 0L,  $ ; 0=none, 1=linear
+    RadonInterpolationNone:     0L, $
+    RadonInterpolationLinear:   1L  $
   }
 end
@@ -0,0 +1,53 @@
+;+
+; NAME:
+;   TOMO_PREPROCESS_PARAMS__DEFINE
+;
+; PURPOSE:
+;   Defines a structure which controls tomography preprocessing parameters for the tomoPreprocess
+;   and tomoPipeline functions in the shareable library.
+;   This structure is passed directly to the C++ code in the shareable library, so the fields must be in
+;   the same order and have the same types as preprocessParamsStruct in tomoPreprocess.h.
+;   Pass long(n_tags(preprocessParams, /length)) to tomoPreprocessParamsSizeIDL before calling tomoPreprocessCreateIDL,
+;   otherwise only the fields before zingerMode are used.
+;
+; MODIFICATION HISTORY:
+;   Written for R2-0.
+;-
+
+pro tomo_preprocess_params__define 
+  t = {tomo_preprocess_params, $
+
+    ; Dimensions
+    numPixels: 0L,           $ ; Number of pixels in each row of a projection
+    numSlices: 0L,           $ ; Number of rows (slices) in each projection
+    numProjections: 0L,      $ ; Number of projections
+    numThreads: 0L,          $ ; Number of pool threads to use
+
+    ; Normalization and zinger removal
+    zingerWidth: 0L,         $ ; Width of the median window for zinger removal; 0 disables zinger removal
+    zingerThreshold: 0.,     $ ; Ratio of a pixel to the median above which it is a zinger
+    scaleFactor: 1.,         $ ; Scale factor to multiply the normalized data by
+    outputDataType: 0L,      $ ; 0=Float32, 1=UInt16, 3=Float16
+    debug: 0L,               $ ; 0=only error messages, 1=debugging messages
+    debugFile: bytarr(256),  $ ; Name of file for debugging output; "" for stdout
+    zingerMode: 0L,          $ ; 0=median of non-overlapping blocks, 1=median of the window centered on each pixel
+
+    ; Output layout
+    sinogramOutput: 0L,      $ ; 1 to write [numPixels, numProjections, numSlices]
+    takeLog: 0L,             $ ; 1 to write -log((input-dark)/flat)*scaleFactor
+    bandRows: 0L,            $ ; Number of rows in each work item; 0 selects automatically
+
+    ; Paganin phase retrieval
+    phaseRetrieval: 0L,      $ ; 1 to apply Paganin phase retrieval to each projection
+    pixelSize: 0.,           $ ; Detector pixel size in cm
+    propagationDistance: 0., $ ; Sample to detector distance in cm
+    energy: 0.,              $ ; X-ray energy in keV
+    deltaOverBeta: 0.,       $ ; Ratio of delta to beta of the sample
+
+    ; Raw data type
+    inputDataType: 0L,       $ ; 0=UInt16, 1=UInt8, 2=UInt32
+
+    ; FFTW planning rigor for phaseRetrieval
+    fftwRigor: 0L            $ ; 0 or 1=estimate, 2=measure, 3=patient
+  }
+end
@@ -84,6 +84,93 @@ pro tomo_recon_poll, reconComplete, slicesRemaining
                       slicesRemaining)
 end
 
+;+
+; NAME:
+;   TOMO_RECON_WAIT
+;
+; PURPOSE:
+;   Waits for the reconstruction started by tomo_recon with WAIT=0 to complete.
+;   This blocks in the tomoRecon object until the last slice is done, rather than polling.
+;
+;   This file uses CALL_EXTERNAL to call tomoReconIDL.cpp which is a thin
+;   wrapper to tomoRecon.cpp. 
+;
+; CATEGORY:
+;   Tomography data processing
+;
+; CALLING SEQUENCE:
+;   tomo_recon_wait, reconComplete
+;
+; KEYWORD PARAMETERS:
+;   TIMEOUT:
+;       Maximum time to wait in seconds.  The default is -1, which waits until the reconstruction is complete.
+;
+; OUTPUTS:
+;   reconComplete:
+;       reconComplete=1 if the reconstruction is complete, 0 if the timeout expired first.
+;
+; COMMON BLOCKS:
+;	  TOMO_RECON_COMMON:
+;       This common block is used to hold the name of the shareable library that is called from IDL.	
+;
+; PROCEDURE:
+;   This function uses CALL_EXTERNAL to call the shareable library.
+;   libtomoRecon.so (Linux)  or tomoRecon.dll (Windows), which is written in C++.
+;
+; EXAMPLE:
+;   TOMO_RECON_WAIT, reconComplete, timeout=10
+;-
+pro tomo_recon_wait, reconComplete, timeout=timeout
+    common tomo_recon_common, tomo_recon_shareable_library
+
+    if (n_elements(timeout) eq 0) then timeout = -1.
+    reconComplete = 0L
+    t = call_external(tomo_recon_shareable_library, 'tomoReconWaitIDL', $
+                      float(timeout), $
+                      reconComplete)
+end
+
+;+
+; NAME:
+;   TOMO_RECON_CANCEL
+;
+; PURPOSE:
+;   Cancels the reconstruction started by tomo_recon with WAIT=0.  The slices that are being reconstructed
+;   are finished, and the others are not reconstructed.  The tomoRecon object is kept, so tomo_recon can
+;   then be called again with CREATE=0.
+;
+;   This file uses CALL_EXTERNAL to call tomoReconIDL.cpp which is a thin
+;   wrapper to tomoRecon.cpp. 
+;
+; CATEGORY:
+;   Tomography data processing
+;
+; CALLING SEQUENCE:
+;   tomo_recon_cancel, numCancelled
+;
+; OUTPUTS:
+;   numCancelled:
+;       The number of slices that were not reconstructed.
+;
+; COMMON BLOCKS:
+;	  TOMO_RECON_COMMON:
+;       This common block is used to hold the name of the shareable library that is called from IDL.	
+;
+; PROCEDURE:
+;   This function uses CALL_EXTERNAL to call the shareable library.
+;   libtomoRecon.so (Linux)  or tomoRecon.dll (Windows), which is written in C++.
+;
+; EXAMPLE:
+;   TOMO_RECON_CANCEL, numCancelled
+;-
+pro tomo_recon_cancel, numCancelled
+    common tomo_recon_common, tomo_recon_shareable_library
+
+    numCancelled = 0L
+    t = call_external(tomo_recon_shareable_library, 'tomoReconCancelIDL', $
+                      numCancelled)
+end
+
 ;+
 ; NAME:
 ;   TOMO_RECON
@@ -112,7 +199,8 @@ end
 ;
 ; OUTPUTS:
 ;   Output:
-;       A FLOAT array of reconstructed slices, dimensions [numPixels, numPixels, numSlices].
+;       A FLOAT array of reconstructed slices, dimensions [numPixels, numPixels, numSlices],
+;       or [2*numPixels, 2*numPixels, numSlices] if tomoParams.offsetAxis is 1.
 ;
 ; KEYWORD PARAMETERS:
 ;   CREATE:
@@ -188,14 +276,19 @@ pro tomo_recon, tomoParams, $
     
     if (n_elements(wait) eq 0) then wait = 1
     
+    imageSize = tomoParams.numPixels
+    if (tomoParams.offsetAxis) then imageSize = 2*imageSize
     output = 0 ; Deallocate any existing array
-    output = fltarr(tomoParams.numPixels, tomoParams.numPixels, tomoParams.numSlices, /nozero)
+    output = fltarr(imageSize, imageSize, tomoParams.numSlices, /nozero)
     
     ; Make sure input is a float array
     tname = size(input, /tname)
     if (tname ne 'FLOAT') then begin
         input = float(input)
     endif
+    ; The input and output are FLOAT arrays
+    tomoParams.inputDataType = 0
+    tomoParams.outputDataType = 0
     t1 = systime(1)
 
     if (n_elements(create) eq 0) then create = 1
@@ -211,9 +304,11 @@ pro tomo_recon, tomoParams, $
 
     locate_tomo_recon_shareable_library
     if (create) then begin
+        ; Pass the size of tomoParams, so the fields that it does not have are set to 0
         t = call_external(tomo_recon_shareable_library, 'tomoReconCreateIDL', $
                       tomoParams, $
-                      angles)
+                      angles, $
+                      long(n_tags(tomoParams, /length)))
     endif
     t = call_external(tomo_recon_shareable_library, 'tomoReconRunIDL', $
                       tomoParams.numSlices, $
@@ -222,13 +317,10 @@ pro tomo_recon, tomoParams, $
                       output)
 
    if (wait) then begin
-        repeat begin
-            tomo_recon_poll, reconComplete, slicesRemaining
-            wait, .01
-        endrep until (reconComplete)
-        t2 = systime(1)
-        print, 'tomo_recon: time to convert to float:', t1-t0
-        print, '                 time to reconstruct:', t2-t1
-        print, '                          total time:', t2-t0
+        tomo_recon_wait, reconComplete
+        t2 = systime(1)
+        print, 'tomo_recon: time to convert to float:', t1-t0
+        print, '                 time to reconstruct:', t2-t1
+        print, '                          total time:', t2-t0
   endif               
 end
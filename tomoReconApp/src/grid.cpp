@@ -68,6 +68,7 @@ grid::grid(grid_struct *GP,sg_struct *SGP, long *imgsiz)
 {
   float C,MaxPixSiz,R,D0,D1;  /* 7/7/98 */
   long itmp;
+  unsigned fftwFlags;
   
   pswf_struct *pswf;
 
@@ -147,7 +148,9 @@ grid::grid(grid_struct *GP,sg_struct *SGP, long *imgsiz)
 
   cproj = (complex *) fftwf_malloc(sizeof(fftwf_complex) * pdim);
   filphase = (complex *) malloc(sizeof(complex) * pdim/2);        
-  HData = (fftwf_complex *) fftwf_malloc(sizeof(fftwf_complex) * M * M);
+  // HData is the largest array and Phase 1 scatters into it, so it benefits most from huge pages
+  HData = (fftwf_complex *) tomoHugePageAlloc(sizeof(fftwf_complex) * M * M, GP->hugePages, &HDataPages);
+  if (HData == 0) HData = (fftwf_complex *) fftwf_malloc(sizeof(fftwf_complex) * M * M);
   H = (complex **) malloc(M * sizeof(complex *));
   H[0] = (complex *) HData;
   for (itmp=1; itmp<M; itmp++) {
@@ -171,8 +174,9 @@ grid::grid(grid_struct *GP,sg_struct *SGP, long *imgsiz)
 
   *imgsiz=M0;
   
-  backward_1d_plan = fftwf_plan_dft_1d(pdim, (fftwf_complex *)cproj, (fftwf_complex *)cproj, FFTW_BACKWARD, FFTW_MEASURE);
-  forward_2d_plan = fftwf_plan_dft_2d(M, M, HData, HData, FFTW_FORWARD, FFTW_MEASURE);
+  fftwFlags = GP->fftwFlags ? GP->fftwFlags : FFTW_MEASURE;
+  backward_1d_plan = fftwf_plan_dft_1d(pdim, (fftwf_complex *)cproj, (fftwf_complex *)cproj, FFTW_BACKWARD, fftwFlags);
+  forward_2d_plan = fftwf_plan_dft_2d(M, M, HData, HData, FFTW_FORWARD, fftwFlags);
 
 }
 
@@ -194,7 +198,8 @@ grid::~grid()
   free(winv);
   free(work);
   free(H);
-  fftwf_free(HData);
+  if (HDataPages.mapSize) tomoHugePageFree(HData, &HDataPages);
+  else fftwf_free(HData);
 }
 
 void grid::logMsg(const char *pFormat, ...)
@@ -13,6 +13,8 @@
 
 #include <fftw3.h>
 
+#include "tomoHugePages.h"
+
 /**** Macros and typedefs ****/
 #ifndef max
 #define max(A,B) ((A)>(B)?(A):(B))
@@ -62,6 +64,8 @@ typedef struct {
    long ltbl;		           /**< Number of elements in convolvent lookup tables. */
    int verbose;            /**< Debug printing flag */
    FILE *debugFile;       /**< File to write debugging messages to */
+   int hugePages;          /**< HP_t method for allocating the M x M FFT array */
+   unsigned fftwFlags;     /**< FFTW planner flags for the FFT plans; 0 selects FFTW_MEASURE */
 } grid_struct;
 
 #ifdef __cplusplus
@@ -88,6 +92,8 @@ public:
   void filphase_su(long pd,float fac, float(*pf)(float),complex *A);
   void pswf_su(pswf_struct *pswf,long ltbl, 
                long linv, float* wtbl,float* dwtbl,float* winv);
+  /** Returns how the M x M FFT array was allocated */
+  hugePageInfo_t *getHDataPages() { return &HDataPages; }
   
 private:
   int flag;       
@@ -115,6 +121,7 @@ private:
   complex *filphase;
   complex **H;
   fftwf_complex *HData;
+  hugePageInfo_t HDataPages;
   
   fftwf_plan backward_1d_plan;
   fftwf_plan forward_2d_plan;
@@ -0,0 +1,152 @@
+/*
+ * tomoHugePages.cpp
+ *
+ * Functions to allocate large buffers backed by huge pages, which reduces the TLB misses when the
+ * buffers are accessed with large strides or scattered access.
+ *
+ * Huge pages are only used on Linux.  On other systems, or when huge pages cannot be allocated,
+ * tomoHugePageAlloc returns NULL and the caller allocates the buffer in the usual way.
+ *
+ * Created: October 18, 2026
+ */
+#include <stdio.h>
+#include <string.h>
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
+#include "tomoHugePages.h"
+
+static const size_t hugePageSize = 2*1024*1024;
+static const size_t gigaPageSize = 1024*1024*1024;
+
+#ifdef __linux__
+static size_t roundUp(size_t size, size_t pageSize)
+{
+  return (size + pageSize - 1) / pageSize * pageSize;
+}
+
+/** Returns 1 if transparent huge pages are available for madvise(MADV_HUGEPAGE), 0 if they are disabled */
+static int transparentHugePagesEnabled()
+{
+  char line[256];
+  char *p;
+  FILE *fp = fopen("/sys/kernel/mm/transparent_hugepage/enabled", "r");
+
+  if (fp == 0) return 0;
+  p = fgets(line, sizeof(line), fp);
+  fclose(fp);
+  if ((p == 0) || strstr(line, "[never]")) return 0;
+  return 1;
+}
+
+/** Maps anonymous hugetlb memory with the given page size
+* \param[in] size Size of the buffer
+* \param[in] pageSize Huge page size
+* \param[out] pInfo Description of the mapping
+* \return Pointer to the memory, or NULL if there are not enough free huge pages of that size */
+static void *mapHugetlb(size_t size, size_t pageSize, hugePageInfo_t *pInfo)
+{
+  size_t mapSize = roundUp(size, pageSize);
+  int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB;
+  void *pMem;
+
+#ifdef MAP_HUGE_SHIFT
+  flags |= ((pageSize == gigaPageSize) ? 30 : 21) << MAP_HUGE_SHIFT;
+#else
+  if (pageSize != hugePageSize) return 0;
+#endif
+  pMem = mmap(0, mapSize, PROT_READ | PROT_WRITE, flags, -1, 0);
+  if (pMem == MAP_FAILED) return 0;
+  pInfo->mapSize = mapSize;
+  pInfo->pageSize = pageSize;
+  pInfo->method = HP_Explicit;
+  return pMem;
+}
+#endif
+
+/** Allocates a buffer backed by huge pages.  The memory is zeroed, like calloc().
+* \param[in] size Size of the buffer in bytes
+* \param[in] hugePages HP_t method to use
+* \param[out] pInfo Description of the allocation, which must be passed to tomoHugePageFree()
+* \return Pointer to the buffer, aligned to the page size, or NULL if hugePages is HP_None or huge pages
+*         could not be allocated.  The caller then allocates the buffer in its usual way. */
+void *tomoHugePageAlloc(size_t size, int hugePages, hugePageInfo_t *pInfo)
+{
+  pInfo->mapSize = 0;
+  pInfo->pageSize = 0;
+  pInfo->method = HP_None;
+  if ((hugePages == HP_None) || (size == 0)) return 0;
+#ifdef __linux__
+  void *pMem = 0;
+  char *pStart;
+  size_t mapSize, head, tail;
+
+  if (hugePages == HP_Explicit) {
+    if (size >= gigaPageSize) pMem = mapHugetlb(size, gigaPageSize, pInfo);
+    if (pMem == 0) pMem = mapHugetlb(size, hugePageSize, pInfo);
+    if (pMem) return pMem;
+  }
+  if (!transparentHugePagesEnabled()) return 0;
+  // Map an extra huge page so the buffer can start on a huge page boundary, then unmap the unused ends
+  mapSize = roundUp(size, hugePageSize);
+  pMem = mmap(0, mapSize + hugePageSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (pMem == MAP_FAILED) return 0;
+  pStart = (char *)roundUp((size_t)pMem, hugePageSize);
+  head = pStart - (char *)pMem;
+  tail = hugePageSize - head;
+  if (head > 0) munmap(pMem, head);
+  if (tail > 0) munmap(pStart + mapSize, tail);
+  if (madvise(pStart, mapSize, MADV_HUGEPAGE) != 0) {
+    munmap(pStart, mapSize);
+    return 0;
+  }
+  pInfo->mapSize = mapSize;
+  pInfo->pageSize = hugePageSize;
+  pInfo->method = HP_Transparent;
+  return pStart;
+#else
+  return 0;
+#endif
+}
+
+/** Frees a buffer allocated by tomoHugePageAlloc()
+* \param[in] pMem Pointer to the buffer
+* \param[in] pInfo Description of the allocation that tomoHugePageAlloc() returned */
+void tomoHugePageFree(void *pMem, hugePageInfo_t *pInfo)
+{
+#ifdef __linux__
+  if (pMem && (pInfo->mapSize > 0)) munmap(pMem, pInfo->mapSize);
+#endif
+  pInfo->mapSize = 0;
+}
+
+/** Asks the kernel to back an existing buffer, such as an input or output volume allocated by the caller,
+* with transparent huge pages.  Only the huge pages that lie entirely inside the buffer are advised,
+* and pages that are already in memory are collapsed into huge pages in the background.
+* \param[in] pMem Pointer to the buffer
+* \param[in] size Size of the buffer in bytes
+* \return Number of bytes that were advised, 0 if huge pages are not available */
+size_t tomoHugePageAdvise(void *pMem, size_t size)
+{
+#ifdef __linux__
+  size_t start = roundUp((size_t)pMem, hugePageSize);
+  size_t end = ((size_t)pMem + size) / hugePageSize * hugePageSize;
+
+  if ((end <= start) || !transparentHugePagesEnabled()) return 0;
+  if (madvise((void *)start, end - start, MADV_HUGEPAGE) != 0) return 0;
+  return end - start;
+#else
+  return 0;
+#endif
+}
+
+/** Returns a string describing the pages of a buffer, for debugging messages
+* \param[in] pInfo Description of the allocation that tomoHugePageAlloc() returned */
+const char *tomoHugePageDescription(hugePageInfo_t *pInfo)
+{
+  if (pInfo->mapSize == 0) return "normal pages";
+  if (pInfo->method == HP_Transparent) return "transparent huge pages";
+  if (pInfo->pageSize == gigaPageSize) return "1 GB hugetlb pages";
+  return "2 MB hugetlb pages";
+}
@@ -0,0 +1,38 @@
+/*
+ * tomoHugePages.h
+ *
+ * Functions to allocate large buffers backed by huge pages, which reduces the TLB misses when the
+ * buffers are accessed with large strides or scattered access.
+ *
+ * Huge pages are only used on Linux.  On other systems, or when huge pages cannot be allocated,
+ * tomoHugePageAlloc returns NULL and the caller allocates the buffer in the usual way.
+ *
+ * Created: October 18, 2026
+ */
+
+#ifndef tomoHugePagesH
+#define tomoHugePagesH
+
+#include <stddef.h>
+
+/** Huge page methods */
+typedef enum {
+  HP_None,          /**< Normal pages */
+  HP_Transparent,   /**< Transparent huge pages: 2 MB aligned memory with madvise(MADV_HUGEPAGE) */
+  HP_Explicit       /**< hugetlb pages: 1 GB pages for buffers of 1 GB or more, else 2 MB pages; 
+                         falls back to HP_Transparent if no hugetlb pages are free */
+} HP_t;
+
+/** Structure that describes how a buffer was allocated by tomoHugePageAlloc */
+typedef struct {
+  size_t mapSize;   /**< Size of the mapping, rounded up to the page size; 0 if the buffer was not allocated with huge pages */
+  size_t pageSize;  /**< Page size in bytes */
+  int method;       /**< HP_t method that was used */
+} hugePageInfo_t;
+
+void *tomoHugePageAlloc(size_t size, int hugePages, hugePageInfo_t *pInfo);
+void tomoHugePageFree(void *pMem, hugePageInfo_t *pInfo);
+size_t tomoHugePageAdvise(void *pMem, size_t size);
+const char *tomoHugePageDescription(hugePageInfo_t *pInfo);
+
+#endif
@@ -0,0 +1,144 @@
+/*
+ * tomoPipeline.cpp
+ *
+ * C++ class for doing computed tomography preprocessing and reconstruction in one pass.
+ *
+ * This preprocesses the raw projections one block of slices at a time with tomoPreprocess and reconstructs
+ * each block with tomoRecon, so the normalized volume is never written.
+ *
+ * Author: Mark Rivers
+ *
+ * Created: October 18, 2026
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <epicsAtomic.h>
+
+#include "tomoPipeline.h"
+
+/** Constructor for the tomoPipeline class.
+* Creates the tomoPreprocess and tomoRecon objects and the two block buffers.
+* \param[in] pPreprocessParams A structure containing the preprocessing parameters for the whole raw volume.
+*            outputDataType, sinogramOutput and takeLog are ignored, the blocks are ODT_Float32 sinograms.
+* \param[in] pTomoParams A structure containing the reconstruction parameters.  numSlices is the number of slices
+*            in a block, and numPixels, numProjections, inputDataType and sinogramInput are ignored.  maxChunks is at least 2.
+*            With phaseRetrieval numSlices is ignored and the whole volume is one block.
+* \param[in] pAngles Array of projection angles in degrees
+* \param[in] pDark Pointer to the dark field [numPixels, numSlices]
+* \param[in] pFlat Pointer to the flat field [numPixels, numSlices] */
+tomoPipeline::tomoPipeline(preprocessParamsStruct *pPreprocessParams, tomoParams_t *pTomoParams, float *pAngles,
+                           float *pDark, float *pFlat)
+  : preprocessParams_(*pPreprocessParams),
+    tomoParams_(*pTomoParams),
+    cancelled_(0)
+{
+  size_t blockSize;
+  int imageWidth;
+  int i;
+  static const char *functionName="tomoPipeline::tomoPipeline";
+
+  preprocessParams_.outputDataType = ODT_Float32;
+  preprocessParams_.sinogramOutput = 1;
+  preprocessParams_.takeLog = 0;
+  tomoParams_.numPixels      = preprocessParams_.numPixels;
+  tomoParams_.numProjections = preprocessParams_.numProjections;
+  tomoParams_.inputDataType  = IDT_Float32;
+  tomoParams_.sinogramInput  = 1;
+  // Phase retrieval filters whole projections, so it would be repeated for each block
+  if (preprocessParams_.phaseRetrieval ||
+      (tomoParams_.numSlices < 1) || (tomoParams_.numSlices > preprocessParams_.numSlices)) {
+    tomoParams_.numSlices = preprocessParams_.numSlices;
+  }
+  tomoParams_.maxChunks = max(tomoParams_.maxChunks, 2);
+  blockSlices_ = tomoParams_.numSlices;
+  imageWidth = tomoParams_.offsetAxis ? 2*tomoParams_.numPixels : tomoParams_.numPixels;
+  outputSliceSize_ = (size_t)imageWidth * imageWidth *
+                     ((tomoParams_.outputDataType == ODT_Float32) ? sizeof(epicsFloat32) : sizeof(epicsUInt16));
+
+  pPreprocess_ = new tomoPreprocess(&preprocessParams_, pDark, pFlat);
+  pRecon_ = new tomoRecon(&tomoParams_, pAngles);
+  if (preprocessParams_.phaseRetrieval && (pTomoParams->numSlices > 0) && (pTomoParams->numSlices < blockSlices_)) {
+    pRecon_->logMsg("%s: phaseRetrieval filters whole projections, so all %d slices are preprocessed as one block",
+                    functionName, blockSlices_);
+  }
+  blockSize = (size_t)preprocessParams_.numPixels * blockSlices_ * preprocessParams_.numProjections;
+  // A single block only needs one buffer
+  pBlocks_[1] = 0;
+  for (i=0; i<((blockSlices_ < preprocessParams_.numSlices) ? 2 : 1); i++) {
+    pBlocks_[i] = (float *) malloc(blockSize * sizeof(float));
+  }
+}
+
+/** Destructor for the tomoPipeline class.
+* Deletes the tomoPreprocess and tomoRecon objects, which wait for their work in progress, and frees the block buffers. */
+tomoPipeline::~tomoPipeline()
+{
+  int i;
+
+  delete pPreprocess_;
+  delete pRecon_;
+  for (i=0; i<2; i++) free(pBlocks_[i]);
+}
+
+/** Function to preprocess and reconstruct all of the slices.
+* Returns when the last block has been reconstructed, or when cancel() is called.
+* \param[in] pInput Pointer to the raw projections of inputDataType [numPixels, numSlices, numProjections] in the
+*            preprocessParamsStruct
+* \param[in] center Rotation center to use for each slice [numSlices]
+* \param[out] pOutput Pointer to the output [numPixels, numPixels, numSlices], or [2*numPixels, 2*numPixels, numSlices] for offsetAxis
+* \return 0 if all of the slices were reconstructed, -1 if there was an error or the reconstruction was cancelled */
+int tomoPipeline::reconstruct(void *pInput, float *center, char *pOutput)
+{
+  int numSlices = preprocessParams_.numSlices;
+  int numProjections = preprocessParams_.numProjections;
+  int chunkIds[2] = {-1, -1};
+  int firstSlice;
+  int numBlockSlices;
+  int block;
+  int status = 0;
+  int i;
+  static const char *functionName="tomoPipeline::reconstruct";
+
+  if ((pBlocks_[0] == 0) || ((pBlocks_[1] == 0) && (blockSlices_ < numSlices))) {
+    pRecon_->logMsg("%s: error, block buffers were not allocated", functionName);
+    return -1;
+  }
+  epicsAtomicSetIntT(&cancelled_, 0);
+  for (firstSlice=0, block=0; firstSlice<numSlices; firstSlice+=blockSlices_, block++) {
+    numBlockSlices = min(blockSlices_, numSlices - firstSlice);
+    i = block % 2;
+    // The buffer can be refilled when the chunk that was reconstructing it is complete
+    if (chunkIds[i] >= 0) pRecon_->waitChunk(chunkIds[i], -1);
+    if (epicsAtomicGetIntT(&cancelled_)) break;
+    status = pPreprocess_->submitRows(0, numProjections, firstSlice, numBlockSlices, pInput, (char *)pBlocks_[i]);
+    if (status) break;
+    pPreprocess_->wait(-1);
+    if (epicsAtomicGetIntT(&cancelled_)) break;
+    if (tomoParams_.debug) pRecon_->logMsg("%s: preprocessed slices %d to %d",
+                                           functionName, firstSlice, firstSlice + numBlockSlices - 1);
+    chunkIds[i] = pRecon_->submitChunk(numBlockSlices, center + firstSlice, (char *)pBlocks_[i],
+                                       pOutput + firstSlice * outputSliceSize_);
+    if (chunkIds[i] < 0) {
+      status = -1;
+      break;
+    }
+  }
+  for (i=0; i<2; i++) {
+    if (chunkIds[i] >= 0) pRecon_->waitChunk(chunkIds[i], -1);
+  }
+  if (epicsAtomicGetIntT(&cancelled_)) status = -1;
+  return status;
+}
+
+/** Function to cancel reconstruct() from another thread.
+* The block that is being preprocessed is not reconstructed, and the slices of the blocks being reconstructed that have
+* not started are cancelled.  reconstruct() returns when the work in progress is finished.
+* \return Number of slices of the queued blocks that were cancelled */
+int tomoPipeline::cancel()
+{
+  epicsAtomicSetIntT(&cancelled_, 1);
+  pPreprocess_->cancel();
+  return pRecon_->cancel();
+}
@@ -0,0 +1,54 @@
+/*
+ * tomoPipeline.h
+ *
+ * C++ class for doing computed tomography preprocessing and reconstruction in one pass.
+ *
+ * This preprocesses the raw projections one block of slices at a time with tomoPreprocess and reconstructs
+ * each block with tomoRecon, so the normalized volume is never written.
+ *
+ * It uses the EPICS libCom library for OS-independent functions for threads, mutexes, message queues, etc.
+ *
+ * Author: Mark Rivers
+ *
+ * Created: October 18, 2026
+ */
+
+#include <epicsTypes.h>
+
+#include "tomoPreprocess.h"
+#include "tomoRecon.h"
+
+/** Class to preprocess and reconstruct raw projections without an intermediate normalized volume.
+* The rows of the raw projections are preprocessed by a tomoPreprocess object one block of slices at a time,
+* into one of two float block buffers, written as sinograms [numPixels, numProjections, blockSlices], and each block is queued with
+* tomoRecon::submitChunk(), whose sinogram() takes the -log.  While block k is reconstructed block k+1 is preprocessed
+* into the other buffer.  The dark, flat and zinger corrections are those of tomoPreprocess, including the rows around
+* each block that zinger removal needs, so the result is the same as preprocessing the whole volume with ODT_Float32
+* output and reconstructing it, with the same scaleFactor and sinoScale.
+* Slices are reconstructed in pairs within a block, so with an even number of slices per block the pairs, and the center
+* used for each pair, are also the same.
+* The preprocessParamsStruct defines the whole raw volume.  tomoParams_t.numSlices is the number of slices in a block,
+* and the numPixels, numProjections and inputDataType of the tomoParams_t are taken from the preprocessing.
+* For a 2048 x 2048 x 1500 scan the buffers of two 32 slice blocks take 0.8 GB instead of 12-25 GB for the normalized volume.
+* Paganin phase retrieval (preprocessParamsStruct.phaseRetrieval) filters whole projections with 2-D FFTs, so with blocks
+* it would be repeated for every block.  With phaseRetrieval the whole volume is therefore preprocessed as one block,
+* and the buffer takes as much memory as the normalized volume.
+*/
+class tomoPipeline {
+public:
+  tomoPipeline(preprocessParamsStruct *pPreprocessParams, tomoParams_t *pTomoParams, float *pAngles,
+               float *pDark, float *pFlat);
+  ~tomoPipeline();
+  int reconstruct(void *pInput, float *center, char *pOutput);
+  int cancel();
+
+private:
+  preprocessParamsStruct preprocessParams_;
+  tomoParams_t tomoParams_;
+  tomoPreprocess *pPreprocess_;
+  tomoRecon *pRecon_;
+  int blockSlices_;
+  size_t outputSliceSize_;
+  float *pBlocks_[2];
+  int cancelled_;
+};
@@ -0,0 +1,73 @@
+/* File tomoPipelineIDL.cpp
+   This file is a thin wrapper layer which is called from IDL
+   It calls tomoPipeline
+
+   Mark Rivers
+   October, 2026
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tomoPipeline.h"
+
+#include <epicsExport.h>
+
+// We use static variables because IDL does not really handle passing pointers (though it can be faked with LongLong type)
+// and because the IDL variables for the parameters can disappear, they do not have the required lifetime.
+static tomoPipeline *pTomoPipeline = 0;
+
+extern "C" {
+/** Function to create a tomoPipeline object from IDL.
+ * \param[in] argc Number of parameters = 5
+ * \param[in] argv Array of pointers.<br/>
+ *            argv[0] = Pointer to a preprocessParamsStruct structure, which defines the preprocessing of the raw volume <br/>
+ *            argv[1] = Pointer to a tomoParams_t structure, whose numSlices is the number of slices in a block <br/>
+ *            argv[2] = Pointer to the projection angles <br/>
+ *            argv[3] = Pointer to the dark field <br/>
+ *            argv[4] = Pointer to the flat field <br/>
+ * The parameters are copied by tomoPipeline, because the IDL variables could be deleted
+ * and returned to the heap while the tomoPipeline object still exists. */
+epicsShareFunc void epicsShareAPI tomoPipelineCreateIDL(int argc, char *argv[])
+{
+  preprocessParamsStruct *pPreprocessParams = (preprocessParamsStruct *)argv[0];
+  tomoParams_t *pTomoParams = (tomoParams_t *)argv[1];
+  float *pAngles = (float *)argv[2];
+  float *pDark   = (float *)argv[3];
+  float *pFlat   = (float *)argv[4];
+
+  if (pTomoPipeline) delete pTomoPipeline;
+  pTomoPipeline = new tomoPipeline(pPreprocessParams, pTomoParams, pAngles, pDark, pFlat);
+}
+
+/** Function to preprocess and reconstruct raw projections with the tomoPipeline object created with tomoPipelineCreateIDL.
+ * Returns when all of the slices have been reconstructed.
+ * \param[in] argc Number of parameters = 4
+ * \param[in] argv Array of pointers. <br/>
+ *            argv[0] = Pointer to the raw projections of inputDataType [numPixels, numSlices, numProjections] <br/>
+ *            argv[1] = Pointer to the rotation center of each slice <br/>
+ *            argv[2] = Pointer to the output [numPixels, numPixels, numSlices] <br/>
+ *            argv[3] = Pointer to int status; 0 if all of the slices were reconstructed */
+epicsShareFunc void epicsShareAPI tomoPipelineRunIDL(int argc, char *argv[])
+{
+  void *pIn        =        (void *)argv[0];
+  float *pCenter   =       (float *)argv[1];
+  char *pOut       =        (char *)argv[2];
+  int *pStatus     =         (int *)argv[3];
+
+  if (pTomoPipeline == 0) return;
+  *pStatus = pTomoPipeline->reconstruct(pIn, pCenter, pOut);
+}
+
+/** Function to delete the tomoPipeline object created with tomoPipelineCreateIDL.
+* Note that any existing tomoPipeline object is automatically deleted the next time
+* that tomoPipelineCreateIDL is called, so it is often not necessary to call this function. */
+epicsShareFunc void epicsShareAPI tomoPipelineDeleteIDL(int argc, char *argv[])
+{
+  if (pTomoPipeline == 0) return;
+  delete pTomoPipeline;
+  pTomoPipeline = 0;
+}
+
+} // extern "C"
@@ -4,6 +4,7 @@
  * C++ class for doing computed tomography preprocessing.
  *
  * This runs the preprocessing using multiple threads, each thread preprocessing a set of projections.
+ * The threads are in the tomoThreadPool, which is shared with other tomoRecon and tomoPreprocess objects.
  *
  * It uses the EPICS libCom library for OS-independent functions for threads, mutexes, message queues, etc.
  *
@@ -18,52 +19,575 @@
 #include <string.h>
 #include <vector>
 #include <algorithm>
+#include <type_traits>
 
 #include <epicsTime.h>
 
 #include "tomoPreprocess.h"
 
+/** Number of work items per thread that submitRows aims for when bandRows is 0 */
+static const int bandsPerThread = 4;
+/** Minimum number of rows in a band when bandRows is 0 */
+static const int minBandRows = 16;
+/** Maximum distance in pixels from a bad pixel to the good pixels that replace it */
+static const int maxBadPixelDistance = 8;
+/** Number of decay lengths of the Paganin filter kernel that the projections are padded by on each side */
+static const double paganinPadLengths = 6.;
+/** Planck constant times the speed of light in keV cm, which converts the energy to the wavelength */
+static const double hc = 1.23984193e-7;
+static const double pi = 3.14159265358979;
 
-extern "C" {
-static void supervisorTask(void *pPvt)
+/** Returns the smallest size that is at least n and has no prime factors larger than 7, for which FFTW is fast */
+static int goodFFTSize(int n)
 {
-  tomoPreprocess *pTomoPreprocess = (tomoPreprocess *)pPvt;
-  pTomoPreprocess->supervisorTask();
+  int m, size;
+
+  for (size=std::max(n, 1); ; size++) {
+    m = size;
+    while (m % 2 == 0) m /= 2;
+    while (m % 3 == 0) m /= 3;
+    while (m % 5 == 0) m /= 5;
+    while (m % 7 == 0) m /= 7;
+    if (m == 1) return size;
+  }
 }
 
-static void workerTask(workerCreateStruct *pWCS)
+/** Converts a normalized value to the output type.  UInt16 output saturates at 0 and 65535, and NaN becomes 0.
+* These compile to min and max instructions, so the normalization loop has no branches and can be vectorized. */
+template <typename outputType> static inline outputType convertOutput(float value);
+
+template <> inline epicsFloat32 convertOutput<epicsFloat32>(float value)
 {
-  pWCS->pTomoPreprocess->workerTask(pWCS->taskNum);
-  free(pWCS);
+  return value;
 }
-} // extern "C"
 
+template <> inline epicsUInt16 convertOutput<epicsUInt16>(float value)
+{
+  return (epicsUInt16) std::min(65535.f, std::max(0.f, value));
+}
 
-/** Constructor for the tomoPreprocess class.
-* Creates the message queues for passing messages to and from the workerTask threads.
-* Creates the thread that execute the supervisorTask function, 
-* and numThreads threads that execute the workerTask function.
+/** IEEE half precision float for ODT_Float16 output.  It is a struct so that it is a different type from epicsUInt16. */
+typedef struct {
+  epicsUInt16 bits;
+} tomoFloat16;
+
+/** Half precision output rounds to nearest even.  Values too large for a half become infinity, and small values
+* become subnormal halves or zero. */
+template <> inline tomoFloat16 convertOutput<tomoFloat16>(float value)
+{
+  union { float f; epicsUInt32 u; } in, magic;
+  epicsUInt32 sign;
+  tomoFloat16 half;
+
+  in.f = value;
+  sign = in.u & 0x80000000u;
+  in.u ^= sign;
+  if (in.u >= 0x47800000u) {
+    // Infinity, or NaN with the quiet bit set
+    half.bits = (in.u > 0x7f800000u) ? 0x7e00 : 0x7c00;
+  } else if (in.u < 0x38800000u) {
+    // Adding 0.5 shifts the mantissa of a subnormal half into the low bits and rounds it
+    magic.u = 0x3f000000u;
+    in.f += magic.f;
+    half.bits = (epicsUInt16)(in.u - magic.u);
+  } else {
+    // Rebias the exponent from 127 to 15 and round the mantissa to nearest even
+    in.u += 0xc8000fffu + ((in.u >> 13) & 1);
+    half.bits = (epicsUInt16)(in.u >> 13);
+  }
+  half.bits |= (epicsUInt16)(sign >> 16);
+  return half;
+}
+
+/** Type of the rows that are normalized and have their zingers removed before they are written as outputType.
+* Half floats have no arithmetic, so their rows are float. */
+template <typename outputType> struct rowTypeOf { typedef outputType type; };
+template <> struct rowTypeOf<tomoFloat16> { typedef epicsFloat32 type; };
+
+/** Replaces the zingers using the median of each zw x zw block.  Each pixel is compared to the median of the
+* block it is in, and the blocks do not overlap. */
+template <typename outputType>
+static int blockZingers(outputType *pOut, int numPixels, int numSlices, int zw, float zingerThreshold)
+{
+  std::vector<float> windowValues(zw*zw, 0);
+  size_t windowSize2 = windowValues.size()/2;
+  auto medianTarget = windowValues.begin() + windowSize2;
+  int numZingers = 0;
+
+  // Outer loops move averaging window through the image
+  for (int i=0; i<numSlices; i+=zw) {
+    for (int j=0; j<numPixels; j+=zw) {
+      // First inner loops calculate the median of the pixels in the averaging window
+      int m = 0;
+      for (int k=0; k<zw; k++) {
+        int iy = std::min(i+k, numSlices-1) * numPixels;
+        for (int l=0; l<zw; l++) {
+          int ix = std::min(j+l, numPixels-1);
+          windowValues[m++] = pOut[iy + ix];
+        }
+      }
+      std::nth_element(windowValues.begin(), medianTarget, windowValues.end());
+      float median = windowValues[windowSize2];
+      // Next inner loops replace pixels which are more than threshold above the median with the median
+      for (int k=0; k<zw; k++) {
+        int iy = std::min(i+k, numSlices-1) * numPixels;
+        for (int l=0; l<zw; l++) {
+          int ix = std::min(j+l, numPixels-1);
+          if ( (pOut[iy + ix] - median) > zingerThreshold) {
+            numZingers++;
+            pOut[iy + ix] = (outputType) median;
+          }
+        }
+      }        
+    }
+  }
+  return numZingers;
+}
+
+/** Returns a scratch buffer of a zingerWorker_t with at least size bytes, replacing it if it is smaller.
+* \param[in,out] ppBuffer Pointer to the buffer
+* \param[in,out] pBufferSize Pointer to the size of the buffer in bytes
+* \param[in] size Number of bytes needed */
+static void *scratchBuffer(void **ppBuffer, size_t *pBufferSize, size_t size)
+{
+  if (*pBufferSize < size) {
+    free(*ppBuffer);
+    *ppBuffer = malloc(size);
+    *pBufferSize = size;
+  }
+  return *ppBuffer;
+}
+
+/** Replaces the zingers using the median of the (2*radius+1) x (2*radius+1) window centered on each pixel,
+* with the rows and columns at the edges repeated.  This is the general version for any radius, which finds each
+* median with std::nth_element.  The band is copied to the scratch buffer of pWorker. */
+template <typename outputType>
+static int sortZingers(outputType *pOut, int numPixels, int numSlices, int radius, float zingerThreshold,
+                       zingerWorker_t *pWorker)
+{
+  size_t bandSize = (size_t)numPixels*numSlices;
+  outputType *projection = (outputType *) scratchBuffer(&pWorker->pCopy, &pWorker->copySize, bandSize*sizeof(outputType));
+  int width = 2*radius + 1;
+  std::vector<float> windowValues(width*width);
+  auto medianTarget = windowValues.begin() + windowValues.size()/2;
+  int numZingers = 0;
+  int i, j, k, l, m;
+  float median;
+
+  std::copy(pOut, pOut + bandSize, projection);
+  for (i=0; i<numSlices; i++) {
+    for (j=0; j<numPixels; j++) {
+      m = 0;
+      for (k=-radius; k<=radius; k++) {
+        outputType *pRow = &projection[(size_t)std::min(std::max(i+k, 0), numSlices-1) * numPixels];
+        for (l=-radius; l<=radius; l++) {
+          windowValues[m++] = pRow[std::min(std::max(j+l, 0), numPixels-1)];
+        }
+      }
+      std::nth_element(windowValues.begin(), medianTarget, windowValues.end());
+      median = *medianTarget;
+      if ((projection[(size_t)i*numPixels + j] - median) > zingerThreshold) {
+        numZingers++;
+        pOut[(size_t)i*numPixels + j] = (outputType) median;
+      }
+    }
+  }
+  return numZingers;
+}
+
+/** Replaces the zingers using the median of the window centered on each pixel, like sortZingers.
+* There is a faster version for each output type, which uses the scratch buffers of pWorker. */
+template <typename outputType>
+static int slidingZingers(outputType *pOut, int numPixels, int numSlices, int radius, float zingerThreshold,
+                          zingerWorker_t *pWorker);
+
+static inline void histogramAdd(medianHistogram_t *pHist, int value)
+{
+  pHist->fine[value]++;
+  pHist->coarse[value >> 8]++;
+  pHist->below += (value < pHist->median);
+}
+
+static inline void histogramRemove(medianHistogram_t *pHist, int value)
+{
+  pHist->fine[value]--;
+  pHist->coarse[value >> 8]--;
+  pHist->below -= (value < pHist->median);
+}
+
+/** Returns the value with rank (number of smaller values) rank in the window */
+static inline int histogramMedian(medianHistogram_t *pHist, int rank)
+{
+  int median = pHist->median;
+  int below = pHist->below;
+
+  while (below > rank) {
+    // Skip a whole coarse bin when median is at its top and the median is below the bin
+    if (((median & 255) == 0) && (below - pHist->coarse[(median >> 8) - 1] > rank)) {
+      below -= pHist->coarse[(median >> 8) - 1];
+      median -= 256;
+    } else {
+      median--;
+      below -= pHist->fine[median];
+    }
+  }
+  while (below + pHist->fine[median] <= rank) {
+    if (((median & 255) == 0) && (below + pHist->coarse[median >> 8] <= rank)) {
+      below += pHist->coarse[median >> 8];
+      median += 256;
+    } else {
+      below += pHist->fine[median];
+      median++;
+    }
+  }
+  pHist->median = median;
+  pHist->below = below;
+  return median;
+}
+
+/** Version of slidingZingers for UInt16 output.  Each row is scanned with a histogram of the window, which is updated
+* by removing the column that leaves the window and adding the column that enters it, so the cost per pixel is
+* 2*(2*radius+1) histogram updates and a few steps of the median, instead of sorting (2*radius+1)^2 values.
+* The histogram of pWorker is allocated and zeroed once; every value added to it is removed again at the end of each row. */
+template <>
+int slidingZingers<epicsUInt16>(epicsUInt16 *pOut, int numPixels, int numSlices, int radius, float zingerThreshold,
+                                zingerWorker_t *pWorker)
+{
+  size_t bandSize = (size_t)numPixels*numSlices;
+  epicsUInt16 *projection = (epicsUInt16 *) scratchBuffer(&pWorker->pCopy, &pWorker->copySize, bandSize*sizeof(epicsUInt16));
+  medianHistogram_t *pHist = pWorker->pHist;
+  int width = 2*radius + 1;
+  int rank = width*width/2;
+  std::vector<epicsUInt16 *> pRows(width);
+  int numZingers = 0;
+  int i, j, k, l, median;
+
+  if (pHist == 0) pHist = pWorker->pHist = (medianHistogram_t *) calloc(1, sizeof(medianHistogram_t));
+  std::copy(pOut, pOut + bandSize, projection);
+  for (i=0; i<numSlices; i++) {
+    for (k=0; k<width; k++) {
+      pRows[k] = &projection[(size_t)std::min(std::max(i+k-radius, 0), numSlices-1) * numPixels];
+    }
+    for (l=-radius; l<=radius; l++) {
+      for (k=0; k<width; k++) histogramAdd(pHist, pRows[k][std::min(std::max(l, 0), numPixels-1)]);
+    }
+    for (j=0; j<numPixels; j++) {
+      if (j > 0) {
+        for (k=0; k<width; k++) {
+          histogramRemove(pHist, pRows[k][std::max(j-radius-1, 0)]);
+          histogramAdd(pHist, pRows[k][std::min(j+radius, numPixels-1)]);
+        }
+      }
+      median = histogramMedian(pHist, rank);
+      if ((pRows[radius][j] - median) > zingerThreshold) {
+        numZingers++;
+        pOut[(size_t)i*numPixels + j] = (epicsUInt16) median;
+      }
+    }
+    for (l=numPixels-1-radius; l<=numPixels-1+radius; l++) {
+      for (k=0; k<width; k++) histogramRemove(pHist, pRows[k][std::min(std::max(l, 0), numPixels-1)]);
+    }
+  }
+  return numZingers;
+}
+
+/** Sorting networks that leave the median of 9 and 25 values in the middle element [Paeth, Devillard] */
+static const int median9Network[][2] = {
+  {1,2}, {4,5}, {7,8}, {0,1}, {3,4}, {6,7}, {1,2}, {4,5}, {7,8}, {0,3}, {5,8}, {4,7}, {3,6}, {1,4}, {2,5},
+  {4,7}, {4,2}, {6,4}, {4,2}
+};
+
+static const int median25Network[][2] = {
+  {0,1},   {3,4},   {2,4},   {2,3},   {6,7},   {5,7},   {5,6},   {9,10},  {8,10},  {8,9},   {12,13}, {11,13},
+  {11,12}, {15,16}, {14,16}, {14,15}, {18,19}, {17,19}, {17,18}, {21,22}, {20,22}, {20,21}, {23,24}, {2,5},
+  {3,6},   {0,6},   {0,3},   {4,7},   {1,7},   {1,4},   {11,14}, {8,14},  {8,11},  {12,15}, {9,15},  {9,12},
+  {13,16}, {10,16}, {10,13}, {20,23}, {17,23}, {17,20}, {21,24}, {18,24}, {18,21}, {19,22}, {8,17},  {9,18},
+  {0,18},  {0,9},   {10,19}, {1,19},  {1,10},  {11,20}, {2,20},  {2,11},  {12,21}, {3,21},  {3,12},  {13,22},
+  {4,22},  {4,13},  {14,23}, {5,23},  {5,14},  {15,24}, {6,24},  {6,15},  {7,16},  {7,19},  {13,21}, {15,23},
+  {7,13},  {7,15},  {1,9},   {3,11},  {5,17},  {11,17}, {9,17},  {4,10},  {6,12},  {7,14},  {4,6},   {4,7},
+  {12,14}, {10,14}, {6,7},   {10,12}, {6,10},  {6,17},  {12,17}, {7,17},  {7,10},  {12,18}, {7,12},  {10,18},
+  {12,20}, {10,20}, {10,12}
+};
+
+/** Version of slidingZingers for Float32 output.  For 3x3 and 5x5 windows each row is done with a sorting network
+* applied to whole rows at once: each compare-exchange is a min and a max over the row, which the compiler vectorizes.
+* Other window sizes use the general version. */
+template <>
+int slidingZingers<epicsFloat32>(epicsFloat32 *pOut, int numPixels, int numSlices, int radius, float zingerThreshold,
+                                 zingerWorker_t *pWorker)
+{
+  const int (*network)[2];
+  int networkSize;
+  int width = 2*radius + 1;
+  int numValues = width*width;
+  int center = numValues/2;
+  int paddedPixels = numPixels + 2*radius;
+  size_t bandSize = (size_t)numPixels*numSlices;
+  int numZingers = 0;
+  int i, j, k, l, n;
+  float *projection, *paddedRows, *values;
+  float *pA, *pB, *pIn, lo, hi;
+
+  if (radius == 1) {
+    network = median9Network;
+    networkSize = sizeof(median9Network)/sizeof(median9Network[0]);
+  } else if (radius == 2) {
+    network = median25Network;
+    networkSize = sizeof(median25Network)/sizeof(median25Network[0]);
+  } else {
+    return sortZingers(pOut, numPixels, numSlices, radius, zingerThreshold, pWorker);
+  }
+  projection = (float *) scratchBuffer(&pWorker->pCopy, &pWorker->copySize, bandSize*sizeof(float));
+  paddedRows = (float *) scratchBuffer(&pWorker->pPaddedRows, &pWorker->paddedRowsSize,
+                                       (size_t)width*paddedPixels*sizeof(float));
+  values = (float *) scratchBuffer(&pWorker->pValues, &pWorker->valuesSize, (size_t)numValues*numPixels*sizeof(float));
+  std::copy(pOut, pOut + bandSize, projection);
+
+  for (i=0; i<numSlices; i++) {
+    // Copy the rows of the window with the edge pixels repeated
+    for (k=0; k<width; k++) {
+      pIn = &projection[(size_t)std::min(std::max(i+k-radius, 0), numSlices-1) * numPixels];
+      for (j=0; j<paddedPixels; j++) {
+        paddedRows[(size_t)k*paddedPixels + j] = pIn[std::min(std::max(j-radius, 0), numPixels-1)];
+      }
+    }
+    // values[n] is the n'th value in the window of each pixel in the row
+    for (k=0; k<width; k++) {
+      for (l=0; l<width; l++) {
+        std::copy(&paddedRows[(size_t)k*paddedPixels + l], &paddedRows[(size_t)k*paddedPixels + l + numPixels],
+                  &values[(size_t)(k*width + l)*numPixels]);
+      }
+    }
+    for (n=0; n<networkSize; n++) {
+      pA = &values[(size_t)network[n][0]*numPixels];
+      pB = &values[(size_t)network[n][1]*numPixels];
+      for (j=0; j<numPixels; j++) {
+        lo = std::min(pA[j], pB[j]);
+        hi = std::max(pA[j], pB[j]);
+        pA[j] = lo;
+        pB[j] = hi;
+      }
+    }
+    pA = &values[(size_t)center*numPixels];
+    pIn = &projection[(size_t)i*numPixels];
+    for (j=0; j<numPixels; j++) {
+      if ((pIn[j] - pA[j]) > zingerThreshold) {
+        numZingers++;
+        pOut[(size_t)i*numPixels + j] = pA[j];
+      }
+    }
+  }
+  return numZingers;
+}
+
+/** Task that reduces a stack of frames to one frame with the tomoThreadPool threads, for tomoPreprocess::reduceFrames().
+* Each run takes the next band of rows, so the same task is running on up to numThreads threads at once.
+* inputType is the type of the frames. */
+template <typename inputType>
+class frameReducer : public tomoPoolTask {
+public:
+  frameReducer(int numPixels, int numSlices, int numFrames, inputType *pFrames, int method, float *pDark, float *pOutput);
+  ~frameReducer();
+  void reduce(int numThreads);
+  void run(int workerNum);
+
+private:
+  void reduceRows(int firstRow, int numRows);
+  int numPixels_;
+  int numSlices_;
+  int numFrames_;
+  inputType *pFrames_;
+  int method_;
+  float *pDark_;
+  float *pOutput_;
+  int bandRows_;
+  int nextRow_;
+  int activeTasks_;
+  tomoThreadPool *pPool_;
+  epicsEventId doneEvent_;
+  epicsMutexId mutex_;
+};
+
+template <typename inputType>
+frameReducer<inputType>::frameReducer(int numPixels, int numSlices, int numFrames, inputType *pFrames, int method,
+                                      float *pDark, float *pOutput)
+  : numPixels_(numPixels),
+    numSlices_(numSlices),
+    numFrames_(numFrames),
+    pFrames_(pFrames),
+    method_(method),
+    pDark_(pDark),
+    pOutput_(pOutput),
+    bandRows_(1),
+    nextRow_(0),
+    activeTasks_(0),
+    pPool_(0)
+{
+  doneEvent_ = epicsEventCreate(epicsEventEmpty);
+  mutex_ = epicsMutexCreate();
+}
+
+template <typename inputType>
+frameReducer<inputType>::~frameReducer()
+{
+  epicsEventDestroy(doneEvent_);
+  epicsMutexDestroy(mutex_);
+}
+
+/** Function that reduces all of the rows and returns when they are done.
+* \param[in] numThreads Number of pool threads to use */
+template <typename inputType>
+void frameReducer<inputType>::reduce(int numThreads)
+{
+  int i;
+
+  if (numThreads < 1) numThreads = 1;
+  pPool_ = tomoThreadPool::getPool(numThreads);
+  bandRows_ = std::max(numSlices_ / (bandsPerThread * numThreads), 1);
+  numThreads = std::min(numThreads, (numSlices_ + bandRows_ - 1) / bandRows_);
+  epicsMutexLock(mutex_);
+  activeTasks_ = numThreads;
+  for (i=0; i<numThreads; i++) pPool_->submit(this);
+  epicsMutexUnlock(mutex_);
+  epicsEventWait(doneEvent_);
+  // The last task signals the event with the mutex locked, so wait for it to release the mutex
+  epicsMutexLock(mutex_);
+  epicsMutexUnlock(mutex_);
+}
+
+/** Function that the thread pool calls to reduce the next band of rows.
+* \param[in] workerNum Number of the pool worker thread running the task */
+template <typename inputType>
+void frameReducer<inputType>::run(int workerNum)
+{
+  int firstRow;
+
+  epicsMutexLock(mutex_);
+  firstRow = nextRow_;
+  nextRow_ += bandRows_;
+  epicsMutexUnlock(mutex_);
+  if (firstRow < numSlices_) reduceRows(firstRow, std::min(bandRows_, numSlices_ - firstRow));
+  epicsMutexLock(mutex_);
+  if (nextRow_ < numSlices_) {
+    pPool_->submit(this, workerNum);
+  } else if (--activeTasks_ == 0) {
+    epicsEventSignal(doneEvent_);
+  }
+  epicsMutexUnlock(mutex_);
+}
+
+/** Function that reduces a band of rows.
+* The mean adds the frames row by row in double precision, so that long stacks of 16 or 32-bit frames do not lose counts.
+* The median copies a row of each frame to a buffer, so the values of each pixel are gathered from the cache, and selects
+* the middle value, or the mean of the two middle values for an even number of frames.
+* \param[in] firstRow First row to reduce
+* \param[in] numRows Number of rows */
+template <typename inputType>
+void frameReducer<inputType>::reduceRows(int firstRow, int numRows)
+{
+  size_t frameSize = (size_t)numPixels_ * numSlices_;
+  std::vector<double> sum;
+  std::vector<inputType> rows, values(numFrames_);
+  int middle = numFrames_ / 2;
+  const inputType *pFrame;
+  float *pOut;
+  double median;
+  int row, frame, i;
+
+  if (method_ == SR_Median) rows.resize((size_t)numFrames_ * numPixels_);
+  else sum.resize(numPixels_);
+  for (row=firstRow; row<firstRow+numRows; row++) {
+    pOut = pOutput_ + (size_t)row * numPixels_;
+    if (method_ == SR_Median) {
+      for (frame=0; frame<numFrames_; frame++) {
+        pFrame = pFrames_ + frame*frameSize + (size_t)row * numPixels_;
+        std::copy(pFrame, pFrame + numPixels_, rows.begin() + (size_t)frame * numPixels_);
+      }
+      for (i=0; i<numPixels_; i++) {
+        for (frame=0; frame<numFrames_; frame++) values[frame] = rows[(size_t)frame * numPixels_ + i];
+        std::nth_element(values.begin(), values.begin() + middle, values.end());
+        median = (double)values[middle];
+        if ((numFrames_ % 2) == 0) median = (median + (double)*std::max_element(values.begin(), values.begin() + middle)) / 2.;
+        pOut[i] = (float)median;
+      }
+    } else {
+      std::fill(sum.begin(), sum.end(), 0.);
+      for (frame=0; frame<numFrames_; frame++) {
+        pFrame = pFrames_ + frame*frameSize + (size_t)row * numPixels_;
+        for (i=0; i<numPixels_; i++) sum[i] += pFrame[i];
+      }
+      for (i=0; i<numPixels_; i++) pOut[i] = (float)(sum[i] / numFrames_);
+    }
+    if (pDark_) {
+      for (i=0; i<numPixels_; i++) pOut[i] -= pDark_[(size_t)row * numPixels_ + i];
+    }
+  }
+}
+
+/** Function to reduce a stack of dark or flat frames to one frame, with the tomoThreadPool threads.
+* The flat field that the constructor needs has the dark field subtracted, so pass the dark field from a first call
+* when reducing the flat frames.
+* \param[in] numPixels Number of pixels in a row
+* \param[in] numSlices Number of rows
+* \param[in] numFrames Number of frames in the stack
+* \param[in] pFrames Pointer to the frames [numPixels, numSlices, numFrames]
+* \param[in] method SR_t method, SR_Mean or SR_Median
+* \param[in] numThreads Number of pool threads to use
+* \param[in] pDark Dark field [numPixels, numSlices] to subtract from the result, or NULL
+* \param[out] pOutput Pointer to the reduced frame [numPixels, numSlices]
+* \param[in] inputDataType RDT_t data type of the frames
+* \return 0 if the frames were reduced, -1 if the arguments are not valid */
+int tomoPreprocess::reduceFrames(int numPixels, int numSlices, int numFrames, void *pFrames, int method, int numThreads,
+                                 float *pDark, float *pOutput, int inputDataType)
+{
+  if ((numPixels < 1) || (numSlices < 1) || (numFrames < 1) || ((method != SR_Mean) && (method != SR_Median))) return -1;
+  switch (inputDataType) {
+    case RDT_UInt16: {
+      frameReducer<epicsUInt16> reducer(numPixels, numSlices, numFrames, (epicsUInt16 *)pFrames, method, pDark, pOutput);
+      reducer.reduce(numThreads);
+      break;
+    }
+    case RDT_UInt8: {
+      frameReducer<epicsUInt8> reducer(numPixels, numSlices, numFrames, (epicsUInt8 *)pFrames, method, pDark, pOutput);
+      reducer.reduce(numThreads);
+      break;
+    }
+    case RDT_UInt32: {
+      frameReducer<epicsUInt32> reducer(numPixels, numSlices, numFrames, (epicsUInt32 *)pFrames, method, pDark, pOutput);
+      reducer.reduce(numThreads);
+      break;
+    }
+    default:
+      return -1;
+  }
+  return 0;
+}
+
+/** Constructor for the tomoPreprocess class that preprocesses projections as they are passed to submitProjections().
+* Computes scaleFactor/flat and dark*scaleFactor/flat for each pixel, so that normalizing a projection is a
+* multiply and a subtract per pixel, and the dark and flat arrays are not needed after the constructor returns.
+* Creates the message queue for passing projections to the preprocessing tasks, and makes sure the shared
+* tomoThreadPool has at least numThreads threads.
+* With a second flat field, for example one collected after the scan, the flat field of each projection is interpolated
+* linearly between pFlat for projection 0 and pFlat2 for projection numProjections-1, which follows a drift of the beam.
+* The reciprocals are interpolated, so the normalization is still a multiply and a subtract per pixel.
+* reduceFrames() computes the dark and flat fields from stacks of frames.
 * \param[in] pPreprocessParams A structure containing the tomography preprocessing parameters
-* \param[in] pAngles Array of projection angles in degrees */
-tomoPreprocess::tomoPreprocess(preprocessParamsStruct *pPreprocessParams, float *pDark, float *pFlat, epicsUInt16 *pInput, char *pOutput)
+* \param[in] pDark Dark field [numPixels, numSlices]
+* \param[in] pFlat Flat field with the dark field subtracted [numPixels, numSlices]
+* \param[in] pFlat2 Second flat field with the dark field subtracted [numPixels, numSlices], or NULL for a single flat field */
+tomoPreprocess::tomoPreprocess(preprocessParamsStruct *pPreprocessParams, float *pDark, float *pFlat, float *pFlat2)
   : params_(*pPreprocessParams),
-    pDark_(pDark),
-    pFlat_(pFlat),
-    preprocessComplete_(0),
-    projectionsRemaining_(params_.numProjections),
-    shutDown_(0)
+    preprocessComplete_(1),
+    projectionsRemaining_(0),
+    bandsRemaining_(0),
+    shutDown_(0),
+    activeTasks_(0)
 
 {
-  epicsThreadId supervisorTaskId;
-  char workerTaskName[30];
-  epicsThreadId workerTaskId;
-  workerCreateStruct *pWCS;
   char *debugFileName = params_.debugFileName;
-  epicsUInt16 *pIn = pInput;
-  char *pOut = pOutput;
-  toDoMessageStruct toDoMessage;
   int projectionSize = params_.numPixels * params_.numSlices;
-  int status;
+  float scaleFactor = (params_.scaleFactor == 0) ? 1.f : params_.scaleFactor;
   int i;
   static const char *functionName="tomoPreprocess::tomoPreprocess";
 
@@ -72,92 +596,327 @@ tomoPreprocess::tomoPreprocess(preprocessParamsStruct *pPreprocessParams, float
     debugFile_ = fopen(debugFileName, "w");
   }
 
-  if (params_.debug) logMsg("%s: entry, creating message queues, events, threads, etc.", functionName);
+  if (params_.debug) logMsg("%s: entry, creating message queue, events, etc.", functionName);
  
-  toDoQueue_ = epicsMessageQueueCreate(params_.numProjections, sizeof(toDoMessageStruct));
-  doneQueue_ = epicsMessageQueueCreate(params_.numProjections, sizeof(doneMessageStruct));
-  workerWakeEvents_ = (epicsEventId *) malloc(params_.numThreads * sizeof(epicsEventId));
-  workerDoneEvents_ = (epicsEventId *) malloc(params_.numThreads * sizeof(epicsEventId));
-  supervisorWakeEvent_ = epicsEventCreate(epicsEventEmpty);
-  supervisorDoneEvent_ = epicsEventCreate(epicsEventEmpty);
-
-  /* Create the thread for the supervisor task */
-  supervisorTaskId = epicsThreadCreate("supervisorTask",
-                                epicsThreadPriorityMedium,
-                                epicsThreadGetStackSize(epicsThreadStackMedium),
-                                (EPICSTHREADFUNC) ::supervisorTask,
-                                this);
-  if (supervisorTaskId == 0) {
-    logMsg("%s: epicsThreadCreate failure for supervisorTask", functionName); 
-  }
-
-  /* Create the worker tasks */
-  for (i=0; i<params_.numThreads; i++) {
-    workerWakeEvents_[i] = epicsEventCreate(epicsEventEmpty);
-    workerDoneEvents_[i] = epicsEventCreate(epicsEventEmpty);
-    sprintf(workerTaskName, "workerTask%d", i);
-    pWCS = (workerCreateStruct *)malloc(sizeof(workerCreateStruct));
-    pWCS->pTomoPreprocess = this;
-    pWCS->taskNum = i;
-    workerTaskId = epicsThreadCreate(workerTaskName,
-                       epicsThreadPriorityMedium,
-                       epicsThreadGetStackSize(epicsThreadStackMedium),
-                       (EPICSTHREADFUNC) ::workerTask,
-                       pWCS);
-    if (workerTaskId == 0) {
-      logMsg("%s epicsThreadCreate failure for workerTask %d", functionName, i);
-      return;
+  pFlatScale_ = (float *) malloc(projectionSize * sizeof(float));
+  pDarkScaled_ = (float *) malloc(projectionSize * sizeof(float));
+  for (i=0; i<projectionSize; i++) {
+    pFlatScale_[i] = scaleFactor / pFlat[i];
+    pDarkScaled_[i] = pDark[i] * pFlatScale_[i];
+  }
+  pFlatScaleDelta_ = 0;
+  pDarkScaledDelta_ = 0;
+  pBadPixels_ = 0;
+  badRowStart_ = 0;
+  pPaganinFilter_ = 0;
+  paddedWidth_ = paddedHeight_ = padLeft_ = padTop_ = 0;
+  for (i=0; i<tomoThreadPool::maxWorkers; i++) {
+    pPaganinWorkers_[i] = 0;
+    pZingerWorkers_[i] = 0;
+  }
+  if (params_.phaseRetrieval) createPaganinFilter();
+  if (pFlat2) {
+    pFlatScaleDelta_ = (float *) malloc(projectionSize * sizeof(float));
+    pDarkScaledDelta_ = (float *) malloc(projectionSize * sizeof(float));
+    for (i=0; i<projectionSize; i++) {
+      pFlatScaleDelta_[i] = scaleFactor / pFlat2[i] - pFlatScale_[i];
+      pDarkScaledDelta_[i] = pDark[i] * pFlatScaleDelta_[i];
     }
   }
 
-  // Fill up the toDoQueue with projections to be preprocessed
-  for (i=0; i<params_.numProjections; i++) {
-    toDoMessage.projectionNumber = i;
-    toDoMessage.pIn = pIn;
-    toDoMessage.pOut = pOut;
-    pIn += projectionSize;
-    if (params_.outputDataType == ODT_UInt16)
-      pOut += projectionSize * sizeof(epicsUInt16);
-    else
-      pOut += projectionSize * sizeof(epicsFloat32);
-    status = epicsMessageQueueTrySend(toDoQueue_, &toDoMessage, sizeof(toDoMessage));
-    if (status) {
-      logMsg("%s:, error calling epicsMessageQueueTrySend, status=%d", 
-          functionName, status);
+  selectKernel();
+  if (params_.numThreads < 1) params_.numThreads = 1;
+  bandsLeft_ = (int *) calloc(params_.numProjections, sizeof(int));
+  projectionsQueued_ = (int *) calloc(params_.numProjections, sizeof(int));
+  // Room for all of the projections, plus the extra bands when a few projections are split
+  toDoQueue_ = epicsMessageQueueCreate(params_.numProjections + bandsPerThread*params_.numThreads, sizeof(toDoMessageStruct));
+  idleEvent_ = epicsEventCreate(epicsEventEmpty);
+  doneEvent_ = epicsEventCreate(epicsEventEmpty);
+  mutex_ = epicsMutexCreate();
+  pPool_ = tomoThreadPool::getPool(params_.numThreads);
+}
+
+/** Constructor for the tomoPreprocess class that starts preprocessing all of the projections.
+* Same as the constructor without input and output followed by submitProjections(0, numProjections, pInput, pOutput).
+* \param[in] pPreprocessParams A structure containing the tomography preprocessing parameters
+* \param[in] pDark Dark field [numPixels, numSlices]
+* \param[in] pFlat Flat field with the dark field subtracted [numPixels, numSlices]
+* \param[in] pInput Pointer to input data of inputDataType [numPixels, numSlices, numProjections]
+* \param[out] pOutput Pointer to output data [numPixels, numSlices, numProjections],
+*                     or [numPixels, numProjections, numSlices] with sinogramOutput */
+tomoPreprocess::tomoPreprocess(preprocessParamsStruct *pPreprocessParams, float *pDark, float *pFlat, void *pInput, char *pOutput)
+  : tomoPreprocess(pPreprocessParams, pDark, pFlat)
+{
+  submitProjections(0, params_.numProjections, pInput, pOutput);
+}
+
+/** Function to set the mask of bad (dead or hot) pixels, which are replaced during the normalization.
+* Finds the nearest good pixel to the left, right, above and below each bad pixel, up to maxBadPixelDistance pixels away,
+* and weights them by the inverse of their distance.  The list of bad pixels is sorted by row, so each band repairs only
+* its own bad pixels and the cost is proportional to the number of bad pixels.  A bad pixel with no good neighbours is set to 0.
+* The reciprocal flat is not changed, so a bad pixel with a zero flat field gives inf or NaN in the normalization loop, which
+* repairBadPixels() then overwrites, and a later mask or NULL restores the normal correction of the pixels.
+* Must not be called while projections are being preprocessed; use the constructor without input and output, then
+* setBadPixels(), then submitProjections().
+* \param[in] pMask Mask [numPixels, numSlices]; non-zero for a bad pixel.  NULL removes the mask.
+* \return Number of bad pixels */
+int tomoPreprocess::setBadPixels(epicsUInt8 *pMask)
+{
+  int numPixels = params_.numPixels;
+  int numSlices = params_.numSlices;
+  int projectionSize = numPixels * numSlices;
+  static const int directions[4][2] = {{-1, 0}, {1, 0}, {0, -1}, {0, 1}};
+  badPixel_t *pBad;
+  float weightSum;
+  int numBad = 0;
+  int x, y, nx, ny;
+  int i, k, d;
+  static const char *functionName="tomoPreprocess::setBadPixels";
+
+  free(pBadPixels_);
+  free(badRowStart_);
+  pBadPixels_ = 0;
+  badRowStart_ = 0;
+  if (pMask == 0) return 0;
+  for (i=0; i<projectionSize; i++) {
+    if (pMask[i]) numBad++;
+  }
+  pBadPixels_ = (badPixel_t *) malloc(std::max(numBad, 1) * sizeof(badPixel_t));
+  badRowStart_ = (int *) malloc((numSlices + 1) * sizeof(int));
+  for (y=0, pBad=pBadPixels_; y<numSlices; y++) {
+    badRowStart_[y] = (int)(pBad - pBadPixels_);
+    for (x=0; x<numPixels; x++) {
+      i = y*numPixels + x;
+      if (!pMask[i]) continue;
+      pBad->index = i;
+      pBad->numNeighbours = 0;
+      weightSum = 0;
+      for (k=0; k<4; k++) {
+        for (d=1; d<=maxBadPixelDistance; d++) {
+          nx = x + d*directions[k][0];
+          ny = y + d*directions[k][1];
+          if ((nx < 0) || (nx >= numPixels) || (ny < 0) || (ny >= numSlices)) break;
+          if (pMask[ny*numPixels + nx]) continue;
+          pBad->neighbours[pBad->numNeighbours] = ny*numPixels + nx;
+          pBad->weights[pBad->numNeighbours] = 1.f/d;
+          weightSum += 1.f/d;
+          pBad->numNeighbours++;
+          break;
+        }
+      }
+      for (k=0; k<pBad->numNeighbours; k++) pBad->weights[k] /= weightSum;
+      pBad++;
+    }
+  }
+  badRowStart_[numSlices] = numBad;
+  if (params_.debug) logMsg("%s: %d bad pixels", functionName, numBad);
+  return numBad;
+}
+
+/** Function to queue projections for preprocessing, for example as the detector delivers them.
+* Returns as soon as the projections are queued, waiting only if the toDoQueue already holds numProjections projections.
+* It can be called again before the previous projections are done; poll() and wait() report on all queued projections.
+* \param[in] firstProjection Number of the first projection, 0 to numProjections-1
+* \param[in] numProjections Number of projections
+* \param[in] pInput Pointer to the raw projections of inputDataType [numPixels, numSlices, numProjections]
+* \param[out] pOutput Pointer to the output for all projections [numPixels, numSlices, numProjections in the constructor],
+*                     or [numPixels, numProjections in the constructor, numSlices] with sinogramOutput.
+*                     Projection firstProjection+i is written to its place in the output.
+* \return 0 if the projections were queued, -1 if they are out of range */
+int tomoPreprocess::submitProjections(int firstProjection, int numProjections, void *pInput, char *pOutput)
+{
+  return submitRows(firstProjection, numProjections, 0, params_.numSlices, pInput, pOutput);
+}
+
+/** Function to queue a band of rows (slices) of projections for preprocessing.
+* Only rows firstRow to firstRow+numRows-1 are written, but the zinger removal also reads the rows around them
+* that its median window needs, so the result is the same as preprocessing the whole projection.
+* The rows of each projection are split into work items of bandRows rows, so that a few large projections keep all of
+* the tasks busy.  With bandRows=0 each projection is split into enough bands to give about bandsPerThread work items
+* per thread, of at least minBandRows rows, and projections are not split when there are enough of them.
+* With phaseRetrieval the projections are not split, and each one is filtered whole, even when only some rows are written.
+* \param[in] firstProjection Number of the first projection, 0 to numProjections-1
+* \param[in] numProjections Number of projections
+* \param[in] firstRow First row to preprocess
+* \param[in] numRows Number of rows to preprocess
+* \param[in] pInput Pointer to the whole raw projections of inputDataType [numPixels, numSlices, numProjections]
+* \param[out] pOutput Pointer to the output [numPixels, numRows, numProjections in the constructor],
+*                     or [numPixels, numProjections in the constructor, numRows] with sinogramOutput.
+*                     The rows of projection firstProjection+i are written to its place in the output.
+* \return 0 if the rows were queued, -1 if they are out of range */
+int tomoPreprocess::submitRows(int firstProjection, int numProjections, int firstRow, int numRows,
+                               void *pInput, char *pOutput)
+{
+  toDoMessageStruct toDoMessage;
+  size_t projectionSize = (size_t)params_.numPixels * params_.numSlices * inputPixelSize_;
+  size_t rowSize = (size_t)params_.numPixels * outputPixelSize_;
+  // The rows of a projection are together in the projection layout, and numProjections rows apart in the sinogram layout
+  size_t projectionOffset = params_.sinogramOutput ? rowSize : rowSize * numRows;
+  size_t rowOffset = params_.sinogramOutput ? rowSize * params_.numProjections : rowSize;
+  int bandRows = params_.bandRows;
+  int numBands;
+  int band;
+  int status;
+  int i;
+  static const char *functionName="tomoPreprocess::submitRows";
+
+  if ((firstProjection < 0) || (numProjections < 0) || (firstProjection + numProjections > params_.numProjections)) {
+    logMsg("%s: error, projections %d to %d are out of range, numProjections=%d", 
+           functionName, firstProjection, firstProjection + numProjections - 1, params_.numProjections);
+    return -1;
+  }
+  if ((firstRow < 0) || (numRows < 1) || (firstRow + numRows > params_.numSlices)) {
+    logMsg("%s: error, rows %d to %d are out of range, numSlices=%d", 
+           functionName, firstRow, firstRow + numRows - 1, params_.numSlices);
+    return -1;
+  }
+  if (numProjections == 0) return 0;
+  if (params_.phaseRetrieval) {
+    // The filter needs the whole projection, so splitting it would repeat the FFTs
+    bandRows = numRows;
+  } else if (bandRows <= 0) {
+    numBands = (bandsPerThread*params_.numThreads + numProjections - 1) / numProjections;
+    numBands = std::min(numBands, std::max(numRows / std::max(minBandRows, 4*params_.zingerWidth), 1));
+    bandRows = (numRows + numBands - 1) / numBands;
+  }
+  numBands = (numRows + bandRows - 1) / bandRows;
+  if (params_.debug) logMsg("%s: queuing projections %d to %d, rows %d to %d in %d bands", functionName, 
+                            firstProjection, firstProjection + numProjections - 1, firstRow, firstRow + numRows - 1, numBands);
+  epicsMutexLock(mutex_);
+  if (preprocessComplete_) epicsEventTryWait(doneEvent_);
+  preprocessComplete_ = 0;
+  projectionsRemaining_ += numProjections;
+  bandsRemaining_ += numProjections * numBands;
+  for (i=0; i<numProjections; i++) {
+    bandsLeft_[firstProjection + i] += numBands;
+    projectionsQueued_[firstProjection + i]++;
+  }
+  epicsMutexUnlock(mutex_);
+
+  for (i=0; i<numProjections; i++) {
+    for (band=0; band<numBands; band++) {
+      toDoMessage.projectionNumber = firstProjection + i;
+      toDoMessage.firstRow = firstRow + band*bandRows;
+      toDoMessage.numRows = std::min(bandRows, numRows - band*bandRows);
+      toDoMessage.pIn = (char *)pInput + i * projectionSize;
+      toDoMessage.pOut = pOutput + (firstProjection + i) * projectionOffset + (size_t)band*bandRows * rowOffset;
+      // This waits if the queue is full.  The tasks submitted below are then taking work items from it.
+      status = epicsMessageQueueSend(toDoQueue_, &toDoMessage, sizeof(toDoMessage));
+      if (status) {
+        logMsg("%s:, error calling epicsMessageQueueSend, status=%d", 
+            functionName, status);
+      }
+      // Submit tasks to the thread pool to preprocess the bands
+      epicsMutexLock(mutex_);
+      while ((activeTasks_ < params_.numThreads) && (activeTasks_ < epicsMessageQueuePending(toDoQueue_))) {
+        activeTasks_++;
+        pPool_->submit(this);
+      }
+      epicsMutexUnlock(mutex_);
+    }
+  }
+  return 0;
+}
+
+/** Function that counts a band of a projection as done or cancelled.  Must be called with the mutex locked.
+* A projection is done when all of the bands that were queued for it are done; if it was queued more than once
+* before that, all of those projections are done together.
+* Sets preprocessComplete_ and signals doneEvent_ when there are no bands left.
+* \param[in] projectionNumber Number of the projection of the band
+* \return Number of projections that are now done */
+int tomoPreprocess::bandDone(int projectionNumber)
+{
+  int numDone = 0;
+
+  bandsRemaining_--;
+  if (--bandsLeft_[projectionNumber] == 0) {
+    numDone = projectionsQueued_[projectionNumber];
+    projectionsQueued_[projectionNumber] = 0;
+    projectionsRemaining_ -= numDone;
+  }
+  if (bandsRemaining_ <= 0) {
+    preprocessComplete_ = 1;
+    epicsEventSignal(doneEvent_);
+  }
+  return numDone;
+}
+
+/** Function to wait for all of the projections that have been queued to be preprocessed
+* \param[in] timeout Maximum time to wait in seconds; a negative value waits forever
+* \return 0 if the preprocessing is complete, -1 if the timeout expired first */
+int tomoPreprocess::wait(double timeout)
+{
+  epicsTimeStamp tStart, tNow;
+  double remaining;
+  int complete;
+
+  epicsTimeGetCurrent(&tStart);
+  while (1) {
+    epicsMutexLock(mutex_);
+    complete = preprocessComplete_;
+    epicsMutexUnlock(mutex_);
+    if (complete) break;
+    if (timeout < 0) {
+      epicsEventWait(doneEvent_);
+      continue;
     }
+    epicsTimeGetCurrent(&tNow);
+    remaining = timeout - epicsTimeDiffInSeconds(&tNow, &tStart);
+    if (remaining <= 0) return -1;
+    epicsEventWaitWithTimeout(doneEvent_, remaining);
   }
-  // Send events to start preprocessing
-  if (params_.debug) logMsg("%s: sending events to start preprocessing", functionName);
-  epicsEventSignal(supervisorWakeEvent_);
-  for (i=0; i<params_.numThreads; i++) epicsEventSignal(workerWakeEvents_[i]);
+  // Pass the event on in case another thread is also waiting
+  epicsEventSignal(doneEvent_);
+  return 0;
 }
 
 /** Destructor for the tomoPreprocess class.
-* Calls shutDown() to stop any active preprocessing, which causes workerTasks to exit.
-* Waits for supervisor task to exit, which in turn waits for all workerTasks to exit.
-* Destroys the EPICS message queues, events and mutexes. Closes the debugging file. */
+* Calls shutDown() to stop any active preprocessing, and waits for the tasks in the thread pool to finish.
+* Destroys the EPICS message queue, events and mutexes, and the FFTW plans of the pool threads. Closes the debugging file. */
 tomoPreprocess::~tomoPreprocess() 
 {
   int i;
-  int status;
   static const char *functionName = "tomoPreprocess:~tomoPreprocess";
   
   if (params_.debug) logMsg("%s: entry, shutting down and cleaning up", functionName);
   shutDown();
-  status = epicsEventWait(supervisorDoneEvent_);
-  if (status) {
-    logMsg("%s: error waiting for supervisorDoneEvent=%d", functionName, status);
+  epicsMutexLock(mutex_);
+  while (activeTasks_ > 0) {
+    epicsMutexUnlock(mutex_);
+    epicsEventWait(idleEvent_);
+    epicsMutexLock(mutex_);
   }
+  epicsMutexUnlock(mutex_);
   epicsMessageQueueDestroy(toDoQueue_);
-  epicsMessageQueueDestroy(doneQueue_);
-  epicsEventDestroy(supervisorWakeEvent_);
-  epicsEventDestroy(supervisorDoneEvent_);
-  for (i=0; i<params_.numThreads; i++) {
-    epicsEventDestroy(workerWakeEvents_[i]);
-    epicsEventDestroy(workerDoneEvents_[i]);
-  }
-  free(workerWakeEvents_);
-  free(workerDoneEvents_);
+  epicsEventDestroy(idleEvent_);
+  epicsEventDestroy(doneEvent_);
+  epicsMutexDestroy(mutex_);
+  free(pFlatScale_);
+  free(pDarkScaled_);
+  free(pFlatScaleDelta_);
+  free(pDarkScaledDelta_);
+  free(pBadPixels_);
+  free(badRowStart_);
+  epicsMutexLock(tomoThreadPool::fftwMutex());
+  for (i=0; i<tomoThreadPool::maxWorkers; i++) {
+    if (pPaganinWorkers_[i] == 0) continue;
+    fftwf_destroy_plan(pPaganinWorkers_[i]->forwardPlan);
+    fftwf_destroy_plan(pPaganinWorkers_[i]->backwardPlan);
+    fftwf_free(pPaganinWorkers_[i]->pPadded);
+    free(pPaganinWorkers_[i]);
+  }
+  epicsMutexUnlock(tomoThreadPool::fftwMutex());
+  for (i=0; i<tomoThreadPool::maxWorkers; i++) {
+    if (pZingerWorkers_[i] == 0) continue;
+    free(pZingerWorkers_[i]->pHist);
+    free(pZingerWorkers_[i]->pCopy);
+    free(pZingerWorkers_[i]->pPaddedRows);
+    free(pZingerWorkers_[i]->pValues);
+    free(pZingerWorkers_[i]);
+  }
+  free(pPaganinFilter_);
+  free(bandsLeft_);
+  free(projectionsQueued_);
   if (debugFile_ != stdout) fclose(debugFile_);
 }
 
@@ -170,191 +929,491 @@ void tomoPreprocess::poll(int *pPreprocessComplete, int *pProjectionsRemaining)
   *pProjectionsRemaining = projectionsRemaining_;
 }
 
+/** Function to cancel the preprocessing.
+* Removes the bands that have not been started from the toDoQueue and waits for the bands that are being
+* preprocessed to finish.  Preprocessing is then complete, and the output of the cancelled bands is not written.
+* \return Number of projections that were not completely preprocessed */
+int tomoPreprocess::cancel()
+{
+  toDoMessageStruct toDoMessage;
+  int numCancelled = 0;
+  static const char *functionName="tomoPreprocess::cancel";
+
+  epicsMutexLock(mutex_);
+  while (epicsMessageQueueTryReceive(toDoQueue_, &toDoMessage, sizeof(toDoMessage)) == sizeof(toDoMessage)) {
+    numCancelled += bandDone(toDoMessage.projectionNumber);
+  }
+  // The tasks end when they find the toDoQueue empty
+  while (activeTasks_ > 0) {
+    epicsMutexUnlock(mutex_);
+    epicsEventWait(idleEvent_);
+    epicsMutexLock(mutex_);
+  }
+  epicsMutexUnlock(mutex_);
+  if (params_.debug) logMsg("%s: cancelled %d projections", functionName, numCancelled);
+  return numCancelled;
+}
+
 /** Function to shut down the object
-* Sets the shutDown_ flag and sends an event to wake up the supervisorTask and workerTasks. */
+* Sets the shutDown_ flag, which causes the preprocessing tasks to stop taking projections from the toDoQueue. */
 void tomoPreprocess::shutDown()
 {
-  int i;
-  
-  // Set the shutdown flag
+  epicsMutexLock(mutex_);
   shutDown_ = 1;
-  // Send events to all threads waking them up
-  epicsEventSignal(supervisorWakeEvent_);
-  for (i=0; i<params_.numThreads; i++) epicsEventSignal(workerWakeEvents_[i]);
+  epicsMutexUnlock(mutex_);
 }
 
-/** Supervisor control task that runs as a separate thread. 
-* Reads messages from the workerTasks to update the status of the preprocessing (preprocessingComplete and projectionsRemaining).
-* When shutting down waits for events from workerTasks threads indicating that they have all exited. */
-void tomoPreprocess::supervisorTask()
+/** Function that the thread pool calls to run a preprocessing task.
+* Preprocesses the next band in the toDoQueue, then submits the task again if there are more bands 
+* in the toDoQueue, otherwise the task ends.
+* \param[in] workerNum Number of the pool worker thread running the task */
+void tomoPreprocess::run(int workerNum)
 {
+  toDoMessageStruct toDoMessage;
+  int status = -1;
+  static const char *functionName="tomoPreprocess::run";
+
+  epicsMutexLock(mutex_);
+  if (!shutDown_) status = epicsMessageQueueTryReceive(toDoQueue_, &toDoMessage, sizeof(toDoMessage));
+  epicsMutexUnlock(mutex_);
+  if (status == sizeof(toDoMessage)) {
+    workerTask(&toDoMessage, workerNum);
+  } else if (status != -1) {
+    logMsg("%s:, error calling epicsMessageQueueTryReceive, status=%d", functionName, status);
+  }
+
+  epicsMutexLock(mutex_);
+  if (status == sizeof(toDoMessage)) {
+    bandDone(toDoMessage.projectionNumber);
+    if (preprocessComplete_ && params_.debug) logMsg("%s: Preprocessing complete!", functionName);
+  }
+  if (!shutDown_ && (epicsMessageQueuePending(toDoQueue_) > 0)) {
+    pPool_->submit(this, workerNum);
+  } else {
+    activeTasks_--;
+    if (activeTasks_ == 0) epicsEventSignal(idleEvent_);
+  }
+  // Nothing in this object can be used after the mutex is released, because the destructor may then run
+  epicsMutexUnlock(mutex_);
+}
+
+/** Function that does the dark and flat field normalization of rows of one projection.
+* Computes (pIn - dark) * scaleFactor / flat as pIn * pFlatScale_ - pDarkScaled_, with the reciprocal of the flat
+* computed in the constructor.  There is one version of the loop for each output type, with no branches inside,
+* so the compiler vectorizes it and it runs at about the memory bandwidth.
+* With a second flat field the reciprocal and the scaled dark are interpolated linearly between the two flats by
+* projection number, using the differences computed in the constructor.  The bad pixels set with setBadPixels() are
+* then repaired in the same pass over the rows.
+* \param[in] pIn Pointer to the whole raw projection
+* \param[out] pOut Pointer to the normalized rows
+* \param[in] firstRow First row to normalize
+* \param[in] numRows Number of rows to normalize
+* \param[in] projectionNumber Number of the projection, which selects the weight of the second flat field */
+template <typename inputType, typename outputType>
+void tomoPreprocess::normalize(const inputType *pIn, outputType *pOut, int firstRow, int numRows, int projectionNumber)
+{
+  size_t offset = (size_t)firstRow * params_.numPixels;
+  const inputType *pRaw = pIn + offset;
+  const float *pFlatScale = pFlatScale_ + offset;
+  const float *pDarkScaled = pDarkScaled_ + offset;
+  const float *pFlatScaleDelta;
+  const float *pDarkScaledDelta;
+  int size = params_.numPixels * numRows;
+  float weight;
   int i;
-  int status;
-  doneMessageStruct doneMessage;
-  static const char *functionName="tomoPreprocess::supervisorTask";
 
-  while (1) {
-    if (params_.debug) logMsg("%s: waiting for wake event", functionName);
-    // Wait for a wake event
-    epicsEventWait(supervisorWakeEvent_);
-    if (shutDown_) goto done;
-    // Wait for all the messages to come back, indicating that preprocessing is complete
-    while (projectionsRemaining_ > 0) {
-      if (shutDown_) goto done;
-      status = epicsMessageQueueReceive(doneQueue_, &doneMessage, sizeof(doneMessage));
-      if (status != sizeof(doneMessage)) {
-        logMsg("%s, error reading worker thread message", functionName);
-        continue;
+  if (pFlatScaleDelta_) {
+    pFlatScaleDelta = pFlatScaleDelta_ + offset;
+    pDarkScaledDelta = pDarkScaledDelta_ + offset;
+    weight = (params_.numProjections > 1) ? (float)projectionNumber / (params_.numProjections - 1) : 0.f;
+    for (i=0; i<size; i++) {
+      pOut[i] = convertOutput<outputType>(pRaw[i] * (pFlatScale[i] + weight * pFlatScaleDelta[i]) - 
+                                          (pDarkScaled[i] + weight * pDarkScaledDelta[i]));
+    }
+  } else {
+    weight = 0.f;
+    for (i=0; i<size; i++) {
+      pOut[i] = convertOutput<outputType>(pRaw[i] * pFlatScale[i] - pDarkScaled[i]);
+    }
+  }
+  if (pBadPixels_) repairBadPixels(pIn, pOut, firstRow, numRows, weight);
+}
+
+/** Function that replaces the bad pixels in rows of a projection after the normalization loop.
+* Each bad pixel is the weighted sum of its good neighbours, which are normalized from the raw projection,
+* so neighbours in rows outside the band can be used.
+* \param[in] pIn Pointer to the whole raw projection
+* \param[in,out] pOut Pointer to the normalized rows
+* \param[in] firstRow First row in pOut
+* \param[in] numRows Number of rows in pOut
+* \param[in] weight Weight of the second flat field for this projection */
+template <typename inputType, typename outputType>
+void tomoPreprocess::repairBadPixels(const inputType *pIn, outputType *pOut, int firstRow, int numRows, float weight)
+{
+  int offset = firstRow * params_.numPixels;
+  badPixel_t *pBad;
+  float flatScale, darkScaled;
+  float value;
+  int n;
+  int i, k;
+
+  for (i=badRowStart_[firstRow]; i<badRowStart_[firstRow + numRows]; i++) {
+    pBad = &pBadPixels_[i];
+    value = 0;
+    for (k=0; k<pBad->numNeighbours; k++) {
+      n = pBad->neighbours[k];
+      flatScale = pFlatScale_[n];
+      darkScaled = pDarkScaled_[n];
+      if (pFlatScaleDelta_) {
+        flatScale += weight * pFlatScaleDelta_[n];
+        darkScaled += weight * pDarkScaledDelta_[n];
       }
-      projectionsRemaining_--;
+      value += pBad->weights[k] * (pIn[n] * flatScale - darkScaled);
     }
-    if (params_.debug) logMsg("%s: All projections complete!", functionName);
-    preprocessComplete_ = 1;
-    if (params_.debug) logMsg("%s: Preprocessing complete!", functionName);
-  }
-  done:
-  // Wait for the worker threads to exit before setting the preprocessing complete flag.
-  // They will exit because the toDoQueue is now empty
-  for (i=0; i<params_.numThreads; i++) {
-    if (params_.debug) logMsg("%s: Beginning wait for worker task %d to complete, eventId=%p", 
-          functionName, i, workerDoneEvents_[i]);
-    status = epicsEventWaitWithTimeout(workerDoneEvents_[i], 1.0);
-    if (status != epicsEventWaitOK) {
-      logMsg("%s: Error waiting for worker task %d to complete, eventId=%p, status=%d", 
-          functionName, i, workerDoneEvents_[i], status);
+    pOut[pBad->index - offset] = convertOutput<outputType>(value);
+  }
+}
+
+/** Function that preprocesses the rows of one projection in a toDoQueue message.
+* When the rows are not the whole projection and zingers are removed, the rows that the median window needs
+* above and below them are also normalized, into a temporary buffer, and only the rows in the message are copied
+* to the output.  With ZM_Block these are the rows to the edges of the zingerWidth blocks, so the blocks are the same
+* as for the whole projection.  The rows also go through the buffer for sinogramOutput and takeLog, see preprocessBuffered().
+* With phaseRetrieval the whole projection is normalized and filtered, and the rows in the message are written.
+* ODT_Float16 rows are also preprocessed as float in the buffer.
+* There is one instantiation for each inputType and outputType, and the constructor selects the one that workerTask() calls.
+* \param[in] pToDoMessage Message from the toDoQueue with the projection and rows to preprocess
+* \param[in] workerNum Number of the pool worker thread, which selects its zinger and phase retrieval buffers
+* \param[out] pNormalizeTime Time spent on normalization
+* \return Number of zingers that were replaced */
+template <typename inputType, typename outputType>
+int tomoPreprocess::preprocessRows(toDoMessageStruct *pToDoMessage, int workerNum, double *pNormalizeTime)
+{
+  typedef typename rowTypeOf<outputType>::type rowType;
+  const inputType *pIn = (const inputType *)pToDoMessage->pIn;
+  outputType *pOut = (outputType *)pToDoMessage->pOut;
+  int firstRow = pToDoMessage->firstRow;
+  int numRows = pToDoMessage->numRows;
+  int zw = params_.zingerWidth;
+  int haloFirst = firstRow;
+  int haloEnd = firstRow + numRows;
+  float scaleFactor = params_.scaleFactor;
+  float zingerThreshold = params_.zingerThreshold;
+  int numZingers = 0;
+  epicsTime tStart;
+
+  if ((scaleFactor != 0.) && (scaleFactor != 1.)) zingerThreshold *= scaleFactor;
+  if ((zw > 0) && (params_.zingerThreshold > 0.0)) {
+    if (params_.zingerMode == ZM_Sliding) {
+      haloFirst = std::max(firstRow - zw/2, 0);
+      haloEnd = std::min(firstRow + numRows + zw/2, params_.numSlices);
+    } else {
+      haloFirst = firstRow / zw * zw;
+      haloEnd = std::min((firstRow + numRows + zw - 1) / zw * zw, params_.numSlices);
+    }
+  }
+  if (params_.phaseRetrieval) {
+    haloFirst = 0;
+    haloEnd = params_.numSlices;
+  }
+  if (params_.takeLog || params_.phaseRetrieval) {
+    return preprocessBuffered<epicsFloat32>(pToDoMessage, pIn, pOut, haloFirst, haloEnd, zingerThreshold, workerNum, 
+                                            pNormalizeTime);
+  }
+  if (params_.sinogramOutput || (haloFirst != firstRow) || (haloEnd != firstRow + numRows) ||
+      !std::is_same<rowType, outputType>::value) {
+    return preprocessBuffered<rowType>(pToDoMessage, pIn, pOut, haloFirst, haloEnd, zingerThreshold, workerNum, 
+                                       pNormalizeTime);
+  }
+  // rowType is outputType here
+  tStart = epicsTime::getCurrent();
+  normalize(pIn, (rowType *)pOut, firstRow, numRows, pToDoMessage->projectionNumber);
+  *pNormalizeTime = epicsTime::getCurrent() - tStart;
+  if ((zw > 0) && (params_.zingerThreshold > 0.0)) {
+    numZingers = removeZingers((rowType *)pOut, numRows, zingerThreshold, workerNum);
+  }
+  return numZingers;
+}
+
+/** Function that preprocesses the rows of one projection in a temporary buffer of rowType, and then writes them to the output
+* with writeRows().  rowType is epicsFloat32 with takeLog and phaseRetrieval, so that the filter and the log use the unrounded
+* normalized value.
+* \param[in] pToDoMessage Message from the toDoQueue with the projection and rows to preprocess
+* \param[in] pIn Pointer to the whole raw projection
+* \param[out] pOut Pointer to the output rows
+* \param[in] haloFirst First row to normalize, including the rows that zinger removal needs
+* \param[in] haloEnd Row after the last row to normalize
+* \param[in] zingerThreshold Threshold in units of the normalized data
+* \param[in] workerNum Number of the pool worker thread, which selects its zinger and phase retrieval buffers
+* \param[out] pNormalizeTime Time spent on normalization
+* \return Number of zingers that were replaced */
+template <typename rowType, typename inputType, typename outputType>
+int tomoPreprocess::preprocessBuffered(toDoMessageStruct *pToDoMessage, const inputType *pIn, outputType *pOut,
+                                       int haloFirst, int haloEnd, float zingerThreshold, int workerNum,
+                                       double *pNormalizeTime)
+{
+  int numPixels = params_.numPixels;
+  int numZingers = 0;
+  std::vector<rowType> rows((size_t)numPixels * (haloEnd - haloFirst));
+  epicsTime tStart;
+
+  tStart = epicsTime::getCurrent();
+  normalize(pIn, rows.data(), haloFirst, haloEnd - haloFirst, pToDoMessage->projectionNumber);
+  *pNormalizeTime = epicsTime::getCurrent() - tStart;
+  if ((params_.zingerWidth > 0) && (params_.zingerThreshold > 0.0)) {
+    numZingers = removeZingers(rows.data(), haloEnd - haloFirst, zingerThreshold, workerNum);
+  }
+  if (params_.phaseRetrieval) retrievePhase(rows.data(), workerNum);
+  writeRows(rows.data() + (size_t)(pToDoMessage->firstRow - haloFirst) * numPixels, pOut, pToDoMessage->numRows);
+  return numZingers;
+}
+
+/** Function that writes preprocessed rows to the output, taking the -log with takeLog.
+* With sinogramOutput each row is written to its sinogram, numProjections rows apart in the output.  The pixels of a row
+* are contiguous in both layouts, so this transposes whole rows, each of which is a contiguous write.
+* With takeLog the output is -log((pIn - dark)/flat) * scaleFactor, or 0 where (pIn - dark)/flat <= 0, which is what
+* tomoRecon::sinogram() computes with sinoScale = 1/scaleFactor.
+* \param[in] pRows Pointer to the preprocessed rows
+* \param[out] pOut Pointer to the first output row
+* \param[in] numRows Number of rows */
+template <typename rowType, typename outputType>
+void tomoPreprocess::writeRows(const rowType *pRows, outputType *pOut, int numRows)
+{
+  int numPixels = params_.numPixels;
+  size_t outputRowStride = params_.sinogramOutput ? (size_t)params_.numProjections * numPixels : numPixels;
+  float scaleFactor = (params_.scaleFactor == 0.) ? 1.f : params_.scaleFactor;
+  float logScale = logf(scaleFactor);
+  const rowType *pRow;
+  outputType *pDest;
+  float value;
+  int i, j;
+
+  for (i=0, pRow=pRows, pDest=pOut; i<numRows; i++, pRow+=numPixels, pDest+=outputRowStride) {
+    if (params_.takeLog) {
+      for (j=0; j<numPixels; j++) {
+        value = pRow[j];
+        pDest[j] = convertOutput<outputType>((value > 0) ? scaleFactor * (logScale - logf(value)) : 0.f);
+      }
+    } else {
+      for (j=0; j<numPixels; j++) pDest[j] = convertOutput<outputType>(pRow[j]);
     }
   }
-  // Send a signal to the destructor that the supervisor task is done
-  if (params_.debug) logMsg("%s: Exiting supervisor task.", functionName);
-  epicsEventSignal(supervisorDoneEvent_);
 }
 
-/** Worker task that runs as a separate thread. Multiple worker tasks can be running simultaneously.
- * Each workerTask thread preprocesses projections that it gets from the toDoQueue, and sends messages to
- * the supervisorTask via the doneQueue after preprocessing the projection.
- * \param[in] taskNum Task number (0 to numThreads-1) for this tread; used to into arrays of event numbers in the object.
+/** Function that preprocesses one band of a projection.  Multiple pool worker threads can be running it simultaneously.
+ * \param[in] pToDoMessage Message from the toDoQueue with the band to preprocess
+ * \param[in] workerNum Number of the pool worker thread running the task
  */
-void tomoPreprocess::workerTask(int taskNum)
+void tomoPreprocess::workerTask(toDoMessageStruct *pToDoMessage, int workerNum)
 {
-  toDoMessageStruct toDoMessage;
-  doneMessageStruct doneMessage;
-  epicsEventId wakeEvent = workerWakeEvents_[taskNum];
-  epicsEventId doneEvent = workerDoneEvents_[taskNum];
   epicsTime tStart, tStop;
-  int status;
+  double normalizeTime, zingerTime;
+  int numZingers;
   static const char *functionName="tomoPreprocess::workerTask";
   
-  while (1) {
-    if (params_.debug) logMsg("%s: %s waiting for wake event", functionName, epicsThreadGetNameSelf());
-    // Wait for an event signalling that preprocessing has started or exiting
-    epicsEventWait(wakeEvent);
-    if (shutDown_) goto done;
-    while (1) {
-      status = epicsMessageQueueTryReceive(toDoQueue_, &toDoMessage, sizeof(toDoMessage));
-      if (status == -1) break;
-      if (status != sizeof(toDoMessage)) {
-        logMsg("%s:, error calling epicsMessageQueueReceive, status=%d", functionName, status);
-        break;
-      }
-      tStart = epicsTime::getCurrent();
-      
-      epicsUInt16 *pIn = toDoMessage.pIn;
-      epicsUInt16 *pOutUInt16 = (epicsUInt16 *) toDoMessage.pOut;
-      epicsFloat32 *pOutFloat32 = (epicsFloat32 *) toDoMessage.pOut;
-      int projectionSize = params_.numPixels * params_.numSlices;
-      int numZingers=0;
-      float ratio;
-      float scaleFactor = params_.scaleFactor;
-      if (scaleFactor == 1) scaleFactor = 0.;
-      float zingerThreshold = params_.zingerThreshold;
-      if (scaleFactor != 0.) zingerThreshold *= scaleFactor;
-      
-      for (int i=0; i<projectionSize; i++) {
-        ratio = (pIn[i] - pDark_[i]) / pFlat_[i];
-        if (scaleFactor != 0.) {
-          ratio *= scaleFactor;
-        }
-        if (params_.outputDataType == ODT_UInt16) {
-          pOutUInt16[i] = (epicsUInt16) ratio;
-        } else {
-          pOutFloat32[i] = ratio;
-        }
-      }
+  tStart = epicsTime::getCurrent();
+  numZingers = (this->*preprocessKernel_)(pToDoMessage, workerNum, &normalizeTime);
+  tStop = epicsTime::getCurrent();
+  zingerTime = tStop - tStart - normalizeTime;
+  if (params_.debug) { 
+    logMsg("%s:, thread=%s, projection=%d, rows=%d-%d, normalize time=%f, zinger time=%f, numZingers=%d", 
+        functionName, epicsThreadGetNameSelf(), pToDoMessage->projectionNumber,
+        pToDoMessage->firstRow, pToDoMessage->firstRow + pToDoMessage->numRows - 1,
+        normalizeTime, zingerTime, numZingers);
+  }
+}
 
-      tStop = epicsTime::getCurrent();
-      doneMessage.normalizeTime = tStop - tStart;
-
-      tStart = epicsTime::getCurrent();
-      int zw = params_.zingerWidth;
-      std::vector<float> windowValues(zw*zw, 0);
-      size_t windowSize2 = windowValues.size()/2;
-      auto medianTarget = windowValues.begin() + windowSize2;
-      // Zinger correction
-      // Outer loops move averaging window through the image
-      if ((zw > 0) && (params_.zingerThreshold > 0.0)) {
-        for (int i=0; i<params_.numSlices; i+=zw) {
-          for (int j=0; j<params_.numPixels; j+=zw) {
-            // First inner loops calculate the median of the pixels in the averaging window
-            int m = 0;
-            for (int k=0; k<zw; k++) {
-              int iy = std::min(i+k, params_.numSlices-1) * params_.numPixels;
-              for (int l=0; l<zw; l++) {
-                int ix = std::min(j+l, params_.numPixels-1);
-                if (params_.outputDataType == ODT_UInt16) {
-                  windowValues[m++] = pOutUInt16[iy + ix];
-                } else {
-                  windowValues[m++] = pOutFloat32[iy + ix];
-                }
-              }
-            }
-            std::nth_element(windowValues.begin(), medianTarget, windowValues.end());
-            float median = windowValues[windowSize2];
-            // Next inner loops replace pixels which are more than threshold above the median with the median
-            for (int k=0; k<zw; k++) {
-              int iy = std::min(i+k, params_.numSlices-1) * params_.numPixels;
-              for (int l=0; l<zw; l++) {
-                if (params_.outputDataType == ODT_UInt16) {
-                  int ix = std::min(j+l, params_.numPixels-1);
-                  if ( (pOutUInt16[iy + ix] - median) > zingerThreshold) {
-                    numZingers++;
-                    pOutUInt16[iy + ix] = (epicsUInt16) median;
-                  }
-                } else {
-                  int ix = std::min(j+l, params_.numPixels-1);
-                  if ( (pOutFloat32[iy + ix] - median) > zingerThreshold) {
-                    numZingers++;
-                    pOutFloat32[iy + ix] = median;
-                  }
-                }
-              }
-            }        
-          }
-        }
-      }
+/** Function that removes the zingers from rows of a normalized projection with the method selected by zingerMode.
+* \param[in,out] pOut Pointer to the normalized rows
+* \param[in] numRows Number of rows
+* \param[in] zingerThreshold Threshold in units of the output
+* \param[in] workerNum Number of the pool worker thread, which selects its ZM_Sliding scratch buffers
+* \return Number of zingers that were replaced */
+template <typename outputType>
+int tomoPreprocess::removeZingers(outputType *pOut, int numRows, float zingerThreshold, int workerNum)
+{
+  int numPixels = params_.numPixels;
+  int zw = params_.zingerWidth;
+  zingerWorker_t *pWorker = pZingerWorkers_[workerNum];
 
-      tStop = epicsTime::getCurrent();
-      doneMessage.zingerTime = tStop - tStart;
-      doneMessage.projectionNumber = toDoMessage.projectionNumber;
-      status = epicsMessageQueueTrySend(doneQueue_, &doneMessage, sizeof(doneMessage));
-      if (status) {
-        logMsg("%s:, error calling epicsMessageQueueTrySend, status=%d", functionName, status);
+  if (params_.zingerMode == ZM_Sliding) {
+    // A thread runs one task at a time, so its buffers are not shared
+    if (pWorker == 0) pWorker = pZingerWorkers_[workerNum] = (zingerWorker_t *) calloc(1, sizeof(zingerWorker_t));
+    return slidingZingers(pOut, numPixels, numRows, zw/2, zingerThreshold, pWorker);
+  }
+  return blockZingers(pOut, numPixels, numRows, zw, zingerThreshold);
+}
+
+/** Function that selects preprocessRows() for inputType and the output data type, and sets the output pixel size.
+* Output data types other than ODT_UInt16 and ODT_Float16 are written as ODT_Float32. */
+template <typename inputType>
+void tomoPreprocess::selectOutputKernel()
+{
+  static const char *functionName="tomoPreprocess::selectOutputKernel";
+
+  switch (params_.outputDataType) {
+    case ODT_UInt16:
+      preprocessKernel_ = &tomoPreprocess::preprocessRows<inputType, epicsUInt16>;
+      outputPixelSize_ = sizeof(epicsUInt16);
+      break;
+    case ODT_Float16:
+      preprocessKernel_ = &tomoPreprocess::preprocessRows<inputType, tomoFloat16>;
+      outputPixelSize_ = sizeof(tomoFloat16);
+      break;
+    default:
+      if (params_.outputDataType != ODT_Float32) {
+        logMsg("%s: error, outputDataType=%d is not supported, using ODT_Float32", functionName, params_.outputDataType);
       }
-      if (params_.debug) { 
-        logMsg("%s:, thread=%s, projection=%d, normalize time=%f, zinger time=%f, numZingers=%d", 
-            functionName, epicsThreadGetNameSelf(), doneMessage.projectionNumber,
-            doneMessage.normalizeTime, doneMessage.zingerTime, numZingers);
+      preprocessKernel_ = &tomoPreprocess::preprocessRows<inputType, epicsFloat32>;
+      outputPixelSize_ = sizeof(epicsFloat32);
+  }
+}
+
+/** Function that selects preprocessRows() for the input and output data types, called once by the constructor.
+* The work items then call it through preprocessKernel_, and do not test the data types for each band or pixel. */
+void tomoPreprocess::selectKernel()
+{
+  static const char *functionName="tomoPreprocess::selectKernel";
+
+  switch (params_.inputDataType) {
+    case RDT_UInt8:
+      selectOutputKernel<epicsUInt8>();
+      inputPixelSize_ = sizeof(epicsUInt8);
+      break;
+    case RDT_UInt32:
+      selectOutputKernel<epicsUInt32>();
+      inputPixelSize_ = sizeof(epicsUInt32);
+      break;
+    default:
+      if (params_.inputDataType != RDT_UInt16) {
+        logMsg("%s: error, inputDataType=%d is not supported, using RDT_UInt16", functionName, params_.inputDataType);
       }
-      if (shutDown_) break;
+      selectOutputKernel<epicsUInt16>();
+      inputPixelSize_ = sizeof(epicsUInt16);
+  }
+}
+
+/** Function that computes the Paganin phase retrieval filter and the padding of the projections, called by the constructor.
+* The filter is 1/(1 + pi*wavelength*propagationDistance*deltaOverBeta*f^2) at spatial frequency f, so its kernel decays
+* with a length of sqrt(pi*wavelength*propagationDistance*deltaOverBeta)/(2*pi).  The projections are padded by
+* paganinPadLengths of these on each side, and then up to sizes for which FFTW is fast, rather than to twice their size.
+* The filter includes the 1/(paddedWidth*paddedHeight) that the FFTs leave out, and is shared by all of the threads.
+* If pixelSize, propagationDistance, energy or deltaOverBeta is not positive the filter would do nothing, so phaseRetrieval
+* is cleared and the projections are preprocessed without it. */
+void tomoPreprocess::createPaganinFilter()
+{
+  int numPixels = params_.numPixels;
+  int numSlices = params_.numSlices;
+  double pixelSize = params_.pixelSize;
+  double wavelength;
+  double a;
+  double decayLength;
+  double fx, fy, norm;
+  int complexWidth;
+  int margin;
+  int i, j;
+  static const char *functionName="tomoPreprocess::createPaganinFilter";
+
+  if ((pixelSize <= 0) || (params_.propagationDistance <= 0) || (params_.energy <= 0) || (params_.deltaOverBeta <= 0)) {
+    logMsg("%s: error, pixelSize=%f, propagationDistance=%f, energy=%f and deltaOverBeta=%f must be positive, "
+           "phase retrieval is disabled", functionName, params_.pixelSize, params_.propagationDistance, params_.energy,
+           params_.deltaOverBeta);
+    params_.phaseRetrieval = 0;
+    return;
+  }
+  wavelength = hc / params_.energy;
+  a = pi * wavelength * params_.propagationDistance * params_.deltaOverBeta;
+  decayLength = sqrt(a) / (2*pi);
+  margin = (int)ceil(paganinPadLengths * decayLength / pixelSize);
+  padLeft_ = std::min(margin, numPixels);
+  padTop_ = std::min(margin, numSlices);
+  paddedWidth_ = goodFFTSize(numPixels + 2*padLeft_);
+  paddedHeight_ = goodFFTSize(numSlices + 2*padTop_);
+  complexWidth = paddedWidth_/2 + 1;
+  pPaganinFilter_ = (float *) malloc((size_t)paddedHeight_ * complexWidth * sizeof(float));
+  norm = 1. / ((double)paddedWidth_ * paddedHeight_);
+  for (j=0; j<paddedHeight_; j++) {
+    fy = ((j <= paddedHeight_/2) ? j : j - paddedHeight_) / (paddedHeight_ * pixelSize);
+    for (i=0; i<complexWidth; i++) {
+      fx = i / (paddedWidth_ * pixelSize);
+      pPaganinFilter_[(size_t)j*complexWidth + i] = (float)(norm / (1. + a*(fx*fx + fy*fy)));
     }
   }
-  done:
-  epicsEventSignal(doneEvent);
-  if (params_.debug) {
-    logMsg("tomoPreprocess::workerTask %s exiting, eventId=%p", 
-        epicsThreadGetNameSelf(), doneEvent);
+  if (params_.debug) logMsg("%s: kernel decay length=%f pixels, padded size=%d x %d", 
+                            functionName, decayLength/pixelSize, paddedWidth_, paddedHeight_);
+}
+
+/** Function that creates the phase retrieval buffer and FFTW plans of the pool worker thread that calls it.
+* The buffer is first touched by this thread, so with pinned threads it is on the thread's NUMA node.
+* The planner is not thread safe, so the plans are created with tomoThreadPool::fftwMutex().  With FR_Measure or FR_Patient
+* the first thread measures the plans and the others create theirs from the FFTW wisdom that this leaves, which is
+* shared by the process.
+* \return Pointer to the paganinWorker_t structure, which the destructor frees */
+paganinWorker_t *tomoPreprocess::createPaganinWorker()
+{
+  size_t complexSize = (size_t)paddedHeight_ * (paddedWidth_/2 + 1);
+  paganinWorker_t *pWorker = (paganinWorker_t *) malloc(sizeof(paganinWorker_t));
+  unsigned fftwFlags;
+  static const char *functionName="tomoPreprocess::createPaganinWorker";
+
+  switch (params_.fftwRigor) {
+    case FR_Measure: fftwFlags = FFTW_MEASURE; break;
+    case FR_Patient: fftwFlags = FFTW_PATIENT; break;
+    default:         fftwFlags = FFTW_ESTIMATE;
   }
+  pWorker->pPadded = (float *) fftwf_malloc(complexSize * sizeof(fftwf_complex));
+  epicsMutexLock(tomoThreadPool::fftwMutex());
+  pWorker->forwardPlan = fftwf_plan_dft_r2c_2d(paddedHeight_, paddedWidth_, pWorker->pPadded, 
+                                               (fftwf_complex *)pWorker->pPadded, fftwFlags);
+  pWorker->backwardPlan = fftwf_plan_dft_c2r_2d(paddedHeight_, paddedWidth_, (fftwf_complex *)pWorker->pPadded, 
+                                                pWorker->pPadded, fftwFlags);
+  epicsMutexUnlock(tomoThreadPool::fftwMutex());
+  if (params_.debug) logMsg("%s: %s created FFTW plans for %d x %d", 
+                            functionName, epicsThreadGetNameSelf(), paddedWidth_, paddedHeight_);
+  return pWorker;
 }
 
+/** Function that does Paganin single-distance phase retrieval of a normalized projection.
+* Copies the projection into the middle of the padded buffer of this thread, repeating the edge pixels into the padding
+* so that the periodic FFT does not see steps at the edges, does the forward FFT, multiplies by the filter, does the
+* inverse FFT, and copies the middle back.  The -log is taken afterwards by writeRows() with takeLog, or by tomoRecon.
+* \param[in,out] pRows Pointer to the whole normalized projection [numPixels, numSlices]
+* \param[in] workerNum Number of the pool worker thread, which selects its buffer and plans */
+template <typename rowType>
+void tomoPreprocess::retrievePhase(rowType *pRows, int workerNum)
+{
+  int numPixels = params_.numPixels;
+  int numSlices = params_.numSlices;
+  int rowStride = 2*(paddedWidth_/2 + 1);
+  size_t complexSize = (size_t)paddedHeight_ * (paddedWidth_/2 + 1);
+  paganinWorker_t *pWorker = pPaganinWorkers_[workerNum];
+  const rowType *pSource;
+  rowType *pDest;
+  float *pPadded;
+  float *pRow;
+  size_t k;
+  int i, j;
+
+  // A thread runs one task at a time, so its buffer is not shared
+  if (pWorker == 0) pWorker = pPaganinWorkers_[workerNum] = createPaganinWorker();
+  pPadded = pWorker->pPadded;
+  for (j=0, pRow=pPadded; j<paddedHeight_; j++, pRow+=rowStride) {
+    pSource = pRows + (size_t)std::min(std::max(j - padTop_, 0), numSlices - 1) * numPixels;
+    for (i=0; i<padLeft_; i++) pRow[i] = pSource[0];
+    std::copy(pSource, pSource + numPixels, pRow + padLeft_);
+    for (i=padLeft_ + numPixels; i<paddedWidth_; i++) pRow[i] = pSource[numPixels - 1];
+  }
+  fftwf_execute(pWorker->forwardPlan);
+  for (k=0; k<complexSize; k++) {
+    pPadded[2*k]   *= pPaganinFilter_[k];
+    pPadded[2*k+1] *= pPaganinFilter_[k];
+  }
+  fftwf_execute(pWorker->backwardPlan);
+  for (j=0, pDest=pRows; j<numSlices; j++, pDest+=numPixels) {
+    pRow = pPadded + (size_t)(j + padTop_) * rowStride + padLeft_;
+    for (i=0; i<numPixels; i++) pDest[i] = convertOutput<rowType>(pRow[i]);
+  }
+}
 
 /** Logs messages.
  * Adds time stamps to each message.
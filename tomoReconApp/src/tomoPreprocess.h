@@ -4,6 +4,7 @@
  * C++ class for doing computed tomography preprocessing.
  *
  * This runs the preprocessing using multiple threads, each thread preprocessing a set of projections
+ * The threads are in the tomoThreadPool, which is shared with other tomoRecon and tomoPreprocess objects.
  *
  * It uses the EPICS libCom library for OS-independent functions for threads, mutexes, message queues, etc.
  *
@@ -12,86 +13,230 @@
  * Created: December 31, 2022
  */
 
+#include <fftw3.h>
+
 #include <epicsMessageQueue.h>
 #include <epicsTypes.h>
 #include <epicsThread.h>
 
-// Output data type
+#include "tomoThreadPool.h"
+
+// Output data type.  tomoRecon.h defines the same enum, so both headers can be included.
+#ifndef ODT_T_DEFINED
+#define ODT_T_DEFINED
 typedef enum {
   ODT_Float32,
-  ODT_UInt16
+  ODT_UInt16,
+  ODT_Int16,
+  ODT_Float16    /**< IEEE half precision; tomoPreprocess output only */
 } ODT_t;
+#endif
 
-/** Structure that is passed from the constructor to the workerTasks in the toDoQueue */
+// FFTW planning rigor.  tomoRecon.h defines the same enum, so both headers can be included.
+#ifndef FR_T_DEFINED
+#define FR_T_DEFINED
+typedef enum {
+  FR_Default,  /**< tomoRecon: use the machine profile if there is one, otherwise FR_Measure; tomoPreprocess: FR_Estimate */
+  FR_Estimate,
+  FR_Measure,
+  FR_Patient
+} FR_t;
+#endif
+
+// Data type of the raw projections, dark and flat frames
+typedef enum {
+  RDT_UInt16,   /**< 16-bit unsigned, also for 12-bit detectors; the default */
+  RDT_UInt8,    /**< 8-bit unsigned */
+  RDT_UInt32    /**< 32-bit unsigned */
+} RDT_t;
+
+// Method for reducing a stack of dark or flat frames to one frame
+typedef enum {
+  SR_Mean,      /**< Mean of the frames */
+  SR_Median     /**< Median of the frames, which ignores zingers in a few of them */
+} SR_t;
+
+// Zinger removal method
+typedef enum {
+  ZM_Block,     /**< Compare each pixel to the median of its zingerWidth x zingerWidth block; the blocks do not overlap */
+  ZM_Sliding    /**< Compare each pixel to the median of the window centered on it */
+} ZM_t;
+
+/** Structure that is passed from submitRows to the workerTasks in the toDoQueue, for one band of rows of a projection */
 struct toDoMessageStruct {
   int projectionNumber;  /**< Number of this projection */
-  epicsUInt16 *pIn;      /**< Pointer to raw projection */
-  char *pOut;            /**< Pointer to normalized output */
+  int firstRow;          /**< First row (slice) to preprocess */
+  int numRows;           /**< Number of rows to preprocess */
+  void *pIn;             /**< Pointer to the whole raw projection, of inputDataType */
+  char *pOut;            /**< Pointer to normalized output for the rows */
 };
 
-/** Structure that is passed from the workerTask to the supervisorTask in the doneQueue */
-struct doneMessageStruct {
-  int projectionNumber;  /**< Number of this projection */
-  double normalizeTime;  /**< Time required for dark and flat normalization */
-  double zingerTime;     /**< Time required for zinger removal */
-};
+/** A bad pixel and the good neighbouring pixels that replace it, computed by tomoPreprocess::setBadPixels */
+typedef struct {
+  int index;             /**< Index of the bad pixel in the projection */
+  int numNeighbours;     /**< Number of good neighbours, 0 to 4 */
+  int neighbours[4];     /**< Index of each neighbour in the projection */
+  float weights[4];      /**< Weight of each neighbour; the weights add up to 1 */
+} badPixel_t;
+
+/** Buffer and FFTW plans of one pool worker thread for phase retrieval, created by the thread the first time it needs them */
+typedef struct {
+  float *pPadded;             /**< Padded projection [paddedWidth, paddedHeight], transformed in place, so each row
+                                   has room for paddedWidth/2+1 complex values */
+  fftwf_plan forwardPlan;     /**< Real to complex 2-D FFT of pPadded */
+  fftwf_plan backwardPlan;    /**< Complex to real 2-D FFT of pPadded */
+} paganinWorker_t;
+
+/** Histogram of 16-bit values with a running median, for zinger removal with ZM_Sliding.
+* fine has a bin for each value and coarse a bin for each 256 values.  median is moved from its previous value,
+* which is close for overlapping windows, skipping the empty coarse bins, so finding it takes a few steps. */
+typedef struct {
+  int fine[65536];  /**< Number of values in the window equal to each value */
+  int coarse[256];  /**< Number of values in the window in each block of 256 values */
+  int median;       /**< Current median */
+  int below;        /**< Number of values in the window that are less than median */
+} medianHistogram_t;
+
+/** Scratch buffers of one pool worker thread for zinger removal with ZM_Sliding, created by the thread the first time
+* it needs them.  The buffers are grown when a band needs more, and are kept for the life of the tomoPreprocess object. */
+typedef struct {
+  medianHistogram_t *pHist;   /**< Histogram for UInt16 output; it is empty again when each band is done */
+  void *pCopy;                /**< Copy of the band before the zingers are replaced */
+  size_t copySize;            /**< Size of pCopy in bytes */
+  void *pPaddedRows;          /**< Rows of the window with the edge pixels repeated, for Float32 output */
+  size_t paddedRowsSize;      /**< Size of pPaddedRows in bytes */
+  void *pValues;              /**< Values in the window of each pixel in a row, for Float32 output */
+  size_t valuesSize;          /**< Size of pValues in bytes */
+} zingerWorker_t;
 
 /** Structure that is passed to the constructor to define the preprocessing 
     NOTE: This structure must match the structure defined in IDL in tomo_preprocess_params__define.pro! 
+    New fields must be added at the end, where 0 selects the previous behaviour, because tomoPreprocessCreateIDL
+    sets the fields after the end of an older IDL structure to 0.
  */
 struct preprocessParamsStruct {
   int numPixels;            /**< Number of horizontal pixels in the input data */
   int numSlices;            /**< Number of slices in the input data */
   int numProjections;       /**< Number of projection angles in the input data */
-  int numThreads;           /**< Number of workerTask threads to create */
+  int numThreads;           /**< Number of pool threads to use for preprocessing */
   int zingerWidth;          /**< Smoothing width for zinger removal */
   float zingerThreshold;    /**< Threshold for zinger removal */
   float scaleFactor;        /**< Scale factor to multiply normalized data by */
-  int outputDataType;       /**< Output data type, ODT_t enum */
+  int outputDataType;       /**< Output data type, ODT_t enum; ODT_Float32, ODT_UInt16 or ODT_Float16 */
   int debug;                /**< Debug output level; 0: only error messages, 1: debugging from tomoPreprocess */
   char debugFileName[256];  /**< Name of file for debugging output;  use 0 length string ("") to send output to stdout */
-};
-
-/** Structure that is used to create a worker task.  This is the structure passed to epicsThreadCreate() */
-struct workerCreateStruct {
-  class tomoPreprocess *pTomoPreprocess; /**< Pointer to the tomoPreprocess object */
-  int taskNum;                           /**< Task number that is passed to tomoPreprocess::workerTask */
+  int zingerMode;           /**< Zinger removal method, ZM_t enum.  ZM_Sliding uses a window of 2*(zingerWidth/2)+1 pixels,
+                                 so an even zingerWidth is rounded up. */
+  int sinogramOutput;       /**< Set to 1 to write the output sinogram-major [numPixels, numProjections, numSlices], so that
+                                 tomoRecon with tomoParams_t.sinogramInput reads each sinogram row contiguously */
+  int takeLog;              /**< Set to 1 to write -log((input - dark)/flat) * scaleFactor instead of the normalized data.
+                                 Zingers are removed before the log.  Use scaleFactor=1 for ODT_Float32
+                                 output.  tomoRecon then needs tomoParams_t.fluorescence=1. */
+  int bandRows;             /**< Number of rows in each work item; 0 splits the projections into bands only when there are
+                                 too few projections to keep numThreads threads busy */
+  int phaseRetrieval;       /**< Set to 1 for Paganin single-distance phase retrieval of each projection after zinger removal.
+                                 Each projection is then one work item.  Use with takeLog, or tomoRecon takes the log. */
+  float pixelSize;          /**< Detector pixel size in cm, for phaseRetrieval */
+  float propagationDistance;/**< Sample to detector distance in cm, for phaseRetrieval */
+  float energy;             /**< X-ray energy in keV, for phaseRetrieval */
+  float deltaOverBeta;      /**< Ratio of the real (delta) to the imaginary (beta) part of the refractive index decrement of
+                                 the sample, for phaseRetrieval */
+  int inputDataType;        /**< Data type of the raw projections, RDT_t enum */
+  int fftwRigor;            /**< FR_t rigor of the FFTW plans for phaseRetrieval.  FR_Default selects FR_Estimate, because
+                                 the plans are created while holding tomoThreadPool::fftwMutex(), which measuring a large
+                                 2-D plan would hold for seconds. */
 };
 
 /** Class to do tomography preprocessing.
-* Creates a supervisorTask that supervises the preprocessing process, and a set of workerTask threads
-* that do the dark field correction, flat field correction, and zinger removal.
-* When the class is created it can be used to preprocess many projections in a single call, and does
-* the preprocessing using multiple threads and cores.  The preprocess function can be called 
-* repeatedly to preprocess more sets projections.  Once the object is created it is restricted to
-* preprocessinging with the same set of parameters, with the exception of the zinger threshold.  
+* Submits tasks to the tomoThreadPool that do the dark field correction, flat field correction, and zinger removal.
+* Each task preprocesses one band of rows of a projection from the toDoQueue and then submits itself again while there are
+* bands left, so at most numThreads pool threads work on this object at once, and a few large projections are shared by
+* all of them.  Each band also normalizes the rows around it that zinger removal needs.
+* The object is created once with the dark and flat fields, and submitProjections() then queues projections as they
+* are acquired, so preprocessing keeps up with the acquisition.  The constructor with input and output queues all
+* of the projections at once.  poll() and wait() report on all of the projections that have been queued.
+* With sinogramOutput and takeLog the output is written as sinograms with the -log already taken, so that tomoRecon does
+* not have to gather and take the log of each sinogram row.
+* The flat field can be interpolated per projection between flats collected before and after the scan, and
+* reduceFrames() averages or medians stacks of dark and flat frames with the pool threads.
+* The raw data can be 8, 16 or 32-bit integers, and the output float, half float or 16-bit integers.  The per-pixel
+* functions are templates, and the constructor selects the one for the input and output types, so each combination
+* has its own loops.
+* setBadPixels() sets a mask of dead and hot pixels, which are replaced by their good neighbours during the normalization.
+* With phaseRetrieval each projection is low-pass filtered with the Paganin filter before the log is taken, so propagation
+* based phase contrast scans do not need a separate phase retrieval step.  Each pool thread has its own FFTW plans.
+* Once the object is created it is restricted to preprocessing with the same set of parameters, dark and flat.
 * If the preprocessing parameters change (number of X pixels, number of projections, etc.) 
 * then the tomoPreprocess object must be deleted and a new one created.
 */
-class tomoPreprocess {
+class tomoPreprocess : public tomoPoolTask {
 public:
-  tomoPreprocess(preprocessParamsStruct *pPreprocessParams, float *pDark, float *pFlat, epicsUInt16 *pInput, char *pOutput);
+  tomoPreprocess(preprocessParamsStruct *pPreprocessParams, float *pDark, float *pFlat, float *pFlat2=0);
+  static int reduceFrames(int numPixels, int numSlices, int numFrames, void *pFrames, int method, int numThreads,
+                          float *pDark, float *pOutput, int inputDataType=RDT_UInt16);
+  tomoPreprocess(preprocessParamsStruct *pPreprocessParams, float *pDark, float *pFlat, void *pInput, char *pOutput);
   virtual ~tomoPreprocess();
-  virtual void supervisorTask();
-  virtual void workerTask(int taskNum);
+  virtual int setBadPixels(epicsUInt8 *pMask);
+  virtual int submitProjections(int firstProjection, int numProjections, void *pInput, char *pOutput);
+  virtual int submitRows(int firstProjection, int numProjections, int firstRow, int numRows,
+                         void *pInput, char *pOutput);
+  virtual int wait(double timeout);
+  virtual void run(int workerNum);
+  virtual void workerTask(toDoMessageStruct *pToDoMessage, int workerNum);
+  template <typename inputType, typename outputType> int preprocessRows(toDoMessageStruct *pToDoMessage, int workerNum,
+                                                                        double *pNormalizeTime);
+  template <typename rowType, typename inputType, typename outputType>
+  int preprocessBuffered(toDoMessageStruct *pToDoMessage, const inputType *pIn, outputType *pOut, int haloFirst, int haloEnd,
+                         float zingerThreshold, int workerNum, double *pNormalizeTime);
+  template <typename rowType, typename outputType> void writeRows(const rowType *pRows, outputType *pOut, int numRows);
+  template <typename inputType, typename outputType> void normalize(const inputType *pIn, outputType *pOut, int firstRow,
+                                                                    int numRows, int projectionNumber);
+  template <typename inputType, typename outputType> void repairBadPixels(const inputType *pIn, outputType *pOut,
+                                                                          int firstRow, int numRows, float weight);
+  template <typename outputType> int removeZingers(outputType *pOut, int numRows, float zingerThreshold, int workerNum);
+  template <typename rowType> void retrievePhase(rowType *pRows, int workerNum);
   virtual void poll(int *pPreprocessComplete, int *pProjectionsRemaining);
+  virtual int cancel();
   virtual void logMsg(const char *pFormat, ...);
 
 private:
   void shutDown();
+  int bandDone(int projectionNumber);
+  void createPaganinFilter();
+  paganinWorker_t *createPaganinWorker();
+  void selectKernel();
+  template <typename inputType> void selectOutputKernel();
   preprocessParamsStruct params_;
-  float *pDark_;
-  float *pFlat_;
+  /** preprocessRows() for the input and output types, selected once by the constructor */
+  int (tomoPreprocess::*preprocessKernel_)(toDoMessageStruct *pToDoMessage, int workerNum, double *pNormalizeTime);
+  size_t inputPixelSize_;
+  size_t outputPixelSize_;
+  float *pFlatScale_;
+  float *pDarkScaled_;
+  float *pFlatScaleDelta_;
+  float *pDarkScaledDelta_;
+  badPixel_t *pBadPixels_;
+  int *badRowStart_;
+  int paddedWidth_;
+  int paddedHeight_;
+  int padLeft_;
+  int padTop_;
+  float *pPaganinFilter_;
+  paganinWorker_t *pPaganinWorkers_[tomoThreadPool::maxWorkers];
+  zingerWorker_t *pZingerWorkers_[tomoThreadPool::maxWorkers];
   int debug_;
   FILE *debugFile_;
   int preprocessComplete_;
   int projectionsRemaining_;
+  int bandsRemaining_;
+  int *bandsLeft_;
+  int *projectionsQueued_;
   int shutDown_;
+  int activeTasks_;
+  tomoThreadPool *pPool_;
   epicsMessageQueueId toDoQueue_;
-  epicsMessageQueueId doneQueue_;
-  epicsEventId supervisorWakeEvent_;
-  epicsEventId supervisorDoneEvent_;
-  epicsEventId *workerWakeEvents_;
-  epicsEventId *workerDoneEvents_;
+  epicsEventId idleEvent_;
+  epicsEventId doneEvent_;
+  epicsMutexId mutex_;
 };
 
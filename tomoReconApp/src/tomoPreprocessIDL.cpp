@@ -8,6 +8,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 
 #include "tomoPreprocess.h"
@@ -17,24 +18,131 @@
 // We use static variables because IDL does not really handle passing pointers (though it can be faked with LongLong type)
 // and because the IDL variable for preprocessParams can disappear, it does not have the required lifetime.
 static tomoPreprocess *pTomoPreprocess = 0;
+// Size of the IDL preprocessParamsStruct; the structure before R2-0 ended before zingerMode
+static size_t preprocessParamsSize = offsetof(preprocessParamsStruct, zingerMode);
 
 extern "C" {
-/** Function to create a tomoPreprocess object from IDL. 
+/** Function to set the size of the IDL structure that is passed to tomoPreprocessCreateIDL.
+ * Only that part of preprocessParamsStruct is copied, and the fields after it are set to 0, so IDL code written
+ * for an older preprocessParamsStruct keeps working.  If this is not called the structure is assumed to end
+ * before zingerMode, as it did before R2-0.
  * \param[in] argc Number of parameters = 1
  * \param[in] argv Array of pointers.<br/>
+ *            argv[0] = Pointer to the size of the structure in bytes, n_tags(preprocessParams, /length) */
+epicsShareFunc void epicsShareAPI tomoPreprocessParamsSizeIDL(int argc, char *argv[])
+{
+  int *pSize = (int *)argv[0];
+
+  preprocessParamsSize = *pSize;
+  if (preprocessParamsSize > sizeof(preprocessParamsStruct)) preprocessParamsSize = sizeof(preprocessParamsStruct);
+}
+
+/** Function to create a tomoPreprocess object from IDL. 
+ * \param[in] argc Number of parameters = 3, 4, 5 or 6
+ * \param[in] argv Array of pointers.<br/>
  *            argv[0] = Pointer to a preprocessParamsStruct structure, which defines the preprocessing parameters <br/>
+ *            argv[1] = Pointer to the dark field <br/>
+ *            argv[2] = Pointer to the flat field <br/>
+ *            With 4 or 6 parameters: <br/>
+ *            argv[3] = Pointer to the second flat field, which is interpolated with the first one by projection <br/>
+ *            With 5 or 6 parameters, after the flat fields: <br/>
+ *            Pointer to the input projections <br/>
+ *            Pointer to the output projections <br/>
+ * With 5 or 6 parameters all of the projections are preprocessed.  With 3 or 4 parameters the projections are passed
+ * later with tomoPreprocessSubmitIDL.
+ * Call tomoPreprocessParamsSizeIDL first with the size of the IDL structure if it has the fields from zingerMode on.
  * These arguments are copied to static variables in this file, because the IDL variables could be deleted
  * and returned to the heap while the tomoPreprocess object still exists. */
 epicsShareFunc void epicsShareAPI tomoPreprocessCreateIDL(int argc, char *argv[])
 {
-  preprocessParamsStruct *pPreprocessParams = (preprocessParamsStruct *)argv[0];
+  preprocessParamsStruct preprocessParams;
   float *pDark     = (float *)argv[1];
   float *pFlat     = (float *)argv[2];
-  epicsUInt16 *pIn = (epicsUInt16 *)argv[3];
-  char *pOut       = (char *)argv[4];
+  float *pFlat2    = ((argc == 4) || (argc == 6)) ? (float *)argv[3] : 0;
   
+  // The tomoPreprocess object copies the parameters
+  memset(&preprocessParams, 0, sizeof(preprocessParams));
+  memcpy(&preprocessParams, argv[0], preprocessParamsSize);
   if (pTomoPreprocess) delete pTomoPreprocess;
-  pTomoPreprocess = new tomoPreprocess(pPreprocessParams, pDark, pFlat, pIn, pOut);
+  pTomoPreprocess = new tomoPreprocess(&preprocessParams, pDark, pFlat, pFlat2);
+  if (argc >= 5) {
+    pTomoPreprocess->submitProjections(0, preprocessParams.numProjections, 
+                                       (void *)argv[argc-2], (char *)argv[argc-1]);
+  }
+}
+
+/** Function to reduce a stack of dark or flat frames to one frame.
+ * \param[in] argc Number of parameters = 6 or 7
+ * \param[in] argv Array of pointers.<br/>
+ *            argv[0] = Pointer to a preprocessParamsStruct structure, whose numPixels, numSlices, numThreads and
+ *                      inputDataType are used <br/>
+ *            argv[1] = Pointer to int numFrames <br/>
+ *            argv[2] = Pointer to the frames of inputDataType [numPixels, numSlices, numFrames] <br/>
+ *            argv[3] = Pointer to int method, SR_Mean (0) or SR_Median (1) <br/>
+ *            argv[4] = Pointer to the reduced frame [numPixels, numSlices] <br/>
+ *            argv[5] = Pointer to int status; 0 if the frames were reduced <br/>
+ *            argv[6] = Pointer to the dark field to subtract from the reduced frame; optional */
+epicsShareFunc void epicsShareAPI tomoPreprocessReduceFramesIDL(int argc, char *argv[])
+{
+  preprocessParamsStruct *pPreprocessParams = (preprocessParamsStruct *)argv[0];
+  int *pNumFrames      =         (int *)argv[1];
+  void *pFrames        =        (void *)argv[2];
+  int *pMethod         =         (int *)argv[3];
+  float *pOutput       =       (float *)argv[4];
+  int *pStatus         =         (int *)argv[5];
+  float *pDark         = (argc >= 7) ? (float *)argv[6] : 0;
+
+  *pStatus = tomoPreprocess::reduceFrames(pPreprocessParams->numPixels, pPreprocessParams->numSlices, *pNumFrames, pFrames,
+                                          *pMethod, pPreprocessParams->numThreads, pDark, pOutput,
+                                          pPreprocessParams->inputDataType);
+}
+
+/** Function to set the bad pixel mask of the tomoPreprocess object created with tomoPreprocessCreateIDL with 3 or 4 arguments.
+ * Must be called before tomoPreprocessSubmitIDL.
+ * \param[in] argc Number of parameters = 2
+ * \param[in] argv Array of pointers. <br/>
+ *            argv[0] = Pointer to the byte mask [numPixels, numSlices]; non-zero for a bad pixel <br/>
+ *            argv[1] = Pointer to int numBadPixels, which gives the number of bad pixels in the mask */
+epicsShareFunc void epicsShareAPI tomoPreprocessSetBadPixelsIDL(int argc, char *argv[])
+{
+  epicsUInt8 *pMask = (epicsUInt8 *)argv[0];
+  int *pNumBadPixels =      (int *)argv[1];
+
+  if (pTomoPreprocess == 0) return;
+  *pNumBadPixels = pTomoPreprocess->setBadPixels(pMask);
+}
+
+/** Function to queue projections for preprocessing with the tomoPreprocess object created with tomoPreprocessCreateIDL.
+ * The input and output IDL variables must exist until the projections have been preprocessed.
+ * \param[in] argc Number of parameters = 4
+ * \param[in] argv Array of pointers. <br/>
+ *            argv[0] = Pointer to int firstProjection <br/>
+ *            argv[1] = Pointer to int numProjections <br/>
+ *            argv[2] = Pointer to the input projections of inputDataType [numPixels, numSlices, numProjections] <br/>
+ *            argv[3] = Pointer to the output for all of the projections */
+epicsShareFunc void epicsShareAPI tomoPreprocessSubmitIDL(int argc, char *argv[])
+{
+  int *pFirstProjection = (int *)argv[0];
+  int *pNumProjections  = (int *)argv[1];
+  void *pIn             = (void *)argv[2];
+  char *pOut            = (char *)argv[3];
+
+  if (pTomoPreprocess == 0) return;
+  pTomoPreprocess->submitProjections(*pFirstProjection, *pNumProjections, pIn, pOut);
+}
+
+/** Function to wait for the projections that have been queued to be preprocessed.
+ * \param[in] argc Number of parameters = 2
+ * \param[in] argv Array of pointers. <br/>
+ *            argv[0] = Pointer to float timeout in seconds; a negative value waits forever <br/>
+ *            argv[1] = Pointer to int preprocessComplete; 1 if preprocessing is complete, 0 if the timeout expired first */
+epicsShareFunc void epicsShareAPI tomoPreprocessWaitIDL(int argc, char *argv[])
+{
+  float *pTimeout          = (float *)argv[0];
+  int *pPreprocessComplete =   (int *)argv[1];
+
+  if (pTomoPreprocess == 0) return;
+  *pPreprocessComplete = (pTomoPreprocess->wait(*pTimeout) == 0);
 }
 
 /** Function to delete the tomoPreprocess object created with tomoPreprocessCreateIDL.
@@ -47,6 +155,19 @@ epicsShareFunc void epicsShareAPI tomoPreprocessDeleteIDL(int argc, char *argv[]
   pTomoPreprocess = 0;
 }
 
+/** Function to cancel the preprocessing started with tomoPreprocessCreateIDL.
+ * Returns when the projections that were being preprocessed have finished.
+ * \param[in] argc Number of parameters = 1
+ * \param[in] argv Array of pointers. <br/>
+ *            argv[0] = Pointer to int numCancelled, which gives the number of projections that were not preprocessed. */
+epicsShareFunc void epicsShareAPI tomoPreprocessCancelIDL(int argc, char *argv[])
+{
+  int *pNumCancelled = (int *)argv[0];
+
+  if (pTomoPreprocess == 0) return;
+  *pNumCancelled = pTomoPreprocess->cancel();
+}
+
 /** Function to poll the status of a preprocessing started with tomoPreprocessRunIDL.
  * \param[in] argc Number of parameters = 2
  * \param[in] argv Array of pointers. <br/>
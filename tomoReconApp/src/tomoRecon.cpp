@@ -4,6 +4,7 @@
  * C++ class for doing computed tomographdeby reconstruction using Gridrec.
  *
  * This runs the reconstruction using multiple threads, each thread reconstructing a set of slices.
+ * The threads are in the tomoThreadPool, which is shared with other tomoRecon and tomoPreprocess objects.
  *
  * It uses the EPICS libCom library for OS-independent functions for threads, mutexes, message queues, etc.
  *
@@ -14,57 +15,124 @@
 #include <stdlib.h>
 #include <math.h>
 #include <stdarg.h>
+#include <algorithm>
 
 #include <epicsTime.h>
 #include <epicsThread.h>
 #include <epicsTypes.h>
+#include <epicsAtomic.h>
 
 #include "tomoRecon.h"
 
+/** Allocates a zeroed buffer of floats for a worker, with huge pages if they are requested and available.
+* \param[in] numElements Number of floats
+* \param[in] hugePages HP_t method
+* \param[out] pInfo How the buffer was allocated */
+static float *allocBuffer(size_t numElements, int hugePages, hugePageInfo_t *pInfo)
+{
+  float *pBuffer = (float *) tomoHugePageAlloc(numElements * sizeof(float), hugePages, pInfo);
 
-extern "C" {
-static void supervisorTask(void *pPvt)
+  if (pBuffer == 0) pBuffer = (float *) calloc(numElements, sizeof(float));
+  return pBuffer;
+}
+
+/** Frees a buffer allocated with allocBuffer() */
+static void freeBuffer(float *pBuffer, hugePageInfo_t *pInfo)
 {
-  tomoRecon *pTomoRecon = (tomoRecon *)pPvt;
-  pTomoRecon->supervisorTask();
+  if (pInfo->mapSize) tomoHugePageFree(pBuffer, pInfo);
+  else free(pBuffer);
 }
 
-static void workerTask(workerCreateStruct *pWCS)
+static tomoReconStats_t classStats[tomoThreadPool::numClasses];
+static double classLatencySum[tomoThreadPool::numClasses];
+static epicsTimeStamp statsStartTime;
+static epicsMutexId statsMutex = 0;
+static epicsThreadOnceId statsOnce = EPICS_THREAD_ONCE_INIT;
+
+extern "C" {
+static void createStatistics(void *pPvt)
 {
-  pWCS->pTomoRecon->workerTask(pWCS->taskNum);
-  free(pWCS);
+  statsMutex = epicsMutexCreate();
+  epicsTimeGetCurrent(&statsStartTime);
 }
 } // extern "C"
 
+/** Adds slices that were reconstructed to the statistics of a priority class
+* \param[in] priorityClass PC_t priority class
+* \param[in] numSlices Number of slices
+* \param[in] threadTime Thread seconds spent on them */
+static void addSliceStatistics(int priorityClass, int numSlices, double threadTime)
+{
+  epicsMutexLock(statsMutex);
+  classStats[priorityClass].numSlices += numSlices;
+  classStats[priorityClass].threadTime += threadTime;
+  epicsMutexUnlock(statsMutex);
+}
+
+/** Adds a chunk that was completed to the statistics of a priority class
+* \param[in] priorityClass PC_t priority class
+* \param[in] latency Seconds from queuing the chunk to writing its last slice */
+static void addChunkStatistics(int priorityClass, double latency)
+{
+  epicsMutexLock(statsMutex);
+  classStats[priorityClass].numChunks++;
+  classLatencySum[priorityClass] += latency;
+  if (latency > classStats[priorityClass].maxLatency) classStats[priorityClass].maxLatency = latency;
+  epicsMutexUnlock(statsMutex);
+}
+
+static bool sortPairLess(const sortPair_t &a, const sortPair_t &b)
+{
+  return a.value < b.value;
+}
+
+/** Type used to select the IDT_UInt12Packed version of sinogram().  Each one holds 2 pixels. */
+typedef struct {
+  epicsUInt8 bytes[3];
+} mono12Packed_t;
+
+/** Returns pixel j of an input row as a float */
+template <typename inputType>
+static inline float inputPixel(const char *pRow, int j)
+{
+  return (float)((const inputType *)pRow)[j];
+}
+
+/** Mono12Packed version of inputPixel(), which unpacks the pixel from the 3 bytes shared with its neighbour.
+ * The first byte holds bits 11-4 of the even pixel, the third byte bits 11-4 of the odd pixel,
+ * and the middle byte the low 4 bits of the even pixel (bits 3-0) and of the odd pixel (bits 7-4). */
+template <>
+inline float inputPixel<mono12Packed_t>(const char *pRow, int j)
+{
+  const epicsUInt8 *p = (const epicsUInt8 *)pRow + (j >> 1)*3;
+  if (j & 1) return (float)((p[2] << 4) | (p[1] >> 4));
+  return (float)((p[0] << 4) | (p[1] & 0xF));
+}
+
 
 /** Constructor for the tomoRecon class.
-* Creates the message queues for passing messages to and from the workerTask threads.
-* Creates the thread that execute the supervisorTask function, 
-* and numThreads threads that execute the workerTask function.
+* Creates the message queue for passing slices to the reconstruction tasks.
+* Makes sure the shared tomoThreadPool has at least numThreads threads.
 * \param[in] pTomoParams A structure containing the tomography reconstruction parameters
 * \param[in] pAngles Array of projection angles in degrees */
 tomoRecon::tomoRecon(tomoParams_t *pTomoParams, float *pAngles)
-  : pTomoParams_(pTomoParams),
-    numPixels_(pTomoParams_->numPixels),
-    numSlices_(pTomoParams_->numSlices),
-    numProjections_(pTomoParams_->numProjections),
-    inputDataType_(pTomoParams_->inputDataType),
-    outputDataType_(pTomoParams_->outputDataType),
-    paddedWidth_(pTomoParams_->paddedSinogramWidth),
-    numThreads_(pTomoParams_->numThreads),
+  : params_(*pTomoParams),
+    pTomoParams_(&params_),
     pAngles_(pAngles),
-    queueElements_((numSlices_+1)/2),
-    debug_(pTomoParams_->debug),
+    nextChunkId_(0),
+    lastChunk_(0),
+    maxGeometries_(pTomoParams->gridCacheSize),
+    geometryUseCount_(0),
+    debug_(pTomoParams->debug),
     reconComplete_(1),
-    shutDown_(0)
+    slicesRemaining_(0),
+    sliceCallback_(0),
+    sliceCallbackPvt_(0),
+    shutDown_(0),
+    activeTasks_(0)
 
 {
-  epicsThreadId supervisorTaskId;
-  char workerTaskName[32];
-  epicsThreadId workerTaskId;
-  workerCreateStruct *pWCS;
   char *debugFileName = pTomoParams_->debugFileName;
-  int i;
   static const char *functionName="tomoRecon::tomoRecon";
 
   debugFile_ = stdout;
@@ -72,98 +140,580 @@ tomoRecon::tomoRecon(tomoParams_t *pTomoParams, float *pAngles)
     debugFile_ = fopen(debugFileName, "w");
   }
   
-  if (debug_) logMsg("%s: entry, creating message queues, events, threads, etc.", functionName);
- 
-  toDoQueue_ = epicsMessageQueueCreate(queueElements_, sizeof(toDoMessage_t));
-  doneQueue_ = epicsMessageQueueCreate(queueElements_, sizeof(doneMessage_t));
-  workerWakeEvents_ = (epicsEventId *) malloc(numThreads_ * sizeof(epicsEventId));
-  workerDoneEvents_ = (epicsEventId *) malloc(numThreads_ * sizeof(epicsEventId));
-  supervisorWakeEvent_ = epicsEventCreate(epicsEventEmpty);
-  supervisorDoneEvent_ = epicsEventCreate(epicsEventEmpty);
-  fftwMutex_ = epicsMutexCreate();
-
-  /* Create the thread for the supervisor task */
-  supervisorTaskId = epicsThreadCreate("supervisorTask",
-                                epicsThreadPriorityMedium,
-                                epicsThreadGetStackSize(epicsThreadStackMedium),
-                                (EPICSTHREADFUNC) ::supervisorTask,
-                                this);
-  if (supervisorTaskId == 0) {
-    logMsg("%s: epicsThreadCreate failure for supervisorTask", functionName); 
-  }
-
-  /* Create the worker tasks */
-  for (i=0; i<numThreads_; i++) {
-    workerWakeEvents_[i] = epicsEventCreate(epicsEventEmpty);
-    workerDoneEvents_[i] = epicsEventCreate(epicsEventEmpty);
-    sprintf(workerTaskName, "workerTask%d", i);
-    pWCS = (workerCreateStruct *)malloc(sizeof(workerCreateStruct));
-    pWCS->pTomoRecon = this;
-    pWCS->taskNum = i;
-    workerTaskId = epicsThreadCreate(workerTaskName,
-                       epicsThreadPriorityMedium,
-                       epicsThreadGetStackSize(epicsThreadStackMedium),
-                       (EPICSTHREADFUNC) ::workerTask,
-                       pWCS);
-    if (workerTaskId == 0) {
-      logMsg("%s epicsThreadCreate failure for workerTask %d", functionName, i);
-      return;
-    }
-  } 
+  if (debug_) logMsg("%s: entry, creating message queue, events, etc.", functionName);
+
+  epicsThreadOnce(&statsOnce, createStatistics, 0);
+  idleEvent_ = epicsEventCreate(epicsEventEmpty);
+  doneEvent_ = epicsEventCreate(epicsEventEmpty);
+  chunkFreeEvent_ = epicsEventCreate(epicsEventEmpty);
+  mutex_ = epicsMutexCreate();
+  if (maxGeometries_ < 1) maxGeometries_ = 4;
+  geometries_ = (reconGeometry_t *) calloc(maxGeometries_, sizeof(reconGeometry_t));
+  configure();
+  createChunks();
+  selectGeometry();
 }
 
 /** Destructor for the tomoRecon class.
-* Calls shutDown() to stop any active reconstruction, which causes workerTasks to exit.
-* Waits for supervisor task to exit, which in turn waits for all workerTasks to exit.
-* Destroys the EPICS message queues, events and mutexes. Closes the debugging file. */
+* Calls shutDown() to stop any active reconstruction, and waits for the tasks in the thread pool to finish.
+* Deletes the grid objects and buffers of the pool worker threads for all of the cached geometries.
+* Destroys the EPICS message queue, events and mutexes. Closes the debugging file. */
 tomoRecon::~tomoRecon() 
 {
   int i;
-  int status;
   static const char *functionName = "tomoRecon:~tomoRecon";
   
   if (debug_) logMsg("%s: entry, shutting down and cleaning up", functionName);
   shutDown();
-  status = epicsEventWait(supervisorDoneEvent_);
-  if (status) {
-    logMsg("%s: error waiting for supervisorDoneEvent=%d", functionName, status);
+  epicsMutexLock(mutex_);
+  while (activeTasks_ > 0) {
+    epicsMutexUnlock(mutex_);
+    epicsEventWait(idleEvent_);
+    epicsMutexLock(mutex_);
   }
-  epicsMessageQueueDestroy(toDoQueue_);
-  epicsMessageQueueDestroy(doneQueue_);
-  epicsEventDestroy(supervisorWakeEvent_);
-  epicsEventDestroy(supervisorDoneEvent_);
-  for (i=0; i<numThreads_; i++) {
-    epicsEventDestroy(workerWakeEvents_[i]);
-    epicsEventDestroy(workerDoneEvents_[i]);
-  }
-  free(workerWakeEvents_);
-  free(workerDoneEvents_);
-  epicsMutexDestroy(fftwMutex_);
+  epicsMutexUnlock(mutex_);
+  for (i=0; i<maxGeometries_; i++) {
+    deleteGeometry(&geometries_[i]);
+  }
+  free(geometries_);
+  deleteChunks();
+  epicsEventDestroy(idleEvent_);
+  epicsEventDestroy(doneEvent_);
+  epicsEventDestroy(chunkFreeEvent_);
+  epicsMutexDestroy(mutex_);
   if (debugFile_ != stdout) fclose(debugFile_);
 }
 
+/** Function to return a copy of a tomoParams_t structure with the parameters that are 0 taken from the machine profile */
+static tomoParams_t profileParams(tomoParams_t *pTomoParams)
+{
+  tomoParams_t params = *pTomoParams;
+
+  tomoRecon::applyProfile(&params, 0);
+  return params;
+}
+
+/** Function to estimate the memory that a tomoRecon object uses, without creating it.
+* Each thread has a grid object, whose largest buffer is the complex M x M array for the 2-D FFT, two padded
+* sinograms and two reconstructions, and with RM_Sort the buffers for sorting the sinogram.  The total is numThreads
+* times that, plus the input and output arrays of a call to reconstruct() with numSlices slices, plus the queue.
+* The grid objects that reconfigure() keeps for other geometries are not included.
+* The parameters that are 0 are taken from the machine profile, as the object would do.
+* \param[in] pTomoParams A structure containing the tomography reconstruction parameters
+* \param[out] pThreadBytes Bytes used by each thread
+* \param[out] pTotalBytes Bytes used by the object with numThreads threads, including the input and output */
+void tomoRecon::estimateMemory(tomoParams_t *pTomoParams, double *pThreadBytes, double *pTotalBytes)
+{
+  tomoParams_t params = profileParams(pTomoParams);
+  int numPixels = params.numPixels;
+  int numSlices = params.numSlices;
+  int numProjections = params.numProjections;
+  int paddedWidth = params.paddedSinogramWidth;
+  int numThreads = params.numThreads;
+  int maxChunks = params.maxChunks;
+  int numAngles = numProjections;
+  int imageWidth = numPixels;
+  float sampl = params.sampl;
+  float ROI = params.ROI;
+  float MaxPixSiz = params.MaxPixSiz;
+  long nDet, pdim, M, M02, M0, itmp;
+  double gridBytes, bufferBytes, inputBytes, outputBytes;
+
+  if (params.offsetAxis) {
+    numAngles = numProjections/2;
+    imageWidth = 2*numPixels;
+  }
+  if (numThreads < 1) numThreads = 1;
+  if (numThreads > tomoThreadPool::maxWorkers) numThreads = tomoThreadPool::maxWorkers;
+  if (maxChunks < 1) maxChunks = 2;
+  if (sampl <= 0) sampl = 1;
+  if (ROI <= 0) ROI = 1;
+  if (MaxPixSiz <= 0) MaxPixSiz = 1;
+
+  // These are the sizes that the grid constructor computes from what createWorker() passes it
+  nDet = paddedWidth;
+  if (paddedWidth/2 != 0) nDet--;
+  pdim = 1;
+  itmp = nDet-1;
+  while (itmp > 0) {
+    pdim <<= 1;
+    itmp >>= 1;
+  }
+  M = 1;
+  itmp = (long)(sampl*ROI*nDet/MaxPixSiz - 1);
+  while (itmp > 0) {
+    M <<= 1;
+    itmp >>= 1;
+  }
+  M02 = (long)floor(M/2/sampl - 0.5);
+  M0 = 2*M02 + 1;
+
+  gridBytes = sizeof(fftwf_complex)*((double)M*M + pdim + pdim/2) + sizeof(complex *)*M +
+              sizeof(float)*(2.*(params.ltbl + 1) + M0 + 2*numAngles);
+  bufferBytes = sizeof(float)*(2.*paddedWidth*numProjections + 2.*M0*M0) + sizeof(float *)*(2.*numProjections + 2*M0);
+  if ((params.ringMethod == RM_Sort) && (params.ringWidth > 0)) {
+    bufferBytes += (sizeof(float) + sizeof(int))*(double)paddedWidth*numProjections + sizeof(sortPair_t)*numProjections +
+                   sizeof(float)*((double)paddedWidth + params.ringWidth);
+  }
+  switch (params.inputDataType) {
+    case IDT_UInt16:       inputBytes = 2;   break;
+    case IDT_UInt8:        inputBytes = 1;   break;
+    case IDT_UInt12Packed: inputBytes = 1.5; break;
+    default:               inputBytes = 4;
+  }
+  inputBytes *= (double)numPixels*numSlices*numProjections;
+  outputBytes = (params.outputDataType == ODT_Float32) ? 4 : 2;
+  outputBytes *= (double)imageWidth*imageWidth*numSlices;
+
+  *pThreadBytes = gridBytes + bufferBytes;
+  *pTotalBytes = numThreads * *pThreadBytes + inputBytes + outputBytes + 
+                 sizeof(toDoMessage_t)*(double)numSlices*maxChunks;
+}
+
+/** Function to choose numThreads and numSlices so that estimateMemory() fits in tomoParams_t.memoryBudget.
+* numSlices is reduced first, but not below 2*numThreads so that each thread still has a pair of slices to reconstruct,
+* then numThreads.  The caller then allocates the input and output for the new numSlices and reconstructs in batches.
+* Does nothing if memoryBudget is 0.  Otherwise the parameters that are 0 are first taken from the machine profile.
+* \param[in,out] pTomoParams A structure containing the tomography reconstruction parameters
+* \return 0 if the parameters fit in the budget, -1 if they do not fit even with 1 thread and 1 slice */
+int tomoRecon::fitMemoryBudget(tomoParams_t *pTomoParams)
+{
+  double budgetBytes = pTomoParams->memoryBudget*1024.*1024.;
+  double threadBytes, totalBytes;
+
+  if (pTomoParams->memoryBudget <= 0) return 0;
+  applyProfile(pTomoParams, 0);
+  if (pTomoParams->numThreads < 1) pTomoParams->numThreads = 1;
+  if (pTomoParams->numSlices < 1) pTomoParams->numSlices = 1;
+  while (1) {
+    estimateMemory(pTomoParams, &threadBytes, &totalBytes);
+    if (totalBytes <= budgetBytes) return 0;
+    if (pTomoParams->numSlices > 2*pTomoParams->numThreads) pTomoParams->numSlices--;
+    else if (pTomoParams->numThreads > 1) pTomoParams->numThreads--;
+    else if (pTomoParams->numSlices > 1) pTomoParams->numSlices--;
+    else return -1;
+  }
+}
+
+/** Function to get the reconstruction statistics of a priority class, for all tomoRecon objects in the process.
+* \param[in] priorityClass PC_t priority class
+* \param[out] pStats The statistics */
+void tomoRecon::getStatistics(int priorityClass, tomoReconStats_t *pStats)
+{
+  epicsTimeStamp now;
+
+  memset(pStats, 0, sizeof(*pStats));
+  if ((priorityClass < 0) || (priorityClass >= tomoThreadPool::numClasses)) return;
+  epicsThreadOnce(&statsOnce, createStatistics, 0);
+  epicsMutexLock(statsMutex);
+  *pStats = classStats[priorityClass];
+  epicsTimeGetCurrent(&now);
+  pStats->elapsedTime = epicsTimeDiffInSeconds(&now, &statsStartTime);
+  if (pStats->elapsedTime > 0) pStats->slicesPerSecond = pStats->numSlices / pStats->elapsedTime;
+  if (pStats->numChunks > 0) pStats->meanLatency = classLatencySum[priorityClass] / pStats->numChunks;
+  epicsMutexUnlock(statsMutex);
+}
+
+/** Function to reset the reconstruction statistics of all priority classes */
+void tomoRecon::resetStatistics()
+{
+  epicsThreadOnce(&statsOnce, createStatistics, 0);
+  epicsMutexLock(statsMutex);
+  memset(classStats, 0, sizeof(classStats));
+  memset(classLatencySum, 0, sizeof(classLatencySum));
+  epicsTimeGetCurrent(&statsStartTime);
+  epicsMutexUnlock(statsMutex);
+}
+
+/** Function that the thread pool calls when the task is submitted to get its priority class
+* \return PC_t priority class */
+int tomoRecon::priorityClass()
+{
+  return priorityClass_;
+}
+
+/** Function to change the priority class of the object.  It applies to the pairs of slices that are taken
+* from the toDoQueue after the call, so it can be changed while a reconstruction is running.
+* \param[in] priorityClass PC_t priority class */
+void tomoRecon::setPriorityClass(int priorityClass)
+{
+  if (priorityClass < 0) priorityClass = 0;
+  if (priorityClass >= tomoThreadPool::numClasses) priorityClass = tomoThreadPool::numClasses-1;
+  priorityClass_ = priorityClass;
+}
+
+/** Function to change the reconstruction parameters of the object.
+* The pool threads are kept, and if the geometry (number of projections and angles, padded sinogram width,
+* Gridrec parameters) is one of the last tomoParams_t.gridCacheSize geometries that were used, so are the
+* grid objects, FFTW plans and buffers.  Otherwise they are created when the next reconstruction starts.
+* debugFileName and gridCacheSize are only used when the object is created.
+* \param[in] pTomoParams A structure containing the tomography reconstruction parameters
+* \param[in] pAngles Array of projection angles in degrees
+* \return 0 if the object was reconfigured, -1 if a reconstruction is in progress or the data types are invalid */
+int tomoRecon::reconfigure(tomoParams_t *pTomoParams, float *pAngles)
+{
+  int oldNumSlices = numSlices_;
+  int oldMaxChunks = maxChunks_;
+  int status;
+  static const char *functionName="tomoRecon::reconfigure";
+
+  if (epicsAtomicGetIntT(&reconComplete_) == 0) {
+    logMsg("%s: error, reconstruction in progress", functionName);
+    return -1;
+  }
+  // Tasks that have finished the last slices can still be ending
+  epicsMutexLock(mutex_);
+  while (activeTasks_ > 0) {
+    epicsMutexUnlock(mutex_);
+    epicsEventWait(idleEvent_);
+    epicsMutexLock(mutex_);
+  }
+  epicsMutexUnlock(mutex_);
+
+  params_ = *pTomoParams;
+  pAngles_ = pAngles;
+  debug_ = pTomoParams_->debug;
+  status = configure();
+  if ((numSlices_ != oldNumSlices) || (maxChunks_ != oldMaxChunks)) {
+    deleteChunks();
+    createChunks();
+  }
+  selectGeometry();
+  return status;
+}
+
+/** Function that sets the members that are computed from the tomoParams_t structure,
+* and makes sure the shared tomoThreadPool has at least numThreads threads.
+* The parameters that are 0 are first taken from the machine profile with applyProfile().
+* If tomoParams_t.memoryBudget is set numThreads is reduced so that estimateMemory() fits in the budget.
+* \return 0 if the data types are valid, -1 if not, in which case reconstructions are refused */
+int tomoRecon::configure()
+{
+  double threadBytes, totalBytes;
+  int budgetThreads;
+  int status = 0;
+  static const char *functionName="tomoRecon::configure";
+
+  if ((applyProfile(pTomoParams_, 0) == 0) && debug_) {
+    logMsg("%s: from machine profile numThreads=%d, paddedSinogramWidth=%d, sampl=%f, fftwRigor=%d", functionName,
+           pTomoParams_->numThreads, pTomoParams_->paddedSinogramWidth, pTomoParams_->sampl, pTomoParams_->fftwRigor);
+  }
+
+  numPixels_ = pTomoParams_->numPixels;
+  numSlices_ = pTomoParams_->numSlices;
+  numProjections_ = pTomoParams_->numProjections;
+  inputDataType_ = pTomoParams_->inputDataType;
+  outputDataType_ = pTomoParams_->outputDataType;
+  paddedWidth_ = pTomoParams_->paddedSinogramWidth;
+  numThreads_ = pTomoParams_->numThreads;
+  maxChunks_ = pTomoParams_->maxChunks;
+  setPriorityClass(pTomoParams_->priorityClass);
+
+  switch (inputDataType_) {
+    case IDT_Float32:
+      inputRowSize_ = numPixels_ * sizeof(epicsFloat32);
+      break;
+    case IDT_UInt16:
+      inputRowSize_ = numPixels_ * sizeof(epicsUInt16);
+      break;
+    case IDT_UInt8:
+      inputRowSize_ = numPixels_ * sizeof(epicsUInt8);
+      break;
+    case IDT_UInt12Packed:
+      inputRowSize_ = numPixels_/2 * sizeof(mono12Packed_t);
+      if (numPixels_ % 2) {
+        logMsg("%s: error, numPixels=%d must be even for IDT_UInt12Packed", functionName, numPixels_);
+        inputRowSize_ = 0;
+        status = -1;
+      }
+      break;
+    default:
+      logMsg("%s: error, unknown input data type %d", functionName, inputDataType_);
+      inputRowSize_ = 0;
+      status = -1;
+  }
+
+  switch (outputDataType_) {
+    case ODT_Float32:
+      outputPixelSize_ = sizeof(epicsFloat32);
+      break;
+    case ODT_UInt16:
+      outputPixelSize_ = sizeof(epicsUInt16);
+      break;
+    case ODT_Int16:
+      outputPixelSize_ = sizeof(epicsInt16);
+      break;
+    default:
+      // ODT_Float16 is only supported by tomoPreprocess
+      logMsg("%s: error, unknown output data type %d", functionName, outputDataType_);
+      outputPixelSize_ = 0;
+      status = -1;
+  }
+
+  // Offset-axis data are stitched into a sinogram with half the projections and up to twice the width
+  numAngles_ = numProjections_;
+  imageWidth_ = numPixels_;
+  if (pTomoParams_->offsetAxis) {
+    numAngles_ = numProjections_/2;
+    imageWidth_ = 2*numPixels_;
+    if (numProjections_ % 2) {
+      logMsg("%s: error, numProjections=%d must be even for offsetAxis", functionName, numProjections_);
+    }
+    if (paddedWidth_ < 2*numPixels_) {
+      logMsg("%s: error, paddedSinogramWidth=%d must be >= 2*numPixels for offsetAxis", functionName, paddedWidth_);
+    }
+  }
+ 
+  if (maxChunks_ < 1) maxChunks_ = 2;
+  if (numThreads_ < 1) numThreads_ = 1;
+  if (numThreads_ > tomoThreadPool::maxWorkers) numThreads_ = tomoThreadPool::maxWorkers;
+  if (pTomoParams_->memoryBudget > 0) {
+    estimateMemory(pTomoParams_, &threadBytes, &totalBytes);
+    budgetThreads = (int)((pTomoParams_->memoryBudget*1024.*1024. - (totalBytes - numThreads_*threadBytes)) / threadBytes);
+    if (budgetThreads < 1) {
+      logMsg("%s: error, memoryBudget=%f MB is less than %f MB needed with 1 thread", functionName, 
+             pTomoParams_->memoryBudget, (totalBytes - (numThreads_-1)*threadBytes)/1024./1024.);
+      budgetThreads = 1;
+    }
+    if (budgetThreads < numThreads_) {
+      if (debug_) logMsg("%s: using %d threads instead of %d to fit memoryBudget=%f MB", functionName, 
+                         budgetThreads, numThreads_, pTomoParams_->memoryBudget);
+      numThreads_ = budgetThreads;
+    }
+  }
+  pPool_ = tomoThreadPool::getPool(numThreads_, pTomoParams_->pinThreads);
+  return status;
+}
+
+/** Function to create the chunks and the toDoQueue, which are sized for numSlices and maxChunks */
+void tomoRecon::createChunks()
+{
+  int i;
+
+  chunks_ = (reconChunk_t *) calloc(maxChunks_, sizeof(reconChunk_t));
+  for (i=0; i<maxChunks_; i++) {
+    chunks_[i].chunkId = -1;
+    chunks_[i].sliceDone = (epicsUInt32 *) calloc((numSlices_ + 31)/32, sizeof(epicsUInt32));
+    chunks_[i].doneEvent = epicsEventCreate(epicsEventEmpty);
+  }
+  lastChunk_ = 0;
+  // Each chunk needs at most one message per slice
+  queueElements_ = numSlices_ * maxChunks_;
+  if (queueElements_ < 1) queueElements_ = 1;
+  toDoQueue_ = epicsMessageQueueCreate(queueElements_, sizeof(toDoMessage_t));
+}
+
+/** Function to delete the chunks and the toDoQueue */
+void tomoRecon::deleteChunks()
+{
+  int i;
+
+  epicsMessageQueueDestroy(toDoQueue_);
+  for (i=0; i<maxChunks_; i++) {
+    free(chunks_[i].sliceDone);
+    epicsEventDestroy(chunks_[i].doneEvent);
+  }
+  free(chunks_);
+}
+
+/** Function to select the cached geometry that matches the current parameters.
+* If none matches, the least recently used entry is emptied and used for the current parameters;
+* the pool worker threads then create their grid objects when they first reconstruct a slice. */
+void tomoRecon::selectGeometry()
+{
+  reconGeometry_t *pGeometry;
+  reconGeometry_t *pOldest = &geometries_[0];
+  int i;
+  static const char *functionName="tomoRecon::selectGeometry";
+
+  for (i=0; i<maxGeometries_; i++) {
+    pGeometry = &geometries_[i];
+    if (pGeometry->lastUsed < pOldest->lastUsed) pOldest = pGeometry;
+    if ((pGeometry->lastUsed != 0) &&
+        (pGeometry->numProjections == numProjections_) &&
+        (pGeometry->numAngles      == numAngles_) &&
+        (pGeometry->paddedWidth    == paddedWidth_) &&
+        (pGeometry->imageWidth     == imageWidth_) &&
+        (pGeometry->geom           == pTomoParams_->geom) &&
+        (pGeometry->pswfParam      == pTomoParams_->pswfParam) &&
+        (pGeometry->sampl          == pTomoParams_->sampl) &&
+        (pGeometry->MaxPixSiz      == pTomoParams_->MaxPixSiz) &&
+        (pGeometry->ROI            == pTomoParams_->ROI) &&
+        (pGeometry->X0             == pTomoParams_->X0) &&
+        (pGeometry->Y0             == pTomoParams_->Y0) &&
+        (pGeometry->ltbl           == pTomoParams_->ltbl) &&
+        (pGeometry->hugePages      == pTomoParams_->hugePages) &&
+        (pGeometry->fftwRigor      == pTomoParams_->fftwRigor) &&
+        (strncmp(pGeometry->fname, pTomoParams_->fname, sizeof(pGeometry->fname)) == 0) &&
+        (memcmp(pGeometry->angles, pAngles_, numAngles_*sizeof(float)) == 0)) {
+      // numThreads may have been reduced since the geometry was used
+      while (pGeometry->numWorkers > numThreads_) {
+        pGeometry->numWorkers--;
+        deleteWorker(pGeometry->workers[pGeometry->numWorkers]);
+        pGeometry->workers[pGeometry->numWorkers] = 0;
+      }
+      pGeometry->lastUsed = ++geometryUseCount_;
+      pGeometry_ = pGeometry;
+      if (debug_) logMsg("%s: using cached geometry %d", functionName, i);
+      return;
+    }
+  }
+  pGeometry = pOldest;
+  deleteGeometry(pGeometry);
+  pGeometry->numProjections = numProjections_;
+  pGeometry->numAngles      = numAngles_;
+  pGeometry->paddedWidth    = paddedWidth_;
+  pGeometry->imageWidth     = imageWidth_;
+  pGeometry->geom           = pTomoParams_->geom;
+  pGeometry->pswfParam      = pTomoParams_->pswfParam;
+  pGeometry->sampl          = pTomoParams_->sampl;
+  pGeometry->MaxPixSiz      = pTomoParams_->MaxPixSiz;
+  pGeometry->ROI            = pTomoParams_->ROI;
+  pGeometry->X0             = pTomoParams_->X0;
+  pGeometry->Y0             = pTomoParams_->Y0;
+  pGeometry->ltbl           = pTomoParams_->ltbl;
+  pGeometry->hugePages      = pTomoParams_->hugePages;
+  pGeometry->fftwRigor      = pTomoParams_->fftwRigor;
+  strncpy(pGeometry->fname, pTomoParams_->fname, sizeof(pGeometry->fname));
+  pGeometry->angles = (float *) malloc(numAngles_*sizeof(float));
+  memcpy(pGeometry->angles, pAngles_, numAngles_*sizeof(float));
+  pGeometry->lastUsed = ++geometryUseCount_;
+  pGeometry_ = pGeometry;
+  if (debug_) logMsg("%s: new geometry %d", functionName, (int)(pGeometry - geometries_));
+}
+
+/** Function to delete the grid objects and buffers of a cached geometry and mark the entry as empty
+* \param[in] pGeometry Pointer to the geometry */
+void tomoRecon::deleteGeometry(reconGeometry_t *pGeometry)
+{
+  int i;
+
+  for (i=0; i<tomoThreadPool::maxWorkers; i++) {
+    if (pGeometry->workers[i]) deleteWorker(pGeometry->workers[i]);
+    pGeometry->workers[i] = 0;
+  }
+  pGeometry->numWorkers = 0;
+  free(pGeometry->angles);
+  pGeometry->angles = 0;
+  pGeometry->lastUsed = 0;
+}
+
 /** Function to start reconstruction of a set of slices
-* Sends messages to workerTasks to begin the reconstruction and wakes up
-* the supervisorTasks and workerTasks.
+* Puts the slices in the toDoQueue and submits tasks to the thread pool to reconstruct them.
 * \param[in] numSlices Number of slices to reconstruct
 * \param[in] center Rotation center to use for each slice
-* \param[in] pInput Pointer to input data [numPixels, numSlices, numProjections]
-* \param[out] pOutput Pointer to output data [numPixels, numPixels, numSlices] */
+* \param[in] pInput Pointer to input data [numPixels, numSlices, numProjections], or [numPixels, numProjections, numSlices] with sinogramInput
+* \param[out] pOutput Pointer to output data [numPixels, numPixels, numSlices], or [2*numPixels, 2*numPixels, numSlices] for offsetAxis */
 int tomoRecon::reconstruct(int numSlices, float *center, char *pInput, char *pOutput)
 {
-  char *pIn, *pOut;
+  return (startReconstruction(numSlices, 0, center, pInput, pOutput, 0) < 0) ? -1 : 0;
+}
+
+/** Function to start reconstruction of a list of slices selected from a larger input volume.
+* The slices are read in place from the input, which must contain the numSlices slices passed to the constructor
+* in tomoParams_t.  The reconstructed slices are written one after the other to the output, in the order of sliceIndex.
+* Consecutive entries in sliceIndex are reconstructed as a pair only if they have the same center.
+* \param[in] numSlices Number of slices to reconstruct
+* \param[in] sliceIndex Index of each slice to reconstruct in the input, 0 to tomoParams_t.numSlices-1
+* \param[in] center Rotation center to use for each slice
+* \param[in] pInput Pointer to input data [numPixels, tomoParams_t.numSlices, numProjections],
+*            or [numPixels, numProjections, tomoParams_t.numSlices] with sinogramInput
+* \param[out] pOutput Pointer to output data [numPixels, numPixels, numSlices], or [2*numPixels, 2*numPixels, numSlices] for offsetAxis */
+int tomoRecon::reconstruct(int numSlices, int *sliceIndex, float *center, char *pInput, char *pOutput)
+{
+  int i;
+  static const char *functionName="tomoRecon::reconstruct";
+
+  for (i=0; i<numSlices; i++) {
+    if ((sliceIndex[i] < 0) || (sliceIndex[i] >= pTomoParams_->numSlices)) {
+      logMsg("%s: error, sliceIndex[%d]=%d, must be >= 0 and < %d", 
+             functionName, i, sliceIndex[i], pTomoParams_->numSlices);
+      return -1;
+    }
+  }
+  return (startReconstruction(numSlices, sliceIndex, center, pInput, pOutput, 0) < 0) ? -1 : 0;
+}
+
+/** Function to queue a chunk of slices for reconstruction without waiting for the chunks already queued to finish.
+* If tomoParams_t.maxChunks chunks are already in flight it blocks until one of them is complete.
+* The input, output and center arrays must not be freed or reused until the chunk is complete.
+* \param[in] numSlices Number of slices to reconstruct
+* \param[in] center Rotation center to use for each slice
+* \param[in] pInput Pointer to input data [numPixels, numSlices, numProjections], or [numPixels, numProjections, numSlices] with sinogramInput
+* \param[out] pOutput Pointer to output data [numPixels, numPixels, numSlices], or [2*numPixels, 2*numPixels, numSlices] for offsetAxis
+* \return Id of the chunk to pass to waitChunk(), or -1 if there was an error */
+int tomoRecon::submitChunk(int numSlices, float *center, char *pInput, char *pOutput)
+{
+  return startReconstruction(numSlices, 0, center, pInput, pOutput, 1);
+}
+
+/** Function to wait for a chunk queued with submitChunk() to complete
+* \param[in] chunkId Id that submitChunk() returned
+* \param[in] timeout Maximum time to wait in seconds; a negative value waits forever
+* \return 0 if the chunk is complete, -1 if the timeout expired first or chunkId is not valid */
+int tomoRecon::waitChunk(int chunkId, double timeout)
+{
+  epicsTimeStamp tStart, tNow;
+  epicsEventId doneEvent;
+  double remaining;
+  int i;
+  static const char *functionName="tomoRecon::waitChunk";
+
+  epicsMutexLock(mutex_);
+  if ((chunkId < 0) || (chunkId >= nextChunkId_)) {
+    epicsMutexUnlock(mutex_);
+    logMsg("%s: error, invalid chunkId=%d", functionName, chunkId);
+    return -1;
+  }
+  epicsTimeGetCurrent(&tStart);
+  while (1) {
+    // A chunk that is no longer in any slot has been completed and its slot reused
+    for (i=0; i<maxChunks_; i++) {
+      if ((chunks_[i].chunkId == chunkId) && (chunks_[i].slicesRemaining > 0)) break;
+    }
+    if (i == maxChunks_) break;
+    doneEvent = chunks_[i].doneEvent;
+    epicsMutexUnlock(mutex_);
+    if (timeout < 0) {
+      epicsEventWait(doneEvent);
+    } else {
+      epicsTimeGetCurrent(&tNow);
+      remaining = timeout - epicsTimeDiffInSeconds(&tNow, &tStart);
+      if (remaining <= 0) return -1;
+      epicsEventWaitWithTimeout(doneEvent, remaining);
+    }
+    epicsMutexLock(mutex_);
+  }
+  epicsMutexUnlock(mutex_);
+  return 0;
+}
+
+/** Function that queues the slices for reconstruct() and submitChunk()
+* \param[in] numSlices Number of slices to reconstruct
+* \param[in] sliceIndex Index of each slice in the input, or NULL if the input contains exactly the numSlices slices to reconstruct
+* \param[in] center Rotation center to use for each slice
+* \param[in] pInput Pointer to input data
+* \param[out] pOutput Pointer to output data
+* \param[in] asynchronous 0 for reconstruct(), which returns an error if a reconstruction is in progress;
+*            1 for submitChunk(), which waits for a free chunk instead
+* \return Id of the chunk, or -1 if there was an error */
+int tomoRecon::startReconstruction(int numSlices, int *sliceIndex, float *center, char *pInput, char *pOutput, int asynchronous)
+{
+  char *pOut;
   toDoMessage_t toDoMessage;
-  int reconSize = numPixels_ * numPixels_;
+  reconChunk_t *pChunk;
+  int reconSize = imageWidth_ * imageWidth_;
   int nextSlice=0;
+  int pairSlices;
+  int chunkId;
   int i;
   int status;
-  int inputPixelSize=0;
-  int outputPixelSize=0;
-  static const char *functionName="tomoRecon::reconstruct";
+  size_t adviseBytes;
+  static const char *functionName="tomoRecon::startReconstruction";
 
   // If a reconstruction is already in progress return an error
-  if (debug_) logMsg("%s: entry, reconComplete_=%d", functionName, reconComplete_);
-  if (reconComplete_ == 0) {
+  if (debug_) logMsg("%s: entry, reconComplete_=%d", functionName, epicsAtomicGetIntT(&reconComplete_));
+  if (!asynchronous && (epicsAtomicGetIntT(&reconComplete_) == 0)) {
     logMsg("%s: error, reconstruction already in progress", functionName);
     return -1;
   }
@@ -173,54 +723,89 @@ int tomoRecon::reconstruct(int numSlices, float *center, char *pInput, char *pOu
     return -1;
   }
   
-  switch (pTomoParams_->inputDataType) {
-    case IDT_Float32:
-      inputPixelSize = sizeof(epicsFloat32);
-      break;
-     case IDT_UInt16:
-      inputPixelSize = sizeof(epicsUInt16);
-      break;
-    default:
-      logMsg("Error: Unknown input data type");
+  if (inputRowSize_ == 0) {
+    logMsg("%s: error, invalid input data type or numPixels", functionName);
+    return -1;
   }
 
-  switch (pTomoParams_->outputDataType) {
-    case ODT_Float32:
-      outputPixelSize = sizeof(epicsFloat32);
-      break;
-     case ODT_UInt16:
-      outputPixelSize = sizeof(epicsUInt16);
-      break;
-     case ODT_Int16:
-      outputPixelSize = sizeof(epicsInt16);
-      break;
-    default:
-      logMsg("Error: Unknown output data type");
+  if (outputPixelSize_ == 0) {
+    logMsg("%s: error, invalid output data type %d", functionName, outputDataType_);
+    return -1;
   }
 
-  numSlices_ = numSlices;
-  slicesRemaining_ = numSlices_;
-  pInput_ = pInput;
-  pOutput_ = pOutput;
-  pIn = pInput_;
-  pOut = pOutput_;
+  // Wait for a free chunk.  There is always one if no reconstruction is in progress.
+  epicsMutexLock(mutex_);
+  while (1) {
+    if (shutDown_) {
+      epicsMutexUnlock(mutex_);
+      return -1;
+    }
+    for (i=0; i<maxChunks_; i++) {
+      if (chunks_[i].slicesRemaining == 0) break;
+    }
+    if (i < maxChunks_) break;
+    epicsMutexUnlock(mutex_);
+    epicsEventWait(chunkFreeEvent_);
+    epicsMutexLock(mutex_);
+  }
+  pChunk = &chunks_[i];
+  chunkId = nextChunkId_++;
+  lastChunk_ = i;
+  pChunk->chunkId = chunkId;
+  pChunk->numSlices = numSlices;
+  pChunk->inputSlices = sliceIndex ? pTomoParams_->numSlices : numSlices;
+  if (pTomoParams_->sinogramInput) {
+    pChunk->sliceStride = (size_t)numProjections_ * inputRowSize_;
+    pChunk->projectionStride = inputRowSize_;
+  } else {
+    pChunk->sliceStride = inputRowSize_;
+    pChunk->projectionStride = (size_t)pChunk->inputSlices * inputRowSize_;
+  }
+  pChunk->slicesRemaining = numSlices;
+  pChunk->pInput = pInput;
+  pChunk->priorityClass = priorityClass_;
+  pChunk->numCancelled = 0;
+  epicsTimeGetCurrent(&pChunk->queueTime);
+  memset(pChunk->sliceDone, 0, (numSlices_ + 31)/32 * sizeof(epicsUInt32));
+  epicsEventTryWait(pChunk->doneEvent);
+  if (numSlices > 0) {
+    if (epicsAtomicGetIntT(&reconComplete_)) epicsEventTryWait(doneEvent_);
+    epicsAtomicAddIntT(&slicesRemaining_, numSlices);
+    epicsAtomicSetIntT(&reconComplete_, 0);
+  }
+  epicsMutexUnlock(mutex_);
+  pOut = pOutput;
 
-  reconComplete_ = 0;
+  // sinogram() reads the input with a stride of a projection, so it benefits from huge pages too
+  if (pTomoParams_->hugePages && (numSlices > 0)) {
+    adviseBytes = tomoHugePageAdvise(pInput, (size_t)pChunk->inputSlices * numProjections_ * inputRowSize_);
+    adviseBytes += tomoHugePageAdvise(pOutput, (size_t)numSlices * reconSize * outputPixelSize_);
+    if (debug_) logMsg("%s: advised %.1f MB of input and output to use transparent huge pages", 
+                       functionName, adviseBytes/1024./1024.);
+  }
 
   // Fill up the toDoQueue with slices to be reconstructed
-  for (i=0; i<(numSlices_+1)/2; i++) {
+  toDoMessage.pChunk = pChunk;
+  while (nextSlice < numSlices) {
     toDoMessage.sliceNumber = nextSlice;
-    toDoMessage.pIn1 = pIn;
+    toDoMessage.pIn1 = pInput + (sliceIndex ? sliceIndex[nextSlice] : nextSlice) * pChunk->sliceStride;
     toDoMessage.pOut1 = pOut;
-    toDoMessage.center = float(center[i*2] + (paddedWidth_ - numPixels_)/2.);
-    pIn += numPixels_ * inputPixelSize;
-    pOut += reconSize * outputPixelSize;
+    toDoMessage.center = float(center[nextSlice] + (paddedWidth_ - numPixels_)/2.);
+    toDoMessage.sliceCenter1 = center[nextSlice];
+    // Stitched sinograms have the rotation axis in the middle, so each slice can have its own center
+    if (pTomoParams_->offsetAxis) toDoMessage.center = float(paddedWidth_/2);
+    pOut += reconSize * outputPixelSize_;
     nextSlice++;
-    if (nextSlice < numSlices_) {
-      toDoMessage.pIn2 = pIn;
+    // The 2 slices in a pair are reconstructed with the center of the first one, unless they are stitched
+    pairSlices = (nextSlice < numSlices);
+    if (pairSlices && sliceIndex && !pTomoParams_->offsetAxis) {
+      pairSlices = (center[nextSlice] == center[nextSlice-1]);
+    }
+    if (pairSlices) {
+      toDoMessage.pIn2 = pInput + (sliceIndex ? sliceIndex[nextSlice] : nextSlice) * pChunk->sliceStride;
       toDoMessage.pOut2 = pOut;
-      pIn += numPixels_ * inputPixelSize;
-      pOut += reconSize * outputPixelSize;
+      toDoMessage.sliceCenter2 = center[nextSlice];
+      pOut += reconSize * outputPixelSize_;
       nextSlice++;
     } else {
       toDoMessage.pIn2 = NULL;
@@ -232,110 +817,264 @@ int tomoRecon::reconstruct(int numSlices, float *center, char *pInput, char *pOu
           functionName, status);
     }
   }
-  // Send events to start reconstruction
-  if (debug_) logMsg("%s: sending events to start reconstruction", functionName);
-  epicsEventSignal(supervisorWakeEvent_);
-  for (i=0; i<numThreads_; i++) epicsEventSignal(workerWakeEvents_[i]);
+  // Submit tasks to the thread pool to reconstruct the slices.
+  // Tasks that are already running take the slices of this chunk when they finish their current slices.
+  if (debug_) logMsg("%s: submitting tasks to start reconstruction", functionName);
+  epicsMutexLock(mutex_);
+  while ((activeTasks_ < numThreads_) && (activeTasks_ < epicsMessageQueuePending(toDoQueue_))) {
+    activeTasks_++;
+    pPool_->submit(this);
+  }
+  epicsMutexUnlock(mutex_);
   
-  return 0;
+  return chunkId;
 }
 
 /** Function to poll the status of the reconstruction
 * \param[out] pReconComplete 0 if reconstruction is still in progress, 1 if it is complete
-* \param[out] pSlicesRemaining Number of slices remaining to be reconstructed */
+* \param[out] pSlicesRemaining Number of slices remaining to be reconstructed, in all chunks */
 void tomoRecon::poll(int *pReconComplete, int *pSlicesRemaining)
 {
-  *pReconComplete = reconComplete_;
-  *pSlicesRemaining = slicesRemaining_;
+  *pReconComplete = epicsAtomicGetIntT(&reconComplete_);
+  *pSlicesRemaining = epicsAtomicGetIntT(&slicesRemaining_);
+}
+
+/** Function to wait for the reconstruction, including all chunks queued with submitChunk(), to complete
+* \param[in] timeout Maximum time to wait in seconds; a negative value waits forever
+* \return 0 if the reconstruction is complete, -1 if the timeout expired first */
+int tomoRecon::wait(double timeout)
+{
+  epicsTimeStamp tStart, tNow;
+  double remaining;
+
+  epicsTimeGetCurrent(&tStart);
+  while (!epicsAtomicGetIntT(&reconComplete_)) {
+    if (timeout < 0) {
+      epicsEventWait(doneEvent_);
+      continue;
+    }
+    epicsTimeGetCurrent(&tNow);
+    remaining = timeout - epicsTimeDiffInSeconds(&tNow, &tStart);
+    if (remaining <= 0) return -1;
+    epicsEventWaitWithTimeout(doneEvent_, remaining);
+  }
+  // Pass the event on in case another thread is also waiting
+  epicsEventSignal(doneEvent_);
+  return 0;
+}
+
+/** Function to find out whether a slice of the most recent reconstruct() or submitChunk() has been written to the output
+* \param[in] sliceNumber Number of the slice in the output, 0 to numSlices-1
+* \return 1 if the slice is done, 0 if it is not done or sliceNumber is out of range */
+int tomoRecon::isSliceDone(int sliceNumber)
+{
+  reconChunk_t *pChunk;
+  int done = 0;
+
+  epicsMutexLock(mutex_);
+  pChunk = &chunks_[lastChunk_];
+  if ((sliceNumber >= 0) && (sliceNumber < pChunk->numSlices)) {
+    done = (pChunk->sliceDone[sliceNumber/32] >> (sliceNumber%32)) & 1;
+  }
+  epicsMutexUnlock(mutex_);
+  return done;
+}
+
+/** Function to set a callback that is called as soon as each slice has been written to the output.
+* The callback for the last slice is called before wait() returns and poll() reports that the reconstruction is complete.
+* \param[in] callback Function to call, or NULL to remove the callback
+* \param[in] pUserPvt Pointer that is passed to the callback */
+void tomoRecon::setSliceCallback(tomoReconSliceCallback_t callback, void *pUserPvt)
+{
+  epicsMutexLock(mutex_);
+  sliceCallback_ = callback;
+  sliceCallbackPvt_ = pUserPvt;
+  epicsMutexUnlock(mutex_);
+}
+
+/** Function that is called by the reconstruction tasks when each slice has been written to the output.
+* Marks the slice as done, calls the slice callback, and counts the slice.
+* \param[in] pChunk Chunk that the slice belongs to
+* \param[in] sliceNumber Number of the slice in the output of the chunk
+* \param[in] pOutput Pointer to the slice in the output */
+void tomoRecon::sliceComplete(reconChunk_t *pChunk, int sliceNumber, char *pOutput)
+{
+  tomoReconSliceCallback_t callback;
+  void *pUserPvt;
+
+  epicsMutexLock(mutex_);
+  pChunk->sliceDone[sliceNumber/32] |= 1u << (sliceNumber%32);
+  callback = sliceCallback_;
+  pUserPvt = sliceCallbackPvt_;
+  epicsMutexUnlock(mutex_);
+  if (callback) callback(pUserPvt, sliceNumber, pOutput);
+  epicsMutexLock(mutex_);
+  countSlices(pChunk, 1);
+  epicsMutexUnlock(mutex_);
+}
+
+/** Function to count slices that have been written to the output or cancelled, completing the chunk and
+* the reconstruction when they are the last ones.  Must be called with mutex_ locked, so that
+* startReconstruction() cannot queue a chunk between the chunk and the total counts being changed.
+* \param[in] pChunk Chunk that the slices belong to
+* \param[in] numSlices Number of slices */
+void tomoRecon::countSlices(reconChunk_t *pChunk, int numSlices)
+{
+  epicsTimeStamp now;
+  static const char *functionName="tomoRecon::countSlices";
+
+  pChunk->slicesRemaining -= numSlices;
+  if (pChunk->slicesRemaining == 0) {
+    if (pChunk->numCancelled == 0) {
+      epicsTimeGetCurrent(&now);
+      addChunkStatistics(pChunk->priorityClass, epicsTimeDiffInSeconds(&now, &pChunk->queueTime));
+    }
+    epicsEventSignal(pChunk->doneEvent);
+    epicsEventSignal(chunkFreeEvent_);
+  }
+  if (epicsAtomicAddIntT(&slicesRemaining_, -numSlices) == 0) {
+    epicsAtomicSetIntT(&reconComplete_, 1);
+    epicsEventSignal(doneEvent_);
+    if (debug_) logMsg("%s: Reconstruction complete!", functionName);
+  }
+}
+
+/** Function to cancel the reconstruction, including all chunks queued with submitChunk().
+* Removes the slices that have not been started from the toDoQueue and waits for the slices that are being
+* reconstructed to finish.  The pool threads and grid objects are kept, so a new reconstruction can be started
+* as soon as this returns.  The slices that were written can be found with isSliceDone().
+* \return Number of slices that were cancelled */
+int tomoRecon::cancel()
+{
+  toDoMessage_t toDoMessage;
+  int numCancelled = 0;
+  int numSlices;
+  static const char *functionName="tomoRecon::cancel";
+
+  epicsMutexLock(mutex_);
+  while (epicsMessageQueueTryReceive(toDoQueue_, &toDoMessage, sizeof(toDoMessage)) == sizeof(toDoMessage)) {
+    numSlices = toDoMessage.pIn2 ? 2 : 1;
+    toDoMessage.pChunk->numCancelled += numSlices;
+    countSlices(toDoMessage.pChunk, numSlices);
+    numCancelled += numSlices;
+  }
+  // The tasks end when they find the toDoQueue empty
+  while (activeTasks_ > 0) {
+    epicsMutexUnlock(mutex_);
+    epicsEventWait(idleEvent_);
+    epicsMutexLock(mutex_);
+  }
+  epicsMutexUnlock(mutex_);
+  if (debug_) logMsg("%s: cancelled %d slices", functionName, numCancelled);
+  return numCancelled;
 }
 
 /** Function to shut down the object
-* Sets the shutDown_ flag and sends an event to wake up the supervisorTask and workerTasks. */
+* Sets the shutDown_ flag, which causes the reconstruction tasks to stop taking slices from the toDoQueue,
+* and wakes up submitChunk() if it is waiting for a free chunk. */
 void tomoRecon::shutDown()
 {
-  int i;
-  
-  // Set the shutdown flag
+  epicsMutexLock(mutex_);
   shutDown_ = 1;
-  // Send events to all threads waking them up
-  epicsEventSignal(supervisorWakeEvent_);
-  for (i=0; i<numThreads_; i++) epicsEventSignal(workerWakeEvents_[i]);
+  epicsMutexUnlock(mutex_);
+  epicsEventSignal(chunkFreeEvent_);
 }
 
-/** Supervisor control task that runs as a separate thread. 
-* Reads messages from the workerTasks to update the status of the reconstruction (reconComplete and slicesRemaining).
-* When shutting down waits for events from workerTasks threads indicating that they have all exited. */
-void tomoRecon::supervisorTask()
+/** Function that the thread pool calls to run a reconstruction task.
+* Reconstructs the next pair of slices in the toDoQueue with a grid object and buffers from getWorker(),
+* or creates them if getWorker() asks for that.
+* Then submits the task again if there are more slices in the toDoQueue, otherwise the task ends.
+* \param[in] workerNum Number of the pool worker thread running the task */
+void tomoRecon::run(int workerNum)
 {
+  toDoMessage_t toDoMessage;
+  reconWorker_t *pWorker = 0;
+  int status = -1;
   int i;
-  int status;
-  doneMessage_t doneMessage;
-  static const char *functionName="tomoRecon::supervisorTask";
+  static const char *functionName="tomoRecon::run";
 
-  while (1) {
-    if (debug_) logMsg("%s: waiting for wake event", functionName);
-    // Wait for a wake event
-    epicsEventWait(supervisorWakeEvent_);
-    if (shutDown_) goto done;
-    // Wait for all the messages to come back, indicating that reconstruction is complete
-    while (slicesRemaining_ > 0) {
-      if (shutDown_) goto done;
-      status = epicsMessageQueueReceive(doneQueue_, &doneMessage, sizeof(doneMessage));
-      if (status != sizeof(doneMessage)) {
-        logMsg("%s, error reading worker thread message", functionName);
-        continue;
-      }
-      slicesRemaining_ -= doneMessage.numSlices;
+  epicsMutexLock(mutex_);
+  if (!shutDown_) status = epicsMessageQueueTryReceive(toDoQueue_, &toDoMessage, sizeof(toDoMessage));
+  if (status == sizeof(toDoMessage)) pWorker = getWorker(workerNum);
+  epicsMutexUnlock(mutex_);
+  if (status == sizeof(toDoMessage)) {
+    if (pWorker == 0) {
+      pWorker = createWorker(workerNum);
+      // getWorker reserved an entry, which is the first NULL one
+      epicsMutexLock(mutex_);
+      for (i=0; pGeometry_->workers[i]; i++);
+      pGeometry_->workers[i] = pWorker;
+      epicsMutexUnlock(mutex_);
     }
-    if (debug_) logMsg("%s: All slices complete!", functionName);
-    reconComplete_ = 1;
-    if (debug_) logMsg("%s: Reconstruction complete!", functionName);
+    workerTask(pWorker, &toDoMessage);
+    sliceComplete(toDoMessage.pChunk, toDoMessage.sliceNumber, toDoMessage.pOut1);
+    if (toDoMessage.pIn2) sliceComplete(toDoMessage.pChunk, toDoMessage.sliceNumber+1, toDoMessage.pOut2);
+  } else if (status != -1) {
+    logMsg("%s:, error calling epicsMessageQueueTryReceive, status=%d", functionName, status);
+  }
+
+  epicsMutexLock(mutex_);
+  if (pWorker) pWorker->inUse = 0;
+  if (!shutDown_ && (epicsMessageQueuePending(toDoQueue_) > 0)) {
+    pPool_->submit(this, workerNum);
+  } else {
+    activeTasks_--;
+    if (activeTasks_ == 0) epicsEventSignal(idleEvent_);
   }
-  done:
-  // Wait for the worker threads to exit before setting the reconstruction complete flag.
-  // They will exit because the toDoQueue is now empty
-  for (i=0; i<numThreads_; i++) {
-    if (debug_) logMsg("%s: Beginning wait for worker task %d to complete, eventId=%p", 
-          functionName, i, workerDoneEvents_[i]);
-    status = epicsEventWaitWithTimeout(workerDoneEvents_[i], 1.0);
-    if (status != epicsEventWaitOK) {
-      logMsg("%s: Error waiting for worker task %d to complete, eventId=%p, status=%d", 
-          functionName, i, workerDoneEvents_[i], status);
+  // Nothing in this object can be used after the mutex is released, because the destructor may then run
+  epicsMutexUnlock(mutex_);
+}
+
+/** Function to select the grid object and buffers for a task.  Must be called with mutex_ held.
+* Uses the free structure that this pool worker thread created.  If there is none and the geometry has fewer than
+* numThreads structures it reserves an entry for a new one, otherwise it uses a free structure from another thread,
+* preferring one created by a thread on the same NUMA node, so that with pinned threads the buffers are local.
+* At most numThreads tasks run at once, so the object never has more than numThreads of them.
+* \param[in] workerNum Number of the pool worker thread running the task
+* \return Pointer to the reconWorker_t structure, which is marked in use, or NULL if the caller must create one */
+reconWorker_t* tomoRecon::getWorker(int workerNum)
+{
+  reconWorker_t *pWorker;
+  reconWorker_t *pFree = 0;
+  reconWorker_t *pLocal = 0;
+  int node = pPool_->workerNode(workerNum);
+  int i;
+
+  for (i=0; i<pGeometry_->numWorkers; i++) {
+    pWorker = pGeometry_->workers[i];
+    if ((pWorker == 0) || pWorker->inUse) continue;
+    if (pWorker->workerNum == workerNum) {
+      pWorker->inUse = 1;
+      return pWorker;
     }
+    if (pFree == 0) pFree = pWorker;
+    if ((pLocal == 0) && (pPool_->workerNode(pWorker->workerNum) == node)) pLocal = pWorker;
   }
-  // Send a signal to the destructor that the supervisor task is done
-  if (debug_) logMsg("%s: Exiting supervisor task.", functionName);
-  epicsEventSignal(supervisorDoneEvent_);
+  if (pLocal) pFree = pLocal;
+  if (pGeometry_->numWorkers < numThreads_) pFree = 0;
+  if (pFree == 0) {
+    pGeometry_->numWorkers++;
+    return 0;
+  }
+  pFree->inUse = 1;
+  return pFree;
 }
 
-/** Worker task that runs as a separate thread. Multiple worker tasks can be running simultaneously.
- * Each workerTask thread reconstructs slices that it gets from the toDoQueue, and sends messages to
- * the supervisorTask via the doneQueue after reconstructing each pair of slices.
- * \param[in] taskNum Task number (0 to numThreads-1) for this tread; used to into arrays of event numbers in the object.
- */
-void tomoRecon::workerTask(int taskNum)
+/** Function to create a grid object and buffers for this object.
+* It is called on the pool worker thread that will use them, which also does the first write to the buffers, so when
+* the pool threads are pinned (tomoParams_t.pinThreads) the memory is allocated on the worker's NUMA node.
+* \param[in] workerNum Number of the pool worker thread
+* \return Pointer to the new reconWorker_t structure, which is marked in use */
+reconWorker_t* tomoRecon::createWorker(int workerNum)
 {
-  toDoMessage_t toDoMessage;
-  doneMessage_t doneMessage;
-  epicsEventId wakeEvent = workerWakeEvents_[taskNum];
-  epicsEventId doneEvent = workerDoneEvents_[taskNum];
-  epicsTimeStamp tStart, tStop;
+  reconWorker_t *pWorker = (reconWorker_t *) calloc(1, sizeof(reconWorker_t));
   long reconSize;
-  int imageSize;
-  int status;
-  int i, j;
-  int sinOffset;
-  float *sin1=0, *sin2=0, *recon1=0, *recon2=0, *pRecon;
+  int i;
   sg_struct sgStruct;
   grid_struct gridStruct;
-  float **S1=0, **S2=0, **R1=0, **R2=0;
-  float reconScale = pTomoParams_->reconScale;
-  float reconOffset = pTomoParams_->reconOffset;
-  grid *pGrid=0;
-  static const char *functionName="tomoRecon::workerTask";
+  static const char *functionName="tomoRecon::createWorker";
   
-  if (reconScale == 0) reconScale = 1;
-  sgStruct.n_ang    = numProjections_;
+  sgStruct.n_ang    = numAngles_;
   sgStruct.n_det    = paddedWidth_;
   // Force n_det to be odd
   if (paddedWidth_/2 != 0) sgStruct.n_det--;
@@ -352,185 +1091,254 @@ void tomoRecon::workerTask(int taskNum)
   gridStruct.filter    = get_filter(pTomoParams_->fname);
   gridStruct.verbose   = (debug_ > 1) ? 1 : 0;
   gridStruct.debugFile = debugFile_;
+  gridStruct.hugePages = pTomoParams_->hugePages;
+  switch (pTomoParams_->fftwRigor) {
+    case FR_Estimate: gridStruct.fftwFlags = FFTW_ESTIMATE; break;
+    case FR_Patient:  gridStruct.fftwFlags = FFTW_PATIENT;  break;
+    default:          gridStruct.fftwFlags = FFTW_MEASURE;
+  }
 
-  // Must take a mutex when creating grid object, because it creates fftw plans, which is not thread safe
-  epicsMutexLock(fftwMutex_);
+  // Must take a mutex when creating grid object, because it creates fftw plans, which is not thread safe.
+  // The mutex is shared by all of the objects that use the pool.
+  epicsMutexLock(tomoThreadPool::fftwMutex());
   if (debug_) logMsg("%s: %s creating grid object, filter=%s", 
                      functionName, epicsThreadGetNameSelf(), pTomoParams_->fname);
-  pGrid = new grid(&gridStruct, &sgStruct, &reconSize);
-  epicsMutexUnlock(fftwMutex_);
-
-  sinOffset = (reconSize - numPixels_)/2;
-  if (sinOffset < 0) sinOffset = 0;
-  imageSize = reconSize;
-  if (imageSize > numPixels_) imageSize = numPixels_;
-
-  sin1   = (float *) calloc(paddedWidth_ * numProjections_, sizeof(float));
-  sin2   = (float *) calloc(paddedWidth_ * numProjections_, sizeof(float));
-  recon1 = (float *) calloc(reconSize * reconSize, sizeof(float));
-  recon2 = (float *) calloc(reconSize * reconSize, sizeof(float));  
-  S1     = (float **) malloc(numProjections_ * sizeof(float *));
-  S2     = (float **) malloc(numProjections_ * sizeof(float *));
-  R1     = (float **) malloc(reconSize * sizeof(float *));
-  R2     = (float **) malloc(reconSize * sizeof(float *));
+  pWorker->pGrid = new grid(&gridStruct, &sgStruct, &reconSize);
+  epicsMutexUnlock(tomoThreadPool::fftwMutex());
+
+  pWorker->workerNum = workerNum;
+  pWorker->inUse = 1;
+  pWorker->reconSize = reconSize;
+  pWorker->sinOffset = (reconSize - imageWidth_)/2;
+  if (pWorker->sinOffset < 0) pWorker->sinOffset = 0;
+  pWorker->imageSize = reconSize;
+  if (pWorker->imageSize > imageWidth_) pWorker->imageSize = imageWidth_;
+
+  pWorker->sin1   = allocBuffer(paddedWidth_ * numProjections_, pTomoParams_->hugePages, &pWorker->sin1Pages);
+  pWorker->sin2   = allocBuffer(paddedWidth_ * numProjections_, pTomoParams_->hugePages, &pWorker->sin2Pages);
+  pWorker->recon1 = allocBuffer(reconSize * reconSize, pTomoParams_->hugePages, &pWorker->recon1Pages);
+  pWorker->recon2 = allocBuffer(reconSize * reconSize, pTomoParams_->hugePages, &pWorker->recon2Pages);
+  if (debug_ && pTomoParams_->hugePages) {
+    logMsg("%s: %s HData %s, sin1 %s, sin2 %s, recon1 %s, recon2 %s", functionName, epicsThreadGetNameSelf(),
+           tomoHugePageDescription(pWorker->pGrid->getHDataPages()),
+           tomoHugePageDescription(&pWorker->sin1Pages), tomoHugePageDescription(&pWorker->sin2Pages),
+           tomoHugePageDescription(&pWorker->recon1Pages), tomoHugePageDescription(&pWorker->recon2Pages));
+  }
+  pWorker->S1     = (float **) malloc(numProjections_ * sizeof(float *));
+  pWorker->S2     = (float **) malloc(numProjections_ * sizeof(float *));
+  pWorker->R1     = (float **) malloc(reconSize * sizeof(float *));
+  pWorker->R2     = (float **) malloc(reconSize * sizeof(float *));
 
   /* We are passed addresses of arrays (float *), while Gridrec
      wants a pointer to a table of the starting address of each row.
      Need to build those tables */
-  S1[0] = sin1;
-  S2[0] = sin2;
+  pWorker->S1[0] = pWorker->sin1;
+  pWorker->S2[0] = pWorker->sin2;
   for (i=1; i<numProjections_; i++) {
-    S1[i] = S1[i-1] + paddedWidth_;
-    S2[i] = S2[i-1] + paddedWidth_;
+    pWorker->S1[i] = pWorker->S1[i-1] + paddedWidth_;
+    pWorker->S2[i] = pWorker->S2[i-1] + paddedWidth_;
   }
-  R1[0] = recon1;
-  R2[0] = recon2;
+  pWorker->R1[0] = pWorker->recon1;
+  pWorker->R2[0] = pWorker->recon2;
   for (i=1; i<reconSize; i++) {
-      R1[i] = R1[i-1] + reconSize;
-      R2[i] = R2[i-1] + reconSize;
+      pWorker->R1[i] = pWorker->R1[i-1] + reconSize;
+      pWorker->R2[i] = pWorker->R2[i-1] + reconSize;
   }
+  if ((pTomoParams_->ringMethod == RM_Sort) && (pTomoParams_->ringWidth > 0)) allocSortBuffers(pWorker);
+  return pWorker;
+}
 
-  while (1) {
-    if (debug_) logMsg("%s: %s waiting for wake event", functionName, epicsThreadGetNameSelf());
-    // Wait for an event signalling that reconstruction has started or exiting
-    epicsEventWait(wakeEvent);
-    if (shutDown_) goto done;
-    while (1) {
-      status = epicsMessageQueueTryReceive(toDoQueue_, &toDoMessage, sizeof(toDoMessage));
-      if (status == -1) break;
-      if (status != sizeof(toDoMessage)) {
-        logMsg("%s:, error calling epicsMessageQueueReceive, status=%d", functionName, status);
-        break;
-      }
-      epicsTimeGetCurrent(&tStart);
+/** Function to delete the grid object and buffers created by createWorker().
+* \param[in] pWorker Pointer to the reconWorker_t structure */
+void tomoRecon::deleteWorker(reconWorker_t *pWorker)
+{
+  freeBuffer(pWorker->sin1, &pWorker->sin1Pages);
+  freeBuffer(pWorker->sin2, &pWorker->sin2Pages);
+  freeBuffer(pWorker->recon1, &pWorker->recon1Pages);
+  freeBuffer(pWorker->recon2, &pWorker->recon2Pages);
+  free(pWorker->S1);
+  free(pWorker->S2);
+  free(pWorker->R1);
+  free(pWorker->R2);
+  free(pWorker->sortPairs);
+  free(pWorker->sorted);
+  free(pWorker->sortIndex);
+  free(pWorker->sortFiltered);
+  free(pWorker->sortWindow);
+  epicsMutexLock(tomoThreadPool::fftwMutex());
+  delete pWorker->pGrid;
+  epicsMutexUnlock(tomoThreadPool::fftwMutex());
+  free(pWorker);
+}
 
-      if (inputDataType_ == IDT_UInt16) {
-        sinogram <epicsUInt16> (toDoMessage.pIn1, sin1);
-      } else {
-        sinogram <epicsFloat32> (toDoMessage.pIn1, sin1);
-      }
-      doneMessage.numSlices = 1;
-      if (toDoMessage.pIn2) {
-        if (inputDataType_ == IDT_UInt16) {
-          sinogram <epicsUInt16> (toDoMessage.pIn2, sin2);
-        } else {
-          sinogram <epicsFloat32> (toDoMessage.pIn2, sin2);
-        }
-          doneMessage.numSlices = 2;
-      }
-      epicsTimeGetCurrent(&tStop);
-      doneMessage.sinogramTime = epicsTimeDiffInSeconds(&tStop, &tStart);
-      epicsTimeGetCurrent(&tStart);
-      pGrid->recon(toDoMessage.center, S1, S2, &R1, &R2);
-      // Copy to output array, discard padding, apply scale and offset
-      epicsFloat32 *pOutF32    = (epicsFloat32 *) toDoMessage.pOut1;
-      epicsUInt16  *pOutUInt16 = (epicsUInt16 *)  toDoMessage.pOut1;
-      epicsInt16   *pOutInt16  = (epicsInt16 *)   toDoMessage.pOut1;
-      for (i=0, pRecon=recon1+sinOffset*reconSize; i<imageSize; i++, pRecon+=reconSize) {
-        switch (outputDataType_) {
-          case ODT_Float32:
-            for (j=0; j<imageSize; j++) pOutF32[j] = pRecon[j + sinOffset] * reconScale + reconOffset;
-            pOutF32 += imageSize;
-            break;
-          case ODT_UInt16:
-            for (j=0; j<imageSize; j++) pOutUInt16[j] = (epicsUInt16) (pRecon[j + sinOffset] * reconScale + reconOffset);
-            pOutUInt16 += imageSize;
-            break;
-          case ODT_Int16:
-            for (j=0; j<imageSize; j++) pOutInt16[j] = (epicsInt16) (pRecon[j + sinOffset] * reconScale + reconOffset);
-            pOutInt16 += imageSize;
-            break;
-        }
-      }
-      if (doneMessage.numSlices == 2) {
-        epicsFloat32 *pOutF32    = (epicsFloat32 *) toDoMessage.pOut2;
-        epicsUInt16  *pOutUInt16 = (epicsUInt16 *)  toDoMessage.pOut2;
-        epicsInt16   *pOutInt16  = (epicsInt16 *)   toDoMessage.pOut2;
-        for (i=0, pRecon=recon2+sinOffset*reconSize; i<imageSize; i++, pRecon+=reconSize) {
-          switch (outputDataType_) {
-            case ODT_Float32:
-              for (j=0; j<imageSize; j++) pOutF32[j] = pRecon[j + sinOffset] * reconScale + reconOffset;
-              pOutF32 += imageSize;
-              break;
-            case ODT_UInt16:
-              for (j=0; j<imageSize; j++) pOutUInt16[j] = (epicsUInt16) (pRecon[j + sinOffset] * reconScale + reconOffset);
-              pOutUInt16 += imageSize;
-              break;
-            case ODT_Int16:
-              for (j=0; j<imageSize; j++) pOutInt16[j] = (epicsInt16) (pRecon[j + sinOffset] * reconScale + reconOffset);
-              pOutInt16 += imageSize;
-              break;
-          }
-        }
-      }
-      epicsTimeGetCurrent(&tStop);
-      doneMessage.reconTime = epicsTimeDiffInSeconds(&tStop, &tStart);
-      doneMessage.sliceNumber = toDoMessage.sliceNumber;
-      status = epicsMessageQueueTrySend(doneQueue_, &doneMessage, sizeof(doneMessage));
-      if (status) {
-        printf("%s, error calling epicsMessageQueueTrySend, status=%d", functionName, status);
-      }
-      if (debug_ > 0) { 
-        logMsg("%s:, thread=%s, slice=%d, center=%f, sinogram time=%f, recon time=%f", 
-            functionName, epicsThreadGetNameSelf(), doneMessage.sliceNumber, toDoMessage.center,
-            doneMessage.sinogramTime, doneMessage.reconTime);
+/** Function that reconstructs one pair of slices.  Multiple pool worker threads can be running it simultaneously.
+ * \param[in] pWorker Grid object and buffers to use
+ * \param[in] pToDoMessage Message from the toDoQueue with the slices to reconstruct
+ */
+void tomoRecon::workerTask(reconWorker_t *pWorker, toDoMessage_t *pToDoMessage)
+{
+  epicsTimeStamp tStart, tStop;
+  double sinogramTime, reconTime;
+  long reconSize = pWorker->reconSize;
+  int imageSize = pWorker->imageSize;
+  int sinOffset = pWorker->sinOffset;
+  int numSlices;
+  int i, j;
+  float *pRecon;
+  float reconScale = pTomoParams_->reconScale;
+  float reconOffset = pTomoParams_->reconOffset;
+  static const char *functionName="tomoRecon::workerTask";
+  
+  if (reconScale == 0) reconScale = 1;
+  epicsTimeGetCurrent(&tStart);
+  computeSinogram(pWorker, pToDoMessage->pChunk, pToDoMessage->pIn1, pWorker->sin1, pToDoMessage->sliceCenter1);
+  numSlices = 1;
+  if (pToDoMessage->pIn2) {
+    computeSinogram(pWorker, pToDoMessage->pChunk, pToDoMessage->pIn2, pWorker->sin2, pToDoMessage->sliceCenter2);
+    numSlices = 2;
+  }
+  epicsTimeGetCurrent(&tStop);
+  sinogramTime = epicsTimeDiffInSeconds(&tStop, &tStart);
+  epicsTimeGetCurrent(&tStart);
+  pWorker->pGrid->recon(pToDoMessage->center, pWorker->S1, pWorker->S2, &pWorker->R1, &pWorker->R2);
+  // Copy to output array, discard padding, apply scale and offset
+  epicsFloat32 *pOutF32    = (epicsFloat32 *) pToDoMessage->pOut1;
+  epicsUInt16  *pOutUInt16 = (epicsUInt16 *)  pToDoMessage->pOut1;
+  epicsInt16   *pOutInt16  = (epicsInt16 *)   pToDoMessage->pOut1;
+  for (i=0, pRecon=pWorker->recon1+sinOffset*reconSize; i<imageSize; i++, pRecon+=reconSize) {
+    switch (outputDataType_) {
+      case ODT_Float32:
+        for (j=0; j<imageSize; j++) pOutF32[j] = pRecon[j + sinOffset] * reconScale + reconOffset;
+        pOutF32 += imageSize;
+        break;
+      case ODT_UInt16:
+        for (j=0; j<imageSize; j++) pOutUInt16[j] = (epicsUInt16) (pRecon[j + sinOffset] * reconScale + reconOffset);
+        pOutUInt16 += imageSize;
+        break;
+      case ODT_Int16:
+        for (j=0; j<imageSize; j++) pOutInt16[j] = (epicsInt16) (pRecon[j + sinOffset] * reconScale + reconOffset);
+        pOutInt16 += imageSize;
+        break;
+    }
+  }
+  if (numSlices == 2) {
+    epicsFloat32 *pOutF32    = (epicsFloat32 *) pToDoMessage->pOut2;
+    epicsUInt16  *pOutUInt16 = (epicsUInt16 *)  pToDoMessage->pOut2;
+    epicsInt16   *pOutInt16  = (epicsInt16 *)   pToDoMessage->pOut2;
+    for (i=0, pRecon=pWorker->recon2+sinOffset*reconSize; i<imageSize; i++, pRecon+=reconSize) {
+      switch (outputDataType_) {
+        case ODT_Float32:
+          for (j=0; j<imageSize; j++) pOutF32[j] = pRecon[j + sinOffset] * reconScale + reconOffset;
+          pOutF32 += imageSize;
+          break;
+        case ODT_UInt16:
+          for (j=0; j<imageSize; j++) pOutUInt16[j] = (epicsUInt16) (pRecon[j + sinOffset] * reconScale + reconOffset);
+          pOutUInt16 += imageSize;
+          break;
+        case ODT_Int16:
+          for (j=0; j<imageSize; j++) pOutInt16[j] = (epicsInt16) (pRecon[j + sinOffset] * reconScale + reconOffset);
+          pOutInt16 += imageSize;
+          break;
       }
-      if (shutDown_) break;
     }
   }
-  done:
-  if (sin1) free(sin1);
-  if (sin2) free(sin2);
-  if (recon1) free(recon1);
-  if (recon2) free(recon2);
-  if (S1) free(S1);
-  if (S2) free(S2);
-  if (R1) free(R1);
-  if (R2) free(R2);
-  if (pGrid) delete pGrid;
-  // Send an event so the supervisor knows this thread is done
-  epicsEventSignal(doneEvent);
-  if (debug_ > 0) {
-    logMsg("tomoRecon::workerTask %s exiting, eventId=%p", 
-        epicsThreadGetNameSelf(), doneEvent);
+  epicsTimeGetCurrent(&tStop);
+  reconTime = epicsTimeDiffInSeconds(&tStop, &tStart);
+  addSliceStatistics(pToDoMessage->pChunk->priorityClass, numSlices, sinogramTime + reconTime);
+  if (debug_ > 0) { 
+    logMsg("%s:, thread=%s, slice=%d, center=%f, sinogram time=%f, recon time=%f", 
+        functionName, epicsThreadGetNameSelf(), pToDoMessage->sliceNumber, pToDoMessage->center,
+        sinogramTime, reconTime);
+  }
+}
+
+/** Function to calculate a sinogram, calling the version of sinogram() for the input data type.
+ * For offset-axis data the 360 degree sinogram is then stitched into a 180 degree sinogram.
+ * \param[in] pWorker Worker whose buffers the ring filter can use
+ * \param[in] pChunk Chunk that the slice belongs to
+ * \param[in] pIn Pointer to normalized data input for this slice [numPixels, slice, numProjections],
+ *                or [numPixels, numProjections, slice] with sinogramInput
+ * \param[out] pOut Pointer to sinogram output [paddedSingramWidth, numProjections]
+ * \param[in] center Rotation center of this slice in detector pixels; only used for offset-axis data
+ */
+void tomoRecon::computeSinogram(reconWorker_t *pWorker, reconChunk_t *pChunk, char *pIn, float *pOut, float center)
+{
+  switch (inputDataType_) {
+    case IDT_UInt16:
+      sinogram <epicsUInt16> (pWorker, pChunk, pIn, pOut);
+      break;
+    case IDT_UInt8:
+      sinogram <epicsUInt8> (pWorker, pChunk, pIn, pOut);
+      break;
+    case IDT_UInt12Packed:
+      sinogram <mono12Packed_t> (pWorker, pChunk, pIn, pOut);
+      break;
+    default:
+      sinogram <epicsFloat32> (pWorker, pChunk, pIn, pOut);
   }
+  if (pTomoParams_->offsetAxis) stitchSinogram(pOut, center);
 }
 
 /** Function to calculate a sinogram.
  * Takes log of data (unless fluorescence flag is set.
  * Optionally does secondary normalization to air in each row of sinogram.
  * Optionally does ring artifact reduction.
- * \param[in] pIn Pointer to normalized data input for this slice [numPixels, slice, numProjections]
+ * Packed and integer input is converted to float by inputPixel() as each row is gathered.
+ * \param[in] pWorker Worker whose buffers the ring filter can use
+ * \param[in] pChunk Chunk that the slice belongs to
+ * \param[in] pIn Pointer to normalized data input for this slice [numPixels, slice, numProjections],
+ *                or [numPixels, numProjections, slice] with sinogramInput
  * \param[out] pOut Pointer to sinogram output [paddedSingramWidth, numProjections]
  */
 template <typename inputType> 
-void tomoRecon::sinogram(char *pIn, float *pOut)
+void tomoRecon::sinogram(reconWorker_t *pWorker, reconChunk_t *pChunk, char *pIn, float *pOut)
 {
   int i, j, k;
   int numAir = pTomoParams_->airPixels;
   int paddingAverage = pTomoParams_->paddingAverage;
   int ringWidth = pTomoParams_->ringWidth;
+  int ringMethod = pTomoParams_->ringMethod;
   int sinOffset = (paddedWidth_ - numPixels_)/2;
+  double ringSum;
   float *air=0, *averageRow=0, *smoothedRow=0;
   float airLeft, airRight, airSlope, ratio, outData;
-  float padLeft, padRight;
-  inputType *pInData;
+  float padLeft, padRight, pixel;
+  float *tiltRow=0;
+  tiltPixel_t *tilt=0;
+  char *pInData;
   float *pOutData;
   //static const char *functionName = "tomoRecon::sinogram";
   
+  if (pTomoParams_->tiltAngle != 0) {
+    tilt = computeTilt(pChunk, pIn);
+    tiltRow = (float *) malloc(numPixels_*sizeof(float));
+  }
+  // Reads pixel j of the row for this projection, along the tilted row if tilt correction is enabled
+  auto rowPixel = [&](int j) -> float {
+    return tiltRow ? tiltRow[j] : inputPixel<inputType>(pInData, j);
+  };
   if (numAir > 0) air = (float *) malloc(paddedWidth_*sizeof(float));
-  if (ringWidth > 0) {
+  if ((ringWidth > 0) && (ringMethod == RM_Smooth)) {
      averageRow = (float *) calloc(numPixels_, sizeof(float));
      smoothedRow = (float *) calloc(numPixels_, sizeof(float));
   }
   
-  for (i=0, pInData=(inputType *)pIn, pOutData=pOut; 
+  for (i=0, pInData=pIn, pOutData=pOut; 
        i<numProjections_;
-       i++, pInData+=numPixels_*numSlices_, pOutData+=paddedWidth_) {
+       i++, pInData+=pChunk->projectionStride, pOutData+=paddedWidth_) {
+    if (tilt) {
+      for (j=0; j<numPixels_; j++) {
+        tiltPixel_t *t = &tilt[j];
+        tiltRow[j] = (1.f - t->fy) * ((1.f - t->fx) * inputPixel<inputType>(pInData + t->y0, t->x0) +
+                                              t->fx * inputPixel<inputType>(pInData + t->y0, t->x1)) +
+                             t->fy * ((1.f - t->fx) * inputPixel<inputType>(pInData + t->y1, t->x0) +
+                                              t->fx * inputPixel<inputType>(pInData + t->y1, t->x1));
+      }
+    }
     if (numAir > 0) {
       for (j=0, airLeft=0, airRight=0; j<numAir; j++) {
-        airLeft += pInData[j];
-        airRight += pInData[numPixels_ - 1 - j];
+        airLeft += rowPixel(j);
+        airRight += rowPixel(numPixels_ - 1 - j);
       }
       airLeft /= numAir;
       airRight /= numAir;
@@ -543,20 +1351,22 @@ void tomoRecon::sinogram(char *pIn, float *pOut)
     }
     if (pTomoParams_->fluorescence) {
       for (j=0; j<numPixels_; j++) {
-        pOutData[sinOffset + j] = pInData[j];
-        if (ringWidth > 0) averageRow[j] += pInData[j];
+        pixel = rowPixel(j);
+        pOutData[sinOffset + j] = pixel;
+        if (averageRow) averageRow[j] += pixel;
       }
     }
     else {
       for (j=0; j<numPixels_; j++) {
+        pixel = rowPixel(j);
         if (numAir > 0)
-            ratio = pInData[j]/air[j];
+            ratio = pixel/air[j];
         else
-            ratio = pInData[j] * pTomoParams_->sinoScale;
+            ratio = pixel * pTomoParams_->sinoScale;
         if (ratio <= 0.) ratio = 1.;
         outData = -log(ratio);
         pOutData[sinOffset + j] = outData;
-        if (ringWidth > 0) averageRow[j] += outData;
+        if (averageRow) averageRow[j] += outData;
       }
     }
     if (paddingAverage > 0) {
@@ -573,21 +1383,27 @@ void tomoRecon::sinogram(char *pIn, float *pOut)
     }
   }
   // Do ring artifact correction if ringWidth > 0
-  if (ringWidth > 0) {
+  if (averageRow) {
     // We have now computed the average row of the sinogram
-    // Smooth it
+    // Smooth it with a running sum, so the cost does not depend on ringWidth
     for (i=0; i<numPixels_; i++) {
       averageRow[i] /= numProjections_;
     }
+    for (j=0, ringSum=0; j<ringWidth; j++) {
+      k = j-ringWidth/2;
+      if (k < 0) k = 0;
+      if (k > numPixels_ - 1) k = numPixels_ -1;
+      ringSum += averageRow[k];
+    }
     for (i=0; i<numPixels_; i++) {
-      smoothedRow[i] = 0;
-      for (j=0; j<ringWidth; j++) {
-        k = i+j-ringWidth/2;
-        if (k < 0) k = 0;
-        if (k > numPixels_ - 1) k = numPixels_ -1;
-        smoothedRow[i] += averageRow[k];
-      }
-      smoothedRow[i] /= ringWidth;
+      smoothedRow[i] = (float)(ringSum / ringWidth);
+      // Slide the kernel one pixel: add the pixel entering on the right, remove the one leaving on the left
+      k = i+ringWidth-ringWidth/2;
+      if (k > numPixels_ - 1) k = numPixels_ -1;
+      ringSum += averageRow[k];
+      k = i-ringWidth/2;
+      if (k < 0) k = 0;
+      ringSum -= averageRow[k];
     }
     // Subtract this difference from each row in sinogram
     for (i=0, pOutData=pOut; 
@@ -598,9 +1414,225 @@ void tomoRecon::sinogram(char *pIn, float *pOut)
       }
     }
   }
+  else if ((ringWidth > 0) && (ringMethod == RM_Sort)) {
+    ringFilterSort(pWorker, pOut);
+  }
   if (air) free(air);
   if (averageRow) free(averageRow);
   if (smoothedRow) free(smoothedRow);
+  if (tilt) free(tilt);
+  if (tiltRow) free(tiltRow);
+}
+
+/** Function to compute the interpolation coefficients for reading a slice along a tilted row.
+ * The row is rotated by tiltAngle about the center pixel of the slice being reconstructed.
+ * Rows that fall outside the input slices of the chunk are clamped to the first or last slice.
+ * The coefficients are the same for every projection, so they are computed once per sinogram.
+ * \param[in] pChunk Chunk that the slice belongs to
+ * \param[in] pIn Pointer to the slice being reconstructed in the first projection
+ * \return Array of numPixels coefficients, which the caller must free
+ */
+tiltPixel_t* tomoRecon::computeTilt(reconChunk_t *pChunk, char *pIn)
+{
+  int j;
+  int inputSlices = pChunk->inputSlices;
+  int slice = (int)((pIn - pChunk->pInput) / pChunk->sliceStride);
+  double angle = pTomoParams_->tiltAngle * pi / 180.;
+  double cosTilt = cos(angle);
+  double sinTilt = sin(angle);
+  double xCenter = (numPixels_ - 1)/2.;
+  double x, y;
+  tiltPixel_t *tilt = (tiltPixel_t *) malloc(numPixels_ * sizeof(tiltPixel_t));
+
+  for (j=0; j<numPixels_; j++) {
+    x = xCenter + (j - xCenter)*cosTilt;
+    y = slice + (j - xCenter)*sinTilt;
+    if (x < 0) x = 0;
+    if (x > numPixels_ - 1) x = numPixels_ - 1;
+    if (y < 0) y = 0;
+    if (y > inputSlices - 1) y = inputSlices - 1;
+    tilt[j].x0 = (int)x;
+    tilt[j].x1 = (tilt[j].x0 < numPixels_ - 1) ? tilt[j].x0 + 1 : tilt[j].x0;
+    tilt[j].fx = (float)(x - tilt[j].x0);
+    tilt[j].y0 = (long)((int)y - slice) * (long)pChunk->sliceStride;
+    tilt[j].y1 = ((int)y < inputSlices - 1) ? tilt[j].y0 + (long)pChunk->sliceStride : tilt[j].y0;
+    tilt[j].fy = (float)(y - (int)y);
+  }
+  return tilt;
+}
+
+/** Function to stitch a 360 degree offset-axis sinogram into a 180 degree sinogram.
+ * Row i of the result combines projection i with the mirror image of projection i+numProjections/2,
+ * with the rotation axis at the middle of the padded row.  Where both projections cover the same
+ * distance from the axis they are blended with weights that ramp linearly across the overlap.
+ * Works in place, because row i is only written after rows i and i+numProjections/2 have been read.
+ * \param[in,out] pSinogram Pointer to sinogram [paddedSinogramWidth, numProjections]; on return
+ *                rows 0 to numProjections/2-1 contain the stitched sinogram
+ * \param[in] center Rotation center of this slice in detector pixels
+ */
+void tomoRecon::stitchSinogram(float *pSinogram, float center)
+{
+  int i, j, x0;
+  int first, last;
+  int haveDirect, haveMirror;
+  int sinOffset = (paddedWidth_ - numPixels_)/2;
+  int paddingAverage = pTomoParams_->paddingAverage;
+  float axis = float(paddedWidth_/2);
+  float maxPixel = float(numPixels_ - 1);
+  float overlap = (center < maxPixel - center) ? center : maxPixel - center;
+  int axisRight = (center > maxPixel/2);
+  float d, x, f, w, direct=0, mirror=0;
+  float padLeft, padRight;
+  float *pDirect, *pMirror;
+  float *row = (float *) malloc(paddedWidth_ * sizeof(float));
+
+  for (i=0; i<numAngles_; i++) {
+    pDirect = pSinogram + i*paddedWidth_ + sinOffset;
+    pMirror = pSinogram + (i + numAngles_)*paddedWidth_ + sinOffset;
+    first = -1;
+    last = -1;
+    for (j=0; j<paddedWidth_; j++) {
+      d = j - axis;
+      x = center + d;
+      haveDirect = (x >= 0) && (x <= maxPixel);
+      if (haveDirect) {
+        x0 = (int)x;
+        f = x - x0;
+        direct = (x0 < numPixels_ - 1) ? (1.f - f)*pDirect[x0] + f*pDirect[x0+1] : pDirect[x0];
+      }
+      x = center - d;
+      haveMirror = (x >= 0) && (x <= maxPixel);
+      if (haveMirror) {
+        x0 = (int)x;
+        f = x - x0;
+        mirror = (x0 < numPixels_ - 1) ? (1.f - f)*pMirror[x0] + f*pMirror[x0+1] : pMirror[x0];
+      }
+      if (haveDirect && haveMirror) {
+        // Weight of the direct projection goes from 1 on its own side of the overlap to 0 on the other side
+        w = 1.f;
+        if (overlap > 0) w = (axisRight ? (overlap - d) : (overlap + d)) / (2.f*overlap);
+        if (w < 0) w = 0;
+        if (w > 1) w = 1;
+        row[j] = w*direct + (1.f - w)*mirror;
+      } else if (haveDirect) {
+        row[j] = direct;
+      } else if (haveMirror) {
+        row[j] = mirror;
+      } else {
+        row[j] = 0;
+        continue;
+      }
+      if (first < 0) first = j;
+      last = j;
+    }
+    if ((paddingAverage > 0) && (first >= 0)) {
+      for (j=0, padLeft=0, padRight=0; j<paddingAverage; j++) {
+        padLeft += row[first + j];
+        padRight += row[last - j];
+      }
+      padLeft /= paddingAverage;
+      padRight /= paddingAverage;
+      for (j=0; j<first; j++) row[j] = padLeft;
+      for (j=last+1; j<paddedWidth_; j++) row[j] = padRight;
+    }
+    memcpy(pSinogram + i*paddedWidth_, row, paddedWidth_ * sizeof(float));
+  }
+  free(row);
+}
+
+/** Allocates the buffers that ringFilterSort() uses, so they are not allocated for each sinogram.
+ * The sorted arrays are sized for paddedSinogramWidth so they do not depend on numPixels,
+ * and the median window is grown if ringWidth is larger than when it was allocated.
+ * \param[in] pWorker Worker to allocate the buffers for
+ */
+void tomoRecon::allocSortBuffers(reconWorker_t *pWorker)
+{
+  int ringWidth = pTomoParams_->ringWidth;
+
+  if (!pWorker->sorted) {
+    pWorker->sortPairs    = (sortPair_t *) malloc(numProjections_ * sizeof(sortPair_t));
+    pWorker->sorted       = (float *) malloc(paddedWidth_ * numProjections_ * sizeof(float));
+    pWorker->sortIndex    = (int *) malloc(paddedWidth_ * numProjections_ * sizeof(int));
+    pWorker->sortFiltered = (float *) malloc(paddedWidth_ * sizeof(float));
+  }
+  if (pWorker->sortWindowSize < ringWidth) {
+    free(pWorker->sortWindow);
+    pWorker->sortWindow = (float *) malloc(ringWidth * sizeof(float));
+    pWorker->sortWindowSize = ringWidth;
+  }
+}
+
+/** Function to do ring artifact reduction with the sorting-based stripe removal method.
+ * Each column of the sinogram is sorted along the projection axis, each row of the sorted sinogram
+ * is median filtered across the columns with a kernel of ringWidth pixels, and the filtered values
+ * are put back at the projections they were sorted from.  Stripes are constant offsets of a column, so they
+ * appear as outlier columns in the sorted sinogram, which the median removes while leaving real structure intact.
+ * The median uses a sliding sorted window, so each output pixel costs O(ringWidth) memory moves rather than a sort.
+ * Called from sinogram() so it operates on the sinogram while it is still in cache.
+ * \param[in] pWorker Worker whose sort buffers are used; they are allocated here if the worker was created
+ *                    before the sorting ring filter was selected
+ * \param[in,out] pSinogram Pointer to sinogram [paddedSinogramWidth, numProjections]; the padding is not modified
+ */
+void tomoRecon::ringFilterSort(reconWorker_t *pWorker, float *pSinogram)
+{
+  int i, j, k, r;
+  int ringWidth = pTomoParams_->ringWidth;
+  int sinOffset = (paddedWidth_ - numPixels_)/2;
+  int pos;
+  float oldValue, newValue;
+  float *pRow;
+  sortPair_t *pairs;
+  float *sorted, *window, *filtered;
+  int *sortIndex;
+
+  if (!pWorker->sorted || (pWorker->sortWindowSize < ringWidth)) allocSortBuffers(pWorker);
+  pairs     = pWorker->sortPairs;
+  sorted    = pWorker->sorted;
+  sortIndex = pWorker->sortIndex;
+  window    = pWorker->sortWindow;
+  filtered  = pWorker->sortFiltered;
+
+  // Sort each column of the sinogram, saving the sorted values and the projection they came from
+  // as rows of [numPixels, numProjections] arrays
+  for (j=0; j<numPixels_; j++) {
+    for (i=0; i<numProjections_; i++) {
+      pairs[i].value = pSinogram[i*paddedWidth_ + sinOffset + j];
+      pairs[i].index = i;
+    }
+    std::sort(pairs, pairs + numProjections_, sortPairLess);
+    for (r=0; r<numProjections_; r++) {
+      sorted[r*numPixels_ + j] = pairs[r].value;
+      sortIndex[r*numPixels_ + j] = pairs[r].index;
+    }
+  }
+  // Median filter each row of the sorted sinogram and write it back unsorted
+  for (r=0, pRow=sorted; r<numProjections_; r++, pRow+=numPixels_) {
+    for (k=0; k<ringWidth; k++) {
+      j = k-ringWidth/2;
+      if (j < 0) j = 0;
+      if (j > numPixels_ - 1) j = numPixels_ -1;
+      window[k] = pRow[j];
+    }
+    std::sort(window, window + ringWidth);
+    for (i=0; i<numPixels_; i++) {
+      filtered[i] = window[ringWidth/2];
+      // Slide the window one pixel, keeping it sorted
+      j = i-ringWidth/2;
+      if (j < 0) j = 0;
+      oldValue = pRow[j];
+      j = i+ringWidth-ringWidth/2;
+      if (j > numPixels_ - 1) j = numPixels_ -1;
+      newValue = pRow[j];
+      pos = (int)(std::lower_bound(window, window + ringWidth, oldValue) - window);
+      memmove(window + pos, window + pos + 1, (ringWidth - 1 - pos) * sizeof(float));
+      pos = (int)(std::upper_bound(window, window + ringWidth - 1, newValue) - window);
+      memmove(window + pos + 1, window + pos, (ringWidth - 1 - pos) * sizeof(float));
+      window[pos] = newValue;
+    }
+    for (j=0; j<numPixels_; j++) {
+      pSinogram[sortIndex[r*numPixels_ + j]*paddedWidth_ + sinOffset + j] = filtered[j];
+    }
+  }
 }
 
 /** Logs messages.
@@ -4,6 +4,7 @@
  * C++ class for doing computed tomography reconstruction using Gridrec.
  *
  * This runs the reconstruction using multiple threads, each thread reconstructing a set of slices.
+ * The threads are in the tomoThreadPool, which is shared with other tomoRecon and tomoPreprocess objects.
  *
  * It uses the EPICS libCom library for OS-independent functions for threads, mutexes, message queues, etc.
  *
@@ -15,51 +16,163 @@
 #include <epicsMessageQueue.h>
 #include <epicsEvent.h>
 #include <epicsMutex.h>
+#include <epicsTypes.h>
+#include <epicsTime.h>
 
+#include "tomoThreadPool.h"
+#include "tomoHugePages.h"
 #include "grid.h"
 
 // Input data type
 typedef enum {
   IDT_Float32,
-  IDT_UInt16
+  IDT_UInt16,
+  IDT_UInt8,
+  IDT_UInt12Packed   /**< Mono12Packed, 2 pixels in 3 bytes; numPixels must be even */
 } IDT_t;
 
-// Output data type
+// Output data type.  tomoPreprocess.h defines the same enum, so both headers can be included.
+#ifndef ODT_T_DEFINED
+#define ODT_T_DEFINED
 typedef enum {
   ODT_Float32,
   ODT_UInt16,
-  ODT_Int16
+  ODT_Int16,
+  ODT_Float16    /**< IEEE half precision; tomoPreprocess output only */
 } ODT_t;
+#endif
+
+// Ring artifact reduction method
+typedef enum {
+  RM_Smooth,
+  RM_Sort
+} RM_t;
 
+// FFTW planning rigor for the grid FFT plans.  tomoPreprocess.h defines the same enum, so both headers can be included.
+#ifndef FR_T_DEFINED
+#define FR_T_DEFINED
+typedef enum {
+  FR_Default,  /**< tomoRecon: use the machine profile if there is one, otherwise FR_Measure; tomoPreprocess: FR_Estimate */
+  FR_Estimate,
+  FR_Measure,
+  FR_Patient
+} FR_t;
+#endif
+
+
+/** Structure with the state of one chunk of slices passed to tomoRecon::reconstruct or tomoRecon::submitChunk */
+typedef struct {
+  int chunkId;            /**< Id of the chunk, which submitChunk returns */
+  int numSlices;          /**< Number of slices to reconstruct */
+  int inputSlices;        /**< Number of slices in the input */
+  int slicesRemaining;    /**< Number of slices not yet written to the output; 0 when the chunk is free */
+  char *pInput;           /**< Pointer to input data [numPixels, inputSlices, numProjections], or [numPixels, numProjections, inputSlices]
+                               with tomoParams_t.sinogramInput */
+  size_t sliceStride;     /**< Bytes from one slice of the input to the next */
+  size_t projectionStride; /**< Bytes from one projection of the input to the next */
+  epicsUInt32 *sliceDone; /**< Bitmap of the slices that have been written to the output */
+  epicsEventId doneEvent; /**< Signalled when the last slice of the chunk has been written */
+  epicsTimeStamp queueTime; /**< Time the chunk was queued */
+  int priorityClass;      /**< PC_t priority class of the object when the chunk was queued */
+  int numCancelled;       /**< Number of slices of the chunk that were cancelled */
+} reconChunk_t;
 
 /** Structure that is passed from the constructor to the workerTasks in the toDoQueue */
 typedef struct {
+  reconChunk_t *pChunk;  /**< Chunk that these slices belong to */
   int sliceNumber;  /**< Slice number of first slice */
   float center;     /**< Rotation center to use for these slices */
   char *pIn1;      /**< Pointer to first input slice */
   char *pIn2;      /**< Pointer to second input slice.  Can be NULL */
   char *pOut1;     /**< Pointer to first output slice */
   char *pOut2;     /**< Pointer to second output slice. Can be NULL */
+  float sliceCenter1; /**< Rotation center of first slice in detector pixels; used when stitching offset-axis data */
+  float sliceCenter2; /**< Rotation center of second slice in detector pixels; used when stitching offset-axis data */
 } toDoMessage_t;
 
-/** Structure that is passed from the workerTask to the supervisorTask in the doneQueue */
+/** Structure used to sort a sinogram column while remembering the projection each value came from */
 typedef struct {
-  int sliceNumber;      /**< Slice number of first slice */
-  int numSlices;        /**< Number of slices that we reconstructed. 1 or 2. */
-  double sinogramTime;  /**< Time required to compute the sinograms */
-  double reconTime;     /**< Time required to reconstruct */
-} doneMessage_t;
+  float value;  /**< Sinogram value */
+  int index;    /**< Projection number */
+} sortPair_t;
+
+/** Structure with the grid object and buffers that a task uses to reconstruct slices.
+* A tomoRecon object creates at most numThreads of these for each geometry, on the pool worker threads that
+* run its tasks.  A task uses the one its pool worker thread created when that one is free. */
+typedef struct {
+  int workerNum;    /**< Pool worker thread that created this structure */
+  int inUse;        /**< 1 while a task is using this structure */
+  grid *pGrid;      /**< Gridrec object */
+  long reconSize;   /**< Size of the images that pGrid produces */
+  int imageSize;    /**< Size of the images that are copied to the output */
+  int sinOffset;    /**< Offset of the output images in the pGrid images */
+  float *sin1;      /**< First sinogram [paddedSinogramWidth, numProjections] */
+  float *sin2;      /**< Second sinogram [paddedSinogramWidth, numProjections] */
+  float *recon1;    /**< First reconstruction [reconSize, reconSize] */
+  float *recon2;    /**< Second reconstruction [reconSize, reconSize] */
+  float **S1;       /**< Table of pointers to rows of sin1 */
+  float **S2;       /**< Table of pointers to rows of sin2 */
+  float **R1;       /**< Table of pointers to rows of recon1 */
+  float **R2;       /**< Table of pointers to rows of recon2 */
+  hugePageInfo_t sin1Pages;   /**< How sin1 was allocated */
+  hugePageInfo_t sin2Pages;   /**< How sin2 was allocated */
+  hugePageInfo_t recon1Pages; /**< How recon1 was allocated */
+  hugePageInfo_t recon2Pages; /**< How recon2 was allocated */
+  sortPair_t *sortPairs;  /**< One sinogram column being sorted by ringFilterSort() [numProjections] */
+  float *sorted;          /**< Sorted sinogram columns for ringFilterSort() [paddedSinogramWidth, numProjections] */
+  int *sortIndex;         /**< Projection each value in sorted came from [paddedSinogramWidth, numProjections] */
+  float *sortFiltered;    /**< Median filtered row of sorted [paddedSinogramWidth] */
+  float *sortWindow;      /**< Sliding median window for ringFilterSort() [sortWindowSize] */
+  int sortWindowSize;     /**< Number of elements allocated in sortWindow */
+} reconWorker_t;
+
+/** Structure with the parameters that determine the grid objects and buffers, and the reconWorker_t structures
+* that were created with them.  tomoRecon keeps several of these so that reconfigure() can switch back to a
+* recently used geometry without creating the grid objects and FFTW plans again. */
+typedef struct {
+  int numProjections;   /**< Number of projections */
+  int numAngles;        /**< Number of angles in the sinogram that is reconstructed */
+  int paddedWidth;      /**< Padded sinogram width */
+  int imageWidth;       /**< Width of the output images */
+  int geom;             /**< Gridrec geometry */
+  float pswfParam;      /**< PSWF parameter */
+  float sampl;          /**< Oversampling ratio */
+  float MaxPixSiz;      /**< Max pixel size */
+  float ROI;            /**< Region of interest relative size */
+  float X0;             /**< Offset of ROI */
+  float Y0;             /**< Offset of ROI */
+  int ltbl;             /**< Number of elements in convolvent lookup tables */
+  char fname[16];       /**< Name of filter function */
+  int hugePages;        /**< HP_t method used for the grid and sinogram buffers */
+  int fftwRigor;        /**< FR_t rigor of the FFTW plans */
+  float *angles;        /**< Copy of the numAngles angles */
+  int lastUsed;         /**< Value of the use counter when this geometry was last selected; 0 if the entry is empty */
+  int numWorkers;       /**< Number of entries in workers that are created or being created */
+  reconWorker_t *workers[tomoThreadPool::maxWorkers]; /**< Grid objects and buffers; NULL while being created */
+} reconGeometry_t;
+
+/** Bilinear interpolation coefficients for one pixel of a tilted sinogram row */
+typedef struct {
+  int x0;      /**< Left input pixel */
+  int x1;      /**< Right input pixel */
+  long y0;     /**< Byte offset from the slice being reconstructed to the lower input row */
+  long y1;     /**< Byte offset from the slice being reconstructed to the upper input row */
+  float fx;    /**< Weight of x1 */
+  float fy;    /**< Weight of y1 */
+} tiltPixel_t;
 
 /** Structure that is passed to the constructor to define the reconstruction 
     NOTE: This structure must match the structure defined in IDL in tomo_params__define.pro! 
     There are fields in this structure that are not used by tomoRecon, but are present because
-    they are used by other reconstruction methods */
+    they are used by other reconstruction methods.
+    New fields must be added at the end, where 0 selects the previous behaviour, because tomoReconCreateIDL
+    sets the fields after the end of an older IDL structure to 0. */
 typedef struct {
   int numPixels;            /**< Number of horizontal pixels in the input data */
   int numProjections;       /**< Number of projection angles in the input data */
   int numSlices;            /**< Maximum number of slices that will be passed to tomoRecon::reconstruct */
   int inputDataType;        /**< Data type of input, IDT_t enum */
-  int outputDataType;       /**< Data type of output, ODT_t enum */
+  int outputDataType;       /**< Data type of output, ODT_t enum; ODT_Float32, ODT_UInt16 or ODT_Int16 */
   float sinoScale;          /**< Scale factor to multiply sinogram when airPixels=0 */
   float reconScale;         /**< Scale factor to multiple reconstruction */
   float reconOffset;        /**< Offset factor to multiple reconstruction */
@@ -68,7 +181,7 @@ typedef struct {
   int airPixels;            /**< Number of pixels of air on each side of sinogram to use for secondary normalization */
   int ringWidth;            /**< Number of pixels in smoothing kernel when doing ring artifact reduction; 0 disables ring artifact reduction */
   int fluorescence;         /**< Set to 1 if the data are fluorescence data and should not have the log taken when computing sinogram */
-  int numThreads;           /**< Number of workerTask threads to create */
+  int numThreads;           /**< Number of pool threads to use for reconstruction */
   int debug;                /**< Debug output level; 0: only error messages, 1: debugging from tomoRecon, 2: debugging also from grid */
   char debugFileName[256];  /**< Name of file for debugging output;  use 0 length string ("") to send output to stdout */
   // These are gridRec parameters
@@ -81,19 +194,60 @@ typedef struct {
   float Y0;                 /**< Offset of ROI from rotation axis in units of center-to-edge distance */
   int ltbl;                 /**< Number of elements in convolvent lookup tables */
   char fname[16];           /**< Name of filter function */
+  int ringMethod;           /**< Ring artifact reduction method, RM_t enum.  RM_Smooth subtracts the difference between the
+                                 average row and its smoothed version, RM_Sort median filters the column-sorted sinogram.
+                                 ringWidth is the kernel width for both. */
+  float tiltAngle;          /**< Tilt of the rotation axis in the detector plane in degrees; 0 disables tilt correction.
+                                 Each slice is then read along a row rotated by this angle about the center pixel,
+                                 interpolating between neighbouring slices. */
+  int offsetAxis;           /**< Set to 1 for 360 degree offset-axis (half-acquisition) data.  Projections i and 
+                                 i+numProjections/2 are stitched around the rotation center of each slice into a 180 degree
+                                 sinogram, paddedSinogramWidth must be >= 2*numPixels, and the output is [2*numPixels, 2*numPixels, numSlices] */
+  int maxChunks;            /**< Maximum number of chunks that can be in flight with tomoRecon::submitChunk; 0 selects 2 */
+  int gridCacheSize;        /**< Number of geometries whose grid objects tomoRecon::reconfigure keeps; 0 selects 4.
+                                 Only used when the tomoRecon object is created. */
+  int pinThreads;           /**< Set to 1 to pin the tomoThreadPool threads to CPUs spread over the NUMA nodes, so that the
+                                 grid objects and buffers of each thread are allocated on its node */
+  float memoryBudget;       /**< Memory in MB that the object may use, as computed by tomoRecon::estimateMemory; 0 for no limit.
+                                 If the budget is exceeded the object uses fewer threads than numThreads.
+                                 tomoRecon::fitMemoryBudget also chooses numSlices to fit. */
+  int hugePages;            /**< HP_t method for backing the FFT arrays, sinograms and reconstructions of each thread with
+                                 huge pages.  The input and output of each reconstruction are then also advised to use
+                                 transparent huge pages.  Falls back to normal pages if huge pages are not available. */
+  int priorityClass;        /**< PC_t priority class of the tasks in the tomoThreadPool.  The pairs of slices of PC_Interactive
+                                 objects are reconstructed before those of PC_Batch objects in the same process. */
+  int fftwRigor;            /**< FR_t rigor of the FFTW plans of the grid objects.  More rigorous plans take longer to create
+                                 and may run faster. */
+  int sinogramInput;        /**< Set to 1 if the input is sinogram-major [numPixels, numProjections, numSlices], as written by
+                                 tomoPreprocess with sinogramOutput, so each sinogram row is read contiguously.
+                                 Set fluorescence to 1 as well if the input already has the -log (tomoPreprocess takeLog). */
 } tomoParams_t;
 
+/** Reconstruction statistics for a priority class, for all tomoRecon objects in the process */
+typedef struct {
+  double elapsedTime;     /**< Seconds since the statistics were reset */
+  double numSlices;       /**< Number of slices reconstructed */
+  double numChunks;       /**< Number of reconstruct() or submitChunk() calls whose slices were all reconstructed */
+  double threadTime;      /**< Thread seconds spent computing sinograms and reconstructing */
+  double slicesPerSecond; /**< numSlices / elapsedTime */
+  double meanLatency;     /**< Mean seconds from queuing a chunk to writing its last slice */
+  double maxLatency;      /**< Maximum seconds from queuing a chunk to writing its last slice */
+} tomoReconStats_t;
+
 #ifdef __cplusplus
 
-/** Structure that is used to create a worker task.  This is the structure passed to epicsThreadCreate() */
-typedef struct {
-  class tomoRecon *pTomoRecon; /**< Pointer to the tomoRecon object */
-  int taskNum;                 /**< Task number that is passed to tomoRecon::workerTask */
-} workerCreateStruct;
+/** Function that is called when each slice has been written to the output.
+* It is called from the pool worker thread that reconstructed the slice, so it must be thread-safe and should be quick.
+* \param[in] pUserPvt Pointer that was passed to tomoRecon::setSliceCallback
+* \param[in] sliceNumber Number of the slice in the output, 0 to numSlices-1
+* \param[in] pOutput Pointer to the reconstructed slice in the output */
+typedef void (*tomoReconSliceCallback_t)(void *pUserPvt, int sliceNumber, char *pOutput);
 
 /** Class to do tomography reconstruction.
-* Creates a supervisorTask that supervises the reconstruction process, and a set of workerTask threads
-* that compute the sinograms and do the reconstruction.
+* Submits tasks to the tomoThreadPool that compute the sinograms and do the reconstruction.
+* Each task reconstructs one pair of slices from the toDoQueue and then submits itself again while there
+* are slices left, so at most numThreads pool threads work on this object at once and the pool can interleave
+* the work of other objects between pairs.
 * The reconstruction is done with the GridRec code, originally written at Brookhaven National Lab.
 * Gridrec was modified to be thread-safe.
 * When the class is created it can be used to reconstruct many slices in a single call, and does
@@ -101,45 +255,103 @@ typedef struct {
 * repeatedly to reconstruct more sets of slices.  Once the object is created it is restricted to
 * reconstructing with the same set of parameters, with the exception of the rotation center, which
 * can be specified on a slice-by-slice basis.  If the reconstruction parameters change (number of X pixels, 
-* number of projections, Gridrec parameters, etc.) then the tomoRecon object must be deleted and a
-* new one created.
+* number of projections, Gridrec parameters, etc.) then reconfigure() must be called.  It keeps the grid objects of the
+* last tomoParams_t.gridCacheSize geometries, so switching back to one of them does not create them again.
+* Objects with tomoParams_t.priorityClass PC_Interactive have their pairs of slices reconstructed before those of
+* PC_Batch objects, so a quick check of the rotation center does not wait for a large reconstruction to finish.
+* getStatistics() reports the throughput and latency of each class.
+* The object keeps a copy of the tomoParams_t structure.  numThreads, paddedSinogramWidth, sampl and fftwRigor that are 0
+* are taken from the machine profile that tune() writes, see applyProfile().
+* estimateMemory() reports the memory per thread and in total for a set of parameters.  With tomoParams_t.memoryBudget
+* the object uses fewer threads if needed to stay within the budget, and fitMemoryBudget() also chooses numSlices.
+* Completion can be polled with poll(), waited for with wait(), or followed slice by slice with
+* a callback from setSliceCallback() or with isSliceDone().  cancel() stops a reconstruction and keeps the object ready for the next one.
+* submitChunk() queues a chunk of slices with its own input, output and centers without waiting for the previous
+* chunks to finish, up to tomoParams_t.maxChunks chunks in flight.  The tasks take the slices of the next chunk as soon
+* as those of the previous chunk are taken, so the caller can read chunk k+1 and write chunk k-1 while chunk k is reconstructed.
 */
-class tomoRecon {
+class tomoRecon : public tomoPoolTask {
 public:
   tomoRecon(tomoParams_t *pTomoParams, float *pAngles);
   ~tomoRecon();
+  static void estimateMemory(tomoParams_t *pTomoParams, double *pThreadBytes, double *pTotalBytes);
+  static int fitMemoryBudget(tomoParams_t *pTomoParams);
+  static void getStatistics(int priorityClass, tomoReconStats_t *pStats);
+  static void resetStatistics();
+  static int applyProfile(tomoParams_t *pTomoParams, const char *profileFileName);
+  static int tune(tomoParams_t *pTomoParams, float *pAngles, const char *profileFileName);
+  int reconfigure(tomoParams_t *pTomoParams, float *pAngles);
   int reconstruct(int numSlices, float *center, char *pInput, char *pOutput);
-  void supervisorTask();
-  void workerTask(int taskNum);
-  template <typename inputType> void sinogram(char *pIn, float *pOut);
+  int reconstruct(int numSlices, int *sliceIndex, float *center, char *pInput, char *pOutput);
+  int submitChunk(int numSlices, float *center, char *pInput, char *pOutput);
+  int waitChunk(int chunkId, double timeout);
+  int cancel();
+  void run(int workerNum);
+  int priorityClass();
+  void setPriorityClass(int priorityClass);
+  void workerTask(reconWorker_t *pWorker, toDoMessage_t *pToDoMessage);
+  template <typename inputType> void sinogram(reconWorker_t *pWorker, reconChunk_t *pChunk, char *pIn, float *pOut);
+  void computeSinogram(reconWorker_t *pWorker, reconChunk_t *pChunk, char *pIn, float *pOut, float center);
   void poll(int *pReconComplete, int *pSlicesRemaining);
+  int wait(double timeout);
+  int isSliceDone(int sliceNumber);
+  void setSliceCallback(tomoReconSliceCallback_t callback, void *pUserPvt);
   void logMsg(const char *pFormat, ...);
 
 private:
+  int startReconstruction(int numSlices, int *sliceIndex, float *center, char *pInput, char *pOutput, int asynchronous);
   void shutDown();
+  int configure();
+  void createChunks();
+  void deleteChunks();
+  void selectGeometry();
+  void deleteGeometry(reconGeometry_t *pGeometry);
+  void sliceComplete(reconChunk_t *pChunk, int sliceNumber, char *pOutput);
+  void countSlices(reconChunk_t *pChunk, int numSlices);
+  reconWorker_t *getWorker(int workerNum);
+  reconWorker_t *createWorker(int workerNum);
+  void deleteWorker(reconWorker_t *pWorker);
+  void allocSortBuffers(reconWorker_t *pWorker);
+  void ringFilterSort(reconWorker_t *pWorker, float *pSinogram);
+  tiltPixel_t *computeTilt(reconChunk_t *pChunk, char *pIn);
+  void stitchSinogram(float *pSinogram, float center);
+  tomoParams_t params_;
   tomoParams_t *pTomoParams_;
   int numPixels_;
   int numSlices_;
   int numProjections_;
+  int numAngles_;
+  int imageWidth_;
   int inputDataType_;
+  int inputRowSize_;
   int outputDataType_;
+  int outputPixelSize_;
   int paddedWidth_;
   int numThreads_;
   float *pAngles_;
-  char *pInput_;
-  char *pOutput_;
+  int maxChunks_;
+  int nextChunkId_;
+  int lastChunk_;
+  reconChunk_t *chunks_;
   int queueElements_;
+  reconGeometry_t *geometries_;
+  reconGeometry_t *pGeometry_;
+  int maxGeometries_;
+  int geometryUseCount_;
+  int priorityClass_;
   int debug_;
   FILE *debugFile_;
   int reconComplete_;
   int slicesRemaining_;
+  tomoReconSliceCallback_t sliceCallback_;
+  void *sliceCallbackPvt_;
   int shutDown_;
+  int activeTasks_;
+  tomoThreadPool *pPool_;
   epicsMessageQueueId toDoQueue_;
-  epicsMessageQueueId doneQueue_;
-  epicsEventId supervisorWakeEvent_;
-  epicsEventId supervisorDoneEvent_;
-  epicsEventId *workerWakeEvents_;
-  epicsEventId *workerDoneEvents_;
-  epicsMutexId fftwMutex_;
+  epicsEventId idleEvent_;
+  epicsEventId doneEvent_;
+  epicsEventId chunkFreeEvent_;
+  epicsMutexId mutex_;
 };
 #endif
@@ -6,6 +6,9 @@
    July, 2012
 */
 
+#include <stddef.h>
+#include <string.h>
+
 #include "tomoRecon.h"
 
 #include <epicsExport.h>
@@ -18,28 +21,42 @@ static float *angles = 0;
 
 extern "C" {
 /** Function to create a tomoRecon object from IDL. 
- * \param[in] argc Number of parameters = 2
+ * \param[in] argc Number of parameters = 2 or 3
  * \param[in] argv Array of pointers.<br/>
  *            argv[0] = Pointer to a tomoParams_t structure, which defines the reconstruction parameters <br/>
  *            argv[1] = Pointer to float array of angles in degrees <br/>
+ *            argv[2] = Pointer to the size of the structure in bytes, n_tags(tomoParams, /length).  Optional. <br/>
  * These arguments are copied to static variables in this file, because the IDL variables could be deleted
- * and returned to the heap while the tomoRecon object still exists. */
+ * and returned to the heap while the tomoRecon object still exists.
+ * Only the part of tomoParams_t that the IDL structure covers is copied and the fields after it are set to 0,
+ * so IDL code written for an older tomoParams_t keeps working.  Without argv[2] the structure is assumed to end
+ * before ringMethod, as it did before R2-0.
+ * If a tomoRecon object already exists any reconstruction in progress is cancelled and the object is
+ * reconfigured with tomoRecon::reconfigure(), so the grid objects of recently used geometries are reused. */
 epicsShareFunc void epicsShareAPI tomoReconCreateIDL(int argc, char *argv[])
 {
   tomoParams_t *pTomoParams = (tomoParams_t *)argv[0];
   float *pAngles            =        (float *)argv[1];
+  size_t paramsSize        = (argc >= 3) ? *(int *)argv[2] : offsetof(tomoParams_t, ringMethod);
+  float *oldAngles = angles;
   
+  if (pTomoRecon) pTomoRecon->cancel();
   // Make a local copy of tomoParams and angles because the IDL variables could be deleted
-  memcpy(&tomoParams, pTomoParams, sizeof(tomoParams));
-  if (angles) free(angles);
+  if (paramsSize > sizeof(tomoParams)) paramsSize = sizeof(tomoParams);
+  memset(&tomoParams, 0, sizeof(tomoParams));
+  memcpy(&tomoParams, pTomoParams, paramsSize);
   angles = (float *)malloc(tomoParams.numProjections*sizeof(float));
   memcpy(angles, pAngles, tomoParams.numProjections*sizeof(float));
-  if (pTomoRecon) delete pTomoRecon;
-  pTomoRecon = new tomoRecon(&tomoParams, angles);
+  if (pTomoRecon) {
+    pTomoRecon->reconfigure(&tomoParams, angles);
+  } else {
+    pTomoRecon = new tomoRecon(&tomoParams, angles);
+  }
+  if (oldAngles) free(oldAngles);
 }
 
 /** Function to delete the tomoRecon object created with tomoReconCreateIDL.
-* Note that any existing tomoRecon object is automatically deleted the next time
+* Note that any existing tomoRecon object is automatically reconfigured the next time
 * that tomoReconCreateIDL is called, so it is often not necessary to call this function. */
 epicsShareFunc void epicsShareAPI tomoReconDeleteIDL(int argc, char *argv[])
 {
@@ -69,6 +86,144 @@ epicsShareFunc void epicsShareAPI tomoReconRunIDL(int argc, char *argv[])
   pTomoRecon->reconstruct(*numSlices, pCenter, pIn, pOut);
 }
 
+/** Function to reconstruct a list of slices from a larger input volume using the tomoRecon object created with tomoReconCreateIDL.
+ * \param[in] argc Number of parameters = 5
+ * \param[in] argv Array of pointers. <br/>
+ *            argv[0] = Pointer to a number of slices to reconstruct <br/>
+ *            argv[1] = Pointer to int array of slice indices in the input <br/>
+ *            argv[2] = Pointer to float array of rotation centers in pixels, one per slice index <br/>
+ *            argv[3] = Pointer to float array of input slices [numPixels, numSlices, numProjections] <br/>
+ *            argv[4] = Pointer to float array of output reconstructed slices [numPixels, numPixels, number of slice indices]
+ */
+epicsShareFunc void epicsShareAPI tomoReconRunSlicesIDL(int argc, char *argv[])
+{
+  int *numSlices   =   (int *)argv[0];
+  int *pSliceIndex =   (int *)argv[1];
+  float *pCenter   = (float *)argv[2];
+  char *pIn        =  (char *)argv[3];
+  char *pOut       =  (char *)argv[4];
+
+  if (pTomoRecon == 0) return;
+  pTomoRecon->reconstruct(*numSlices, pSliceIndex, pCenter, pIn, pOut);
+}
+
+/** Function to queue a chunk of slices for reconstruction without waiting for previous chunks to complete.
+ * Blocks if tomoParams.maxChunks chunks are already in flight.  The IDL input, output and center arrays must not be
+ * deleted or reused until tomoReconWaitChunkIDL reports that the chunk is complete.
+ * \param[in] argc Number of parameters = 5
+ * \param[in] argv Array of pointers. <br/>
+ *            argv[0] = Pointer to a number of slices to reconstruct <br/>
+ *            argv[1] = Pointer to float array of rotation centers in pixels <br/>
+ *            argv[2] = Pointer to float array of input slices [numPixels, numSlices, numProjections] <br/>
+ *            argv[3] = Pointer to float array of output reconstructed slices [numPixels, numPixels, numSlices] <br/>
+ *            argv[4] = Pointer to int chunkId, which is returned; -1 if there was an error */
+epicsShareFunc void epicsShareAPI tomoReconSubmitChunkIDL(int argc, char *argv[])
+{
+  int *numSlices =   (int *)argv[0];
+  float *pCenter = (float *)argv[1];
+  char *pIn      =  (char *)argv[2];
+  char *pOut     =  (char *)argv[3];
+  int *pChunkId  =   (int *)argv[4];
+
+  *pChunkId = -1;
+  if (pTomoRecon == 0) return;
+  *pChunkId = pTomoRecon->submitChunk(*numSlices, pCenter, pIn, pOut);
+}
+
+/** Function to wait for a chunk queued with tomoReconSubmitChunkIDL to complete.
+ * \param[in] argc Number of parameters = 3
+ * \param[in] argv Array of pointers. <br/>
+ *            argv[0] = Pointer to int chunkId returned by tomoReconSubmitChunkIDL <br/>
+ *            argv[1] = Pointer to float timeout in seconds; a negative value waits forever <br/>
+ *            argv[2] = Pointer to int chunkComplete; 0 if the timeout expired before the chunk completed, 1 if complete */
+epicsShareFunc void epicsShareAPI tomoReconWaitChunkIDL(int argc, char *argv[])
+{
+  int *pChunkId       =   (int *)argv[0];
+  float *pTimeout     = (float *)argv[1];
+  int *pChunkComplete =   (int *)argv[2];
+
+  if (pTomoRecon == 0) return;
+  *pChunkComplete = (pTomoRecon->waitChunk(*pChunkId, *pTimeout) == 0);
+}
+
+/** Function to cancel a reconstruction started with tomoReconRunIDL or tomoReconSubmitChunkIDL.
+ * Returns when the slices that were being reconstructed have finished; the tomoRecon object can then be used again.
+ * \param[in] argc Number of parameters = 1
+ * \param[in] argv Array of pointers. <br/>
+ *            argv[0] = Pointer to int numCancelled, which gives the number of slices that were not reconstructed. */
+epicsShareFunc void epicsShareAPI tomoReconCancelIDL(int argc, char *argv[])
+{
+  int *pNumCancelled = (int *)argv[0];
+
+  if (pTomoRecon == 0) return;
+  *pNumCancelled = pTomoRecon->cancel();
+}
+
+/** Function to estimate the memory that a tomoRecon object would use, with tomoRecon::estimateMemory.
+ * \param[in] argc Number of parameters = 3
+ * \param[in] argv Array of pointers. <br/>
+ *            argv[0] = Pointer to a tomoParams_t structure, which defines the reconstruction parameters <br/>
+ *            argv[1] = Pointer to double threadBytes, the bytes used by each thread <br/>
+ *            argv[2] = Pointer to double totalBytes, the bytes used with numThreads threads, including the input and output */
+epicsShareFunc void epicsShareAPI tomoReconEstimateMemoryIDL(int argc, char *argv[])
+{
+  tomoParams_t *pTomoParams = (tomoParams_t *)argv[0];
+  double *pThreadBytes      =       (double *)argv[1];
+  double *pTotalBytes       =       (double *)argv[2];
+
+  tomoRecon::estimateMemory(pTomoParams, pThreadBytes, pTotalBytes);
+}
+
+/** Function to reduce numThreads and numSlices in a tomoParams_t structure to fit its memoryBudget,
+ * with tomoRecon::fitMemoryBudget.
+ * \param[in] argc Number of parameters = 2
+ * \param[in] argv Array of pointers. <br/>
+ *            argv[0] = Pointer to a tomoParams_t structure, which is modified <br/>
+ *            argv[1] = Pointer to int status; 0 if the parameters fit the budget, -1 if not */
+epicsShareFunc void epicsShareAPI tomoReconFitMemoryBudgetIDL(int argc, char *argv[])
+{
+  tomoParams_t *pTomoParams = (tomoParams_t *)argv[0];
+  int *pStatus              =          (int *)argv[1];
+
+  *pStatus = tomoRecon::fitMemoryBudget(pTomoParams);
+}
+
+/** Function to find the fastest settings for a geometry and write them to the machine profile, with tomoRecon::tune.
+ * \param[in] argc Number of parameters = 4
+ * \param[in] argv Array of pointers. <br/>
+ *            argv[0] = Pointer to a tomoParams_t structure; the parameters that are 0 are swept and set to the fastest <br/>
+ *            argv[1] = Pointer to the angles array <br/>
+ *            argv[2] = Pointer to a 0 terminated byte array with the profile file name; "" uses TOMORECON_PROFILE <br/>
+ *            argv[3] = Pointer to int status; 0 if the profile was written, -1 if not */
+epicsShareFunc void epicsShareAPI tomoReconTuneIDL(int argc, char *argv[])
+{
+  tomoParams_t *pTomoParams = (tomoParams_t *)argv[0];
+  float *pAngles            =        (float *)argv[1];
+  char *profileFileName     =                 argv[2];
+  int *pStatus              =          (int *)argv[3];
+
+  *pStatus = tomoRecon::tune(pTomoParams, pAngles, profileFileName);
+}
+
+/** Function to get the reconstruction statistics of a priority class with tomoRecon::getStatistics.
+ * \param[in] argc Number of parameters = 2
+ * \param[in] argv Array of pointers. <br/>
+ *            argv[0] = Pointer to int priorityClass, PC_t <br/>
+ *            argv[1] = Pointer to a tomoReconStats_t structure (7 doubles), which is filled in */
+epicsShareFunc void epicsShareAPI tomoReconGetStatisticsIDL(int argc, char *argv[])
+{
+  int *pPriorityClass       =              (int *)argv[0];
+  tomoReconStats_t *pStats  = (tomoReconStats_t *)argv[1];
+
+  tomoRecon::getStatistics(*pPriorityClass, pStats);
+}
+
+/** Function to reset the reconstruction statistics of all priority classes with tomoRecon::resetStatistics. */
+epicsShareFunc void epicsShareAPI tomoReconResetStatisticsIDL(int argc, char *argv[])
+{
+  tomoRecon::resetStatistics();
+}
+
 /** Function to poll the status of a reconstruction started with tomoReconRunIDL.
  * \param[in] argc Number of parameters = 2
  * \param[in] argv Array of pointers. <br/>
@@ -83,4 +238,18 @@ epicsShareFunc void epicsShareAPI tomoReconPollIDL(int argc, char *argv[])
   pTomoRecon->poll(pReconComplete, pSlicesRemaining);
 }
 
+/** Function to wait for a reconstruction started with tomoReconRunIDL to complete.
+ * \param[in] argc Number of parameters = 2
+ * \param[in] argv Array of pointers. <br/>
+ *            argv[0] = Pointer to float timeout in seconds; a negative value waits forever <br/>
+ *            argv[1] = Pointer to int reconComplete; 0 if the timeout expired before the reconstruction completed, 1 if complete */
+epicsShareFunc void epicsShareAPI tomoReconWaitIDL(int argc, char *argv[])
+{
+  float *pTimeout     = (float *)argv[0];
+  int *pReconComplete =   (int *)argv[1];
+
+  if (pTomoRecon == 0) return;
+  *pReconComplete = (pTomoRecon->wait(*pTimeout) == 0);
+}
+
 } // extern "C"
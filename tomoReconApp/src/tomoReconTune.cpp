@@ -0,0 +1,382 @@
+/*
+ * tomoReconTune.cpp
+ *
+ * Functions for the machine profile of tomoRecon.
+ *
+ * tomoRecon::tune() times short reconstructions of synthetic data with different numbers of threads,
+ * padded sinogram widths, oversampling ratios and FFTW planning rigor, and writes the fastest settings for
+ * the number of pixels and projections to a profile file.  tomoRecon::applyProfile() reads the profile to
+ * fill in the parameters that are 0, so a tomoRecon object created with those parameters 0 uses the tuned settings.
+ *
+ * The profile is a text file with one line per geometry:
+ *   numPixels numProjections numThreads paddedSinogramWidth sampl fftwRigor slicesPerSecond
+ * Lines that start with # are comments.
+ *
+ * Created: October 18, 2026
+ */
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include <epicsTime.h>
+#include <epicsThread.h>
+
+#include "tomoRecon.h"
+
+/** Environment variable with the name of the profile file that is used when no file name is passed */
+static const char *profileEnvName = "TOMORECON_PROFILE";
+static const int maxProfileEntries = 256;
+/** Minimum time in seconds that each setting is timed for */
+static const double minTuneTime = 0.5;
+
+/** Structure with one line of the profile */
+typedef struct {
+  int numPixels;
+  int numProjections;
+  int numThreads;
+  int paddedSinogramWidth;
+  float sampl;
+  int fftwRigor;
+  double slicesPerSecond;
+} profileEntry_t;
+
+static const char *profileName(const char *profileFileName)
+{
+  if (profileFileName && (strlen(profileFileName) > 0)) return profileFileName;
+  return getenv(profileEnvName);
+}
+
+/** Reads the entries of a profile file.
+* \return Number of entries read, -1 if the file cannot be opened */
+static int readProfile(const char *fileName, profileEntry_t *pEntries, int maxEntries)
+{
+  FILE *file;
+  char line[256];
+  profileEntry_t *pEntry;
+  int numEntries = 0;
+
+  file = fopen(fileName, "r");
+  if (file == 0) return -1;
+  while ((numEntries < maxEntries) && fgets(line, sizeof(line), file)) {
+    if (line[0] == '#') continue;
+    pEntry = &pEntries[numEntries];
+    if (sscanf(line, "%d %d %d %d %f %d %lf", &pEntry->numPixels, &pEntry->numProjections, &pEntry->numThreads,
+               &pEntry->paddedSinogramWidth, &pEntry->sampl, &pEntry->fftwRigor, &pEntry->slicesPerSecond) != 7) continue;
+    if ((pEntry->numPixels < 1) || (pEntry->numProjections < 1)) continue;
+    numEntries++;
+  }
+  fclose(file);
+  return numEntries;
+}
+
+static int writeProfile(const char *fileName, profileEntry_t *pEntries, int numEntries)
+{
+  FILE *file;
+  profileEntry_t *pEntry;
+  int i;
+
+  file = fopen(fileName, "w");
+  if (file == 0) return -1;
+  fprintf(file, "# tomoRecon machine profile written by tomoRecon::tune on %d CPUs\n", epicsThreadGetCPUs());
+  fprintf(file, "# numPixels numProjections numThreads paddedSinogramWidth sampl fftwRigor slicesPerSecond\n");
+  for (i=0; i<numEntries; i++) {
+    pEntry = &pEntries[i];
+    fprintf(file, "%d %d %d %d %f %d %f\n", pEntry->numPixels, pEntry->numProjections, pEntry->numThreads,
+            pEntry->paddedSinogramWidth, pEntry->sampl, pEntry->fftwRigor, pEntry->slicesPerSecond);
+  }
+  fclose(file);
+  return 0;
+}
+
+/** Returns the smallest power of 2 >= width */
+static int powerOf2(double width)
+{
+  int n = 1;
+
+  while (n < width) n <<= 1;
+  return n;
+}
+
+/** Logs messages from tune(), which has no tomoRecon object to call tomoRecon::logMsg() on.
+ * Adds a time stamp and the same terminator as tomoRecon::logMsg() uses for stdout (CR LF).
+ * \param[in] pFormat Format string
+ * \param[in] ... Additional arguments for vsnprintf
+ */
+static void tuneMsg(const char *pFormat, ...)
+{
+  va_list pvar;
+  epicsTimeStamp now;
+  char nowText[40];
+  char message[256];
+
+  epicsTimeGetCurrent(&now);
+  nowText[0] = 0;
+  epicsTimeToStrftime(nowText, sizeof(nowText), "%Y/%m/%d %H:%M:%S.%03f", &now);
+  va_start(pvar, pFormat);
+  vsnprintf(message, sizeof(message), pFormat, pvar);
+  va_end(pvar);
+  printf("%s %s\r\n", nowText, message);
+  fflush(stdout);
+}
+
+/** Function to fill in the parameters that are 0 from the machine profile.
+* Uses the profile entry with the same numPixels and numProjections, or else the one with the closest size.
+* numThreads, sampl and fftwRigor are copied from the entry.  paddedSinogramWidth is the power of 2 that has
+* about the same ratio to numPixels as in the entry, and at least 2*numPixels with tomoParams_t.offsetAxis.
+* \param[in,out] pTomoParams A structure containing the tomography reconstruction parameters
+* \param[in] profileFileName Name of the profile file.  If NULL or "" the TOMORECON_PROFILE environment variable is used.
+* \return 0 if a profile entry was used, -1 if there is no profile or it has no entries */
+int tomoRecon::applyProfile(tomoParams_t *pTomoParams, const char *profileFileName)
+{
+  const char *fileName = profileName(profileFileName);
+  profileEntry_t *pEntries, *pEntry=0;
+  int numEntries, i;
+  double distance, bestDistance=0, ratio;
+  int minPadded;
+
+  if ((fileName == 0) || (pTomoParams->numPixels < 1) || (pTomoParams->numProjections < 1)) return -1;
+  if ((pTomoParams->numThreads > 0) && (pTomoParams->paddedSinogramWidth > 0) &&
+      (pTomoParams->sampl > 0) && (pTomoParams->fftwRigor != FR_Default)) return -1;
+  pEntries = (profileEntry_t *) malloc(maxProfileEntries * sizeof(profileEntry_t));
+  numEntries = readProfile(fileName, pEntries, maxProfileEntries);
+  for (i=0; i<numEntries; i++) {
+    distance = fabs(log((double)pEntries[i].numPixels / pTomoParams->numPixels)) +
+               fabs(log((double)pEntries[i].numProjections / pTomoParams->numProjections));
+    if ((pEntry == 0) || (distance < bestDistance)) {
+      pEntry = &pEntries[i];
+      bestDistance = distance;
+    }
+  }
+  if (pEntry == 0) {
+    free(pEntries);
+    return -1;
+  }
+  if (pTomoParams->numThreads == 0) pTomoParams->numThreads = pEntry->numThreads;
+  if (pTomoParams->paddedSinogramWidth == 0) {
+    ratio = (double)pEntry->paddedSinogramWidth / pEntry->numPixels;
+    minPadded = pTomoParams->offsetAxis ? 2*pTomoParams->numPixels : pTomoParams->numPixels;
+    pTomoParams->paddedSinogramWidth = powerOf2(ratio*pTomoParams->numPixels - 0.5);
+    if (pTomoParams->paddedSinogramWidth < minPadded) pTomoParams->paddedSinogramWidth = powerOf2(minPadded);
+  }
+  if (pTomoParams->sampl == 0) pTomoParams->sampl = pEntry->sampl;
+  if (pTomoParams->fftwRigor == FR_Default) pTomoParams->fftwRigor = pEntry->fftwRigor;
+  free(pEntries);
+  return 0;
+}
+
+/** Fills the input with projections of a cylinder that fills 2/3 of the field of view */
+static void syntheticInput(tomoParams_t *pTomoParams, char *pInput, size_t inputBytes)
+{
+  int numPixels = pTomoParams->numPixels;
+  size_t numRows = (size_t)pTomoParams->numSlices * pTomoParams->numProjections;
+  float *pRow = (float *) malloc(numPixels * sizeof(float));
+  double radius = numPixels/3., x, chord;
+  size_t row;
+  int i;
+
+  for (i=0; i<numPixels; i++) {
+    x = i - numPixels/2.;
+    chord = (fabs(x) < radius) ? 2*sqrt(radius*radius - x*x) : 0;
+    pRow[i] = (float)exp(-0.5*chord/radius);
+  }
+  for (row=0; row<numRows; row++) {
+    for (i=0; i<numPixels; i++) {
+      switch (pTomoParams->inputDataType) {
+        case IDT_Float32:
+          ((epicsFloat32 *)pInput)[row*numPixels + i] = pRow[i];
+          break;
+        case IDT_UInt16:
+          ((epicsUInt16 *)pInput)[row*numPixels + i] = (epicsUInt16)(pRow[i]*60000);
+          break;
+        case IDT_UInt8:
+          ((epicsUInt8 *)pInput)[row*numPixels + i] = (epicsUInt8)(pRow[i]*250);
+          break;
+      }
+    }
+  }
+  // Packed pixels are all 0x808, which is enough to time the reconstruction
+  if (pTomoParams->inputDataType == IDT_UInt12Packed) memset(pInput, 0x80, inputBytes);
+  free(pRow);
+}
+
+/** Times reconstructions of numSlices synthetic slices with a new tomoRecon object.
+* A first reconstruction of 2*numThreads slices creates the grid objects and is not timed.  The numSlices slices
+* are then reconstructed repeatedly for at least minTuneTime seconds.
+* \return Slices per second */
+static double timeReconstruction(tomoParams_t *pTomoParams, float *pAngles, float *center, char *pInput, char *pOutput,
+                                 double *pCreateTime)
+{
+  tomoRecon *pTomoRecon;
+  epicsTimeStamp tStart, tCreated, tEnd;
+  int warmupSlices = 2*pTomoParams->numThreads;
+  double numTimed = 0, elapsed;
+
+  if (warmupSlices > pTomoParams->numSlices) warmupSlices = pTomoParams->numSlices;
+  epicsTimeGetCurrent(&tStart);
+  pTomoRecon = new tomoRecon(pTomoParams, pAngles);
+  pTomoRecon->reconstruct(warmupSlices, center, pInput, pOutput);
+  pTomoRecon->wait(-1);
+  epicsTimeGetCurrent(&tCreated);
+  do {
+    pTomoRecon->reconstruct(pTomoParams->numSlices, center, pInput, pOutput);
+    pTomoRecon->wait(-1);
+    numTimed += pTomoParams->numSlices;
+    epicsTimeGetCurrent(&tEnd);
+    elapsed = epicsTimeDiffInSeconds(&tEnd, &tCreated);
+  } while (elapsed < minTuneTime);
+  delete pTomoRecon;
+  *pCreateTime = epicsTimeDiffInSeconds(&tCreated, &tStart);
+  return numTimed / elapsed;
+}
+
+/** Function to find the fastest settings for a geometry on this machine and write them to the machine profile.
+* Reconstructs synthetic data with the numPixels, numProjections, angles, input and output types and Gridrec parameters
+* of pTomoParams.  Each parameter that is 0 is swept: first fftwRigor, sampl and paddedSinogramWidth with as many threads
+* as CPUs, then numThreads with the fastest of those.  Parameters that are not 0 are kept, so sampl should be set if
+* the oversampling ratio matters for the image quality, because smaller ratios are faster.
+* Each setting reconstructs 4*numThreads slices repeatedly for at least 0.5 seconds, after 2*numThreads untimed slices
+* that create the grid objects.
+* The entry for numPixels and numProjections in the profile is replaced, the others are kept.
+* The time for each setting is only printed if tomoParams_t.debug is set; the fastest settings and errors are always printed.
+* \param[in,out] pTomoParams A structure containing the tomography reconstruction parameters.
+*                The parameters that were 0 are set to the fastest settings.
+* \param[in] pAngles Array of projection angles in degrees
+* \param[in] profileFileName Name of the profile file.  If NULL or "" the TOMORECON_PROFILE environment variable is used.
+* \return 0 if the profile was written, -1 on error */
+int tomoRecon::tune(tomoParams_t *pTomoParams, float *pAngles, const char *profileFileName)
+{
+  const char *fileName = profileName(profileFileName);
+  static const int rigors[] = {FR_Estimate, FR_Measure, FR_Patient};
+  static const float sampls[] = {1.0f, 1.2f, 1.4f};
+  tomoParams_t params = *pTomoParams;
+  tomoParams_t best;
+  profileEntry_t *pEntries, entry;
+  int numCpus = epicsThreadGetCPUs();
+  int debug = pTomoParams->debug;
+  int maxThreads, numThreads, minPadded, numEntries, i, j, k;
+  int numRigors, numSampls, numPadded, padded[2];
+  double inputBytes, outputBytes, slicesPerSecond, bestSlicesPerSecond=0, createTime;
+  float *center;
+  char *pInput, *pOutput;
+  static const char *functionName="tomoRecon::tune";
+
+  if (fileName == 0) {
+    tuneMsg("%s: error, no profile file name and %s is not set", functionName, profileEnvName);
+    return -1;
+  }
+  maxThreads = (params.numThreads > 0) ? params.numThreads : numCpus;
+  if (maxThreads > tomoThreadPool::maxWorkers) maxThreads = tomoThreadPool::maxWorkers;
+  switch (params.inputDataType) {
+    case IDT_UInt16:       inputBytes = 2;   break;
+    case IDT_UInt8:        inputBytes = 1;   break;
+    case IDT_UInt12Packed: inputBytes = 1.5; break;
+    default:               inputBytes = 4;
+  }
+  params.numSlices = 4*maxThreads;
+  params.debug = 0;
+  params.debugFileName[0] = 0;
+  params.maxChunks = 1;
+  params.gridCacheSize = 1;
+  inputBytes *= (double)params.numPixels*params.numSlices*params.numProjections;
+  outputBytes = (params.outputDataType == ODT_Float32) ? 4 : 2;
+  outputBytes *= (params.offsetAxis ? 4. : 1.)*params.numPixels*params.numPixels*params.numSlices;
+  pInput = (char *) malloc((size_t)inputBytes);
+  pOutput = (char *) malloc((size_t)outputBytes);
+  center = (float *) malloc(params.numSlices * sizeof(float));
+  if ((pInput == 0) || (pOutput == 0) || (center == 0)) {
+    tuneMsg("%s: error allocating %f MB for the synthetic data", functionName, (inputBytes + outputBytes)/1024./1024.);
+    free(pInput);
+    free(pOutput);
+    free(center);
+    return -1;
+  }
+  syntheticInput(&params, pInput, (size_t)inputBytes);
+  for (i=0; i<params.numSlices; i++) center[i] = params.numPixels/2.f;
+
+  minPadded = params.offsetAxis ? 2*params.numPixels : params.numPixels;
+  numPadded = 1;
+  padded[0] = params.paddedSinogramWidth;
+  if (params.paddedSinogramWidth == 0) {
+    padded[0] = powerOf2(minPadded);
+    padded[1] = 2*padded[0];
+    numPadded = 2;
+  }
+  numRigors = (params.fftwRigor == FR_Default) ? 3 : 1;
+  numSampls = (params.sampl == 0) ? 3 : 1;
+
+  // Sweep the FFT settings with maxThreads threads
+  params.numThreads = maxThreads;
+  best = params;
+  for (i=0; i<numRigors; i++) {
+    for (j=0; j<numSampls; j++) {
+      for (k=0; k<numPadded; k++) {
+        if (numRigors > 1) params.fftwRigor = rigors[i];
+        if (numSampls > 1) params.sampl = sampls[j];
+        params.paddedSinogramWidth = padded[k];
+        slicesPerSecond = timeReconstruction(&params, pAngles, center, pInput, pOutput, &createTime);
+        if (debug) {
+          tuneMsg("%s: numThreads=%d, paddedSinogramWidth=%d, sampl=%f, fftwRigor=%d, create time=%f, slices/s=%f",
+                  functionName, params.numThreads, params.paddedSinogramWidth, params.sampl, params.fftwRigor,
+                  createTime, slicesPerSecond);
+        }
+        if (slicesPerSecond > bestSlicesPerSecond) {
+          bestSlicesPerSecond = slicesPerSecond;
+          best = params;
+        }
+      }
+    }
+  }
+
+  // Sweep numThreads over the powers of 2 below maxThreads with the fastest FFT settings
+  if (pTomoParams->numThreads == 0) {
+    params = best;
+    for (numThreads=1; numThreads<maxThreads; numThreads*=2) {
+      params.numThreads = numThreads;
+      params.numSlices = 4*numThreads;
+      slicesPerSecond = timeReconstruction(&params, pAngles, center, pInput, pOutput, &createTime);
+      if (debug) {
+        tuneMsg("%s: numThreads=%d, create time=%f, slices/s=%f", functionName, numThreads, createTime, slicesPerSecond);
+      }
+      if (slicesPerSecond > bestSlicesPerSecond) {
+        bestSlicesPerSecond = slicesPerSecond;
+        best = params;
+      }
+    }
+  }
+  free(pInput);
+  free(pOutput);
+  free(center);
+
+  entry.numPixels = params.numPixels;
+  entry.numProjections = params.numProjections;
+  entry.numThreads = best.numThreads;
+  entry.paddedSinogramWidth = best.paddedSinogramWidth;
+  entry.sampl = best.sampl;
+  entry.fftwRigor = best.fftwRigor;
+  entry.slicesPerSecond = bestSlicesPerSecond;
+  tuneMsg("%s: fastest numThreads=%d, paddedSinogramWidth=%d, sampl=%f, fftwRigor=%d, slices/s=%f", functionName,
+          entry.numThreads, entry.paddedSinogramWidth, entry.sampl, entry.fftwRigor, entry.slicesPerSecond);
+
+  pEntries = (profileEntry_t *) malloc((maxProfileEntries + 1) * sizeof(profileEntry_t));
+  numEntries = readProfile(fileName, pEntries, maxProfileEntries);
+  if (numEntries < 0) numEntries = 0;
+  for (i=0; i<numEntries; i++) {
+    if ((pEntries[i].numPixels == entry.numPixels) && (pEntries[i].numProjections == entry.numProjections)) break;
+  }
+  pEntries[i] = entry;
+  if (i == numEntries) numEntries++;
+  if (writeProfile(fileName, pEntries, numEntries)) {
+    tuneMsg("%s: error writing profile file %s", functionName, fileName);
+    free(pEntries);
+    return -1;
+  }
+  free(pEntries);
+
+  pTomoParams->numThreads = best.numThreads;
+  pTomoParams->paddedSinogramWidth = best.paddedSinogramWidth;
+  pTomoParams->sampl = best.sampl;
+  pTomoParams->fftwRigor = best.fftwRigor;
+  return 0;
+}
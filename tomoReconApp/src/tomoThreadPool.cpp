@@ -0,0 +1,365 @@
+/*
+ * tomoThreadPool.cpp
+ *
+ * C++ class for a process-wide pool of worker threads that is shared by tomoRecon and tomoPreprocess.
+ *
+ * Each worker thread has its own queue of tasks.  A worker runs the tasks in its own queue first, and when that
+ * is empty it steals tasks from the other workers, so all workers stay busy while there is work to do.
+ * There is a queue for each priority class, and the queues of a higher class are always tried first.
+ *
+ * It uses the EPICS libCom library for OS-independent functions for threads, mutexes, events, etc.
+ *
+ * Created: October 18, 2026
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#include <epicsThread.h>
+#include <epicsAtomic.h>
+
+#include "tomoThreadPool.h"
+
+/** Structure that is used to create a pool worker thread.  This is the structure passed to epicsThreadCreate() */
+typedef struct {
+  tomoThreadPool *pPool;  /**< Pointer to the tomoThreadPool object */
+  int workerNum;          /**< Worker number that is passed to tomoThreadPool::workerTask */
+} poolWorkerCreateStruct;
+
+static tomoThreadPool *pThreadPool = 0;
+static epicsThreadOnceId threadPoolOnce = EPICS_THREAD_ONCE_INIT;
+
+extern "C" {
+static void createThreadPool(void *pPvt)
+{
+  pThreadPool = new tomoThreadPool();
+}
+
+static void poolWorkerTask(void *pPvt)
+{
+  poolWorkerCreateStruct *pPWCS = (poolWorkerCreateStruct *)pPvt;
+  pPWCS->pPool->workerTask(pPWCS->workerNum);
+  free(pPWCS);
+}
+} // extern "C"
+
+
+/** Returns the process-wide thread pool, creating it the first time it is called.
+* \param[in] numThreads Number of threads the caller wants to use.  If the pool has fewer threads
+*            it creates more, up to maxWorkers.
+* \param[in] pinThreads If 1 the pool threads are pinned to CPUs with pinWorkers().  Once the threads
+*            are pinned they stay pinned for the life of the process. */
+tomoThreadPool* tomoThreadPool::getPool(int numThreads, int pinThreads)
+{
+  epicsThreadOnce(&threadPoolOnce, createThreadPool, 0);
+  pThreadPool->addWorkers(numThreads);
+  if (pinThreads) pThreadPool->pinWorkers();
+  return pThreadPool;
+}
+
+/** Returns the mutex that must be held while FFTW plans are created or destroyed.
+* The FFTW planner is not thread safe, and the tomoRecon and tomoPreprocess objects that share the pool create their
+* plans on the pool threads, so they all use this one mutex.  The plans share the FFTW wisdom of the process, so only
+* the first plan of each size is measured. */
+epicsMutexId tomoThreadPool::fftwMutex()
+{
+  epicsThreadOnce(&threadPoolOnce, createThreadPool, 0);
+  return pThreadPool->fftwMutex_;
+}
+
+/** Constructor for the tomoThreadPool class.
+* Normally the process-wide pool returned by getPool() is used rather than creating another one.
+* The worker threads are created by addWorkers(). */
+tomoThreadPool::tomoThreadPool()
+  : numWorkers_(0),
+    pinThreads_(0),
+    numCpus_(0),
+    nextWorker_(0),
+    pendingTasks_(0),
+    numIdle_(0)
+{
+  int i;
+
+  for (i=0; i<maxWorkers; i++) {
+    workerPinned_[i] = 0;
+    workerNodes_[i] = 0;
+  }
+  for (i=0; i<numClasses; i++) {
+    classTasks_[i] = 0;
+  }
+  mutex_ = epicsMutexCreate();
+  fftwMutex_ = epicsMutexCreate();
+  findCpus();
+}
+
+/** Finds the CPUs that the workers are pinned to and their NUMA nodes.
+* On Linux the CPUs of each node are read from /sys/devices/system/node.  The CPUs are ordered so that
+* consecutive entries are on different nodes, in turn.  If the nodes cannot be read all CPUs are on node 0. */
+void tomoThreadPool::findCpus()
+{
+  static const int maxNodes = 64;
+  int cpu[maxCpus], node[maxCpus], rank[maxCpus];
+  int n=0, first, last, c, i, r, nodeNum, numNodeCpus;
+#ifdef __linux__
+  char fileName[64];
+  char line[4096];
+  char *p;
+  FILE *fp;
+
+  for (nodeNum=0; nodeNum<maxNodes; nodeNum++) {
+    sprintf(fileName, "/sys/devices/system/node/node%d/cpulist", nodeNum);
+    fp = fopen(fileName, "r");
+    if (fp == 0) continue;
+    p = fgets(line, sizeof(line), fp);
+    fclose(fp);
+    numNodeCpus = 0;
+    // The list is ranges of CPUs separated by commas, e.g. 0-13,28-41.  Nodes with only memory have an empty list.
+    while (p && isdigit(*p)) {
+      first = strtol(p, &p, 10);
+      last = first;
+      if (*p == '-') last = strtol(p+1, &p, 10);
+      for (c=first; (c<=last) && (n<maxCpus); c++) {
+        cpu[n] = c;
+        node[n] = nodeNum;
+        rank[n] = numNodeCpus++;
+        n++;
+      }
+      if (*p != ',') break;
+      p++;
+    }
+  }
+#endif
+  if (n == 0) {
+    n = epicsThreadGetCPUs();
+    if (n > maxCpus) n = maxCpus;
+    for (c=0; c<n; c++) {
+      cpu[c] = c;
+      node[c] = 0;
+      rank[c] = c;
+    }
+  }
+  // Take the first CPU of each node, then the second CPU of each node, etc.
+  numCpus_ = 0;
+  for (r=0; numCpus_<n; r++) {
+    for (i=0; i<n; i++) {
+      if (rank[i] != r) continue;
+      cpus_[numCpus_] = cpu[i];
+      cpuNodes_[numCpus_] = node[i];
+      numCpus_++;
+    }
+  }
+}
+
+/** Creates worker threads until the pool has numThreads threads.
+* \param[in] numThreads Number of threads the pool should have */
+void tomoThreadPool::addWorkers(int numThreads)
+{
+  char workerTaskName[32];
+  epicsThreadId workerTaskId;
+  poolWorkerCreateStruct *pPWCS;
+  int first, i;
+  static const char *functionName="tomoThreadPool::addWorkers";
+
+  if (numThreads > maxWorkers) numThreads = maxWorkers;
+  epicsMutexLock(mutex_);
+  first = numWorkers_;
+  if (numThreads <= first) {
+    epicsMutexUnlock(mutex_);
+    return;
+  }
+  // The queues must exist before numWorkers_ is increased, because other workers then start stealing from them
+  for (i=first; i<numThreads; i++) {
+    taskMutexes_[i] = epicsMutexCreate();
+    wakeEvents_[i] = epicsEventCreate(epicsEventEmpty);
+  }
+  numWorkers_ = numThreads;
+  epicsMutexUnlock(mutex_);
+
+  for (i=first; i<numThreads; i++) {
+    sprintf(workerTaskName, "tomoPool%d", i);
+    pPWCS = (poolWorkerCreateStruct *)malloc(sizeof(poolWorkerCreateStruct));
+    pPWCS->pPool = this;
+    pPWCS->workerNum = i;
+    workerTaskId = epicsThreadCreate(workerTaskName,
+                       epicsThreadPriorityMedium,
+                       epicsThreadGetStackSize(epicsThreadStackMedium),
+                       (EPICSTHREADFUNC) ::poolWorkerTask,
+                       pPWCS);
+    if (workerTaskId == 0) {
+      printf("%s: epicsThreadCreate failure for worker %d\n", functionName, i);
+    }
+  }
+}
+
+/** Requests that all worker threads, including those created later, pin themselves to a CPU.
+* Worker N is pinned to the N'th CPU found by findCpus(), so consecutive workers are on different NUMA nodes.
+* Each worker pins itself before it runs its next task. */
+void tomoThreadPool::pinWorkers()
+{
+  epicsMutexLock(mutex_);
+  pinThreads_ = 1;
+  epicsMutexUnlock(mutex_);
+}
+
+/** Pins the calling worker thread to its CPU.  This is only done on Linux; on other systems the worker is not
+* pinned but is still marked as pinned.
+* \param[in] workerNum Worker number of the calling thread */
+void tomoThreadPool::pinWorker(int workerNum)
+{
+  int i = workerNum % numCpus_;
+  static const char *functionName="tomoThreadPool::pinWorker";
+
+#ifdef __linux__
+  cpu_set_t cpuSet;
+  CPU_ZERO(&cpuSet);
+  CPU_SET(cpus_[i], &cpuSet);
+  if (pthread_setaffinity_np(pthread_self(), sizeof(cpuSet), &cpuSet) != 0) {
+    printf("%s: error pinning worker %d to CPU %d\n", functionName, workerNum, cpus_[i]);
+  }
+#endif
+  workerNodes_[workerNum] = cpuNodes_[i];
+  workerPinned_[workerNum] = 1;
+}
+
+/** Returns the number of worker threads in the pool */
+int tomoThreadPool::numWorkers()
+{
+  return numWorkers_;
+}
+
+/** Returns the NUMA node of a worker thread.  This is 0 until the worker is pinned.
+* \param[in] workerNum Worker number */
+int tomoThreadPool::workerNode(int workerNum)
+{
+  return workerNodes_[workerNum];
+}
+
+/** Submits a task to be run by the pool.
+* Wakes an idle worker if there is one; the task is run by the worker whose queue it is on, or stolen by another worker.
+* The task is put on the queue for its tomoPoolTask::priorityClass().
+* \param[in] pTask Task to run
+* \param[in] workerNum Worker whose queue the task is put on.  Tasks that submit follow-on work pass the workerNum
+*            they were called with, so the work stays on that worker unless another worker is idle.
+*            If -1 the queues are used in turn. */
+void tomoThreadPool::submit(tomoPoolTask *pTask, int workerNum)
+{
+  epicsEventId wakeEvent = 0;
+  int priorityClass = pTask->priorityClass();
+  int i;
+
+  if (priorityClass < 0) priorityClass = 0;
+  if (priorityClass >= numClasses) priorityClass = numClasses-1;
+  epicsMutexLock(mutex_);
+  if ((workerNum < 0) || (workerNum >= numWorkers_)) {
+    workerNum = nextWorker_;
+    nextWorker_ = (nextWorker_ + 1) % numWorkers_;
+  }
+  epicsMutexUnlock(mutex_);
+
+  epicsMutexLock(taskMutexes_[workerNum]);
+  tasks_[priorityClass][workerNum].push_back(pTask);
+  epicsMutexUnlock(taskMutexes_[workerNum]);
+
+  epicsMutexLock(mutex_);
+  pendingTasks_++;
+  classTasks_[priorityClass]++;
+  // Wake the worker that owns the queue if it is idle, otherwise any idle worker, which will steal the task
+  if (numIdle_ > 0) {
+    for (i=0; i<numIdle_-1; i++) {
+      if (idleWorkers_[i] == workerNum) break;
+    }
+    wakeEvent = wakeEvents_[idleWorkers_[i]];
+    idleWorkers_[i] = idleWorkers_[--numIdle_];
+  }
+  epicsMutexUnlock(mutex_);
+  if (wakeEvent) epicsEventSignal(wakeEvent);
+}
+
+/** Takes a task from a worker's queue.
+* \param[in] workerNum Worker that wants a task
+* \param[in] victim Worker whose queue is used.  If this is workerNum the oldest task is taken, otherwise the newest.
+* \param[in] priorityClass Priority class of the queue
+* \return The task, or NULL if the queue is empty */
+tomoPoolTask* tomoThreadPool::takeTask(int workerNum, int victim, int priorityClass)
+{
+  std::deque<tomoPoolTask *> *pTasks = &tasks_[priorityClass][victim];
+  tomoPoolTask *pTask = 0;
+
+  epicsMutexLock(taskMutexes_[victim]);
+  if (!pTasks->empty()) {
+    if (victim == workerNum) {
+      pTask = pTasks->front();
+      pTasks->pop_front();
+    } else {
+      pTask = pTasks->back();
+      pTasks->pop_back();
+    }
+  }
+  epicsMutexUnlock(taskMutexes_[victim]);
+  return pTask;
+}
+
+/** Gets the next task for a worker.
+* Starting with the highest priority class, takes the oldest task from the worker's own queue, or if that is empty
+* steals the newest task from another worker, trying the workers on the same NUMA node first.
+* \param[in] workerNum Worker that wants a task
+* \return The task, or NULL if all queues are empty */
+tomoPoolTask* tomoThreadPool::getTask(int workerNum)
+{
+  tomoPoolTask *pTask = 0;
+  int i, victim, priorityClass;
+  int numWorkers = numWorkers_;
+  int node = workerNodes_[workerNum];
+
+  for (priorityClass=numClasses-1; priorityClass>=0; priorityClass--) {
+    // The count is only a hint; a task that is missed here is found when the worker checks pendingTasks_ before going idle
+    if (epicsAtomicGetIntT(&classTasks_[priorityClass]) == 0) continue;
+    pTask = takeTask(workerNum, workerNum, priorityClass);
+    for (i=1; (i<numWorkers) && !pTask; i++) {
+      victim = (workerNum + i) % numWorkers;
+      if (workerNodes_[victim] == node) pTask = takeTask(workerNum, victim, priorityClass);
+    }
+    for (i=1; (i<numWorkers) && !pTask; i++) {
+      victim = (workerNum + i) % numWorkers;
+      if (workerNodes_[victim] != node) pTask = takeTask(workerNum, victim, priorityClass);
+    }
+    if (pTask) break;
+  }
+  if (pTask) {
+    epicsMutexLock(mutex_);
+    pendingTasks_--;
+    classTasks_[priorityClass]--;
+    epicsMutexUnlock(mutex_);
+  }
+  return pTask;
+}
+
+/** Worker task that runs as a separate thread.  There are numWorkers() of these.
+* Runs tasks until all queues are empty, then waits to be woken by submit().
+* \param[in] workerNum Worker number (0 to numWorkers()-1) for this thread. */
+void tomoThreadPool::workerTask(int workerNum)
+{
+  tomoPoolTask *pTask;
+
+  while (1) {
+    if (pinThreads_ && !workerPinned_[workerNum]) pinWorker(workerNum);
+    pTask = getTask(workerNum);
+    if (pTask) {
+      pTask->run(workerNum);
+      continue;
+    }
+    // Only go idle if no task was submitted since the queues were checked, otherwise its wake up could be missed
+    epicsMutexLock(mutex_);
+    if (pendingTasks_ > 0) {
+      epicsMutexUnlock(mutex_);
+      continue;
+    }
+    idleWorkers_[numIdle_++] = workerNum;
+    epicsMutexUnlock(mutex_);
+    epicsEventWait(wakeEvents_[workerNum]);
+  }
+}
@@ -0,0 +1,94 @@
+/*
+ * tomoThreadPool.h
+ *
+ * C++ class for a process-wide pool of worker threads that is shared by tomoRecon and tomoPreprocess.
+ *
+ * Each worker thread has its own queue of tasks.  A worker runs the tasks in its own queue first, and when that
+ * is empty it steals tasks from the other workers, so all workers stay busy while there is work to do.
+ * There is a queue for each priority class, and the queues of a higher class are always tried first.
+ *
+ * It uses the EPICS libCom library for OS-independent functions for threads, mutexes, events, etc.
+ *
+ * Created: October 18, 2026
+ */
+
+#ifndef tomoThreadPoolH
+#define tomoThreadPoolH
+
+#include <deque>
+
+#include <epicsEvent.h>
+#include <epicsMutex.h>
+
+/** Priority classes of the tasks run by tomoThreadPool.  A worker always runs a queued task of a higher class first.
+* Running tasks are not interrupted, so a task waits at most for one task of a lower class to finish. */
+typedef enum {
+  PC_Batch,         /**< Bulk work; the default */
+  PC_Interactive    /**< Short interactive work, such as reconstructing one slice to check the rotation center */
+} PC_t;
+
+/** Base class for the tasks that are run by tomoThreadPool.
+* The pool does not take ownership of the task, and the same task may be submitted more than once. */
+class tomoPoolTask {
+public:
+  virtual ~tomoPoolTask() {}
+  /** Function that the pool calls to run the task.
+  * \param[in] workerNum Number of the pool worker thread that is running the task, 0 to tomoThreadPool::maxWorkers-1 */
+  virtual void run(int workerNum) = 0;
+  /** Function that the pool calls when the task is submitted to get its priority class.
+  * \return PC_t priority class */
+  virtual int priorityClass() { return PC_Batch; }
+};
+
+/** Process-wide pool of worker threads with per-worker task queues and work stealing.
+* The threads are created the first time they are needed and are never destroyed, so they stay warm across
+* tomoRecon and tomoPreprocess objects.  The pool grows to the largest number of threads that has been requested.
+* Objects that share the pool therefore share its threads, rather than each creating its own threads and
+* oversubscribing the cores.
+* The threads can optionally be pinned to CPUs.  Consecutive workers are then placed on different NUMA nodes,
+* so a few threads already use all of the sockets, and an idle worker steals from workers on its own node first.
+* Buffers that a task allocates and first touches on a pinned worker thread are therefore local to that node.
+*/
+class tomoThreadPool {
+public:
+  tomoThreadPool();
+  static tomoThreadPool *getPool(int numThreads, int pinThreads=0);
+  static epicsMutexId fftwMutex();
+  void addWorkers(int numThreads);
+  void pinWorkers();
+  void submit(tomoPoolTask *pTask, int workerNum=-1);
+  int numWorkers();
+  int workerNode(int workerNum);
+  void workerTask(int workerNum);
+  /** Maximum number of worker threads in the pool */
+  static const int maxWorkers = 256;
+  /** Maximum number of CPUs that workers are pinned to */
+  static const int maxCpus = 1024;
+  /** Number of priority classes, PC_t */
+  static const int numClasses = 2;
+
+private:
+  void findCpus();
+  void pinWorker(int workerNum);
+  tomoPoolTask *getTask(int workerNum);
+  tomoPoolTask *takeTask(int workerNum, int victim, int priorityClass);
+  int numWorkers_;
+  int pinThreads_;
+  int numCpus_;
+  int cpus_[maxCpus];
+  int cpuNodes_[maxCpus];
+  int workerPinned_[maxWorkers];
+  int workerNodes_[maxWorkers];
+  int nextWorker_;
+  int pendingTasks_;
+  int classTasks_[numClasses];
+  int numIdle_;
+  int idleWorkers_[maxWorkers];
+  std::deque<tomoPoolTask *> tasks_[numClasses][maxWorkers];
+  epicsMutexId taskMutexes_[maxWorkers];
+  epicsEventId wakeEvents_[maxWorkers];
+  epicsMutexId mutex_;
+  epicsMutexId fftwMutex_;
+};
+
+#endif